@@ -1,17 +1,37 @@
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <pthread.h>
 #include <regex>
 #include <stdexcept>
 #include <thread>
 #include <vector>
 
+#if defined(__has_include)
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#if defined(_POSIX_VERSION)
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+#if defined(_POSIX_MAPPED_FILES)
+#include <sys/mman.h>
+#endif
+#endif
+#endif
+
 #include "clip_android.h"
+#include "ggml/ggml-alloc.h"
 #include "ggml/ggml.h"
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -57,6 +77,17 @@ static std::string format(const char * fmt, ...) {
 #define KEY_IMAGE_MEAN "clip.vision.image_mean"
 #define KEY_IMAGE_STD "clip.vision.image_std"
 
+// weight cache, see clip_cache_write()
+#define KEY_CACHE_VERSION "clip.cache.version"
+#define KEY_CACHE_SOURCE_SIZE "clip.cache.source_size"
+#define KEY_CACHE_SOURCE_MTIME "clip.cache.source_mtime"
+#define KEY_CACHE_SOURCE_META_SIZE "clip.cache.source_meta_size"
+#define KEY_CACHE_SOURCE_CHECKSUM "clip.cache.source_checksum"
+#define KEY_CACHE_SOURCE_DATA_CHECKSUM "clip.cache.source_data_checksum"
+#define KEY_CACHE_VOCAB_ORDER "clip.cache.vocab_order"
+
+#define CLIP_CACHE_VERSION 3
+
 //
 // tensor name constants
 //
@@ -68,6 +99,7 @@ static std::string format(const char * fmt, ...) {
 #define TN_ATTN_K "%s.blk.%d.attn_k.%s"
 #define TN_ATTN_Q "%s.blk.%d.attn_q.%s"
 #define TN_ATTN_V "%s.blk.%d.attn_v.%s"
+#define TN_ATTN_QKV "%s.blk.%d.attn_qkv.%s"
 #define TN_ATTN_OUTPUT "%s.blk.%d.attn_out.%s"
 #define TN_FFN_DOWN "%s.blk.%d.ffn_down.%s"
 #define TN_FFN_UP "%s.blk.%d.ffn_up.%s"
@@ -170,6 +202,10 @@ struct clip_layer {
     struct ggml_tensor * v_w;
     struct ggml_tensor * v_b;
 
+    // q, k and v stacked in that order, NULL unless they were loaded as views of these
+    struct ggml_tensor * qkv_w = NULL;
+    struct ggml_tensor * qkv_b = NULL;
+
     struct ggml_tensor * o_w;
     struct ggml_tensor * o_b;
 
@@ -190,7 +226,7 @@ struct clip_layer {
 };
 
 struct clip_text_model {
-    struct clip_text_hparams hparams;
+    struct clip_text_hparams hparams = {};
 
     // embeddings
     struct ggml_tensor * token_embeddings;
@@ -205,7 +241,7 @@ struct clip_text_model {
 };
 
 struct clip_vision_model {
-    struct clip_vision_hparams hparams;
+    struct clip_vision_hparams hparams = {};
 
     // embeddings
     struct ggml_tensor * class_embedding;
@@ -223,620 +259,2133 @@ struct clip_vision_model {
     struct ggml_tensor * projection;
 };
 
+// a weight of the model and the field it is bound to
+struct clip_tensor_slot {
+    std::string name;
+    struct ggml_tensor ** tensor;
+};
+
+static void clip_layer_tensors(const char * prefix, const int il, clip_layer & layer,
+                               std::vector<clip_tensor_slot> & slots) {
+    slots.push_back({format(TN_LN_1, prefix, il, "weight"), &layer.ln_1_w});
+    slots.push_back({format(TN_LN_1, prefix, il, "bias"), &layer.ln_1_b});
+    slots.push_back({format(TN_ATTN_Q, prefix, il, "weight"), &layer.q_w});
+    slots.push_back({format(TN_ATTN_K, prefix, il, "weight"), &layer.k_w});
+    slots.push_back({format(TN_ATTN_V, prefix, il, "weight"), &layer.v_w});
+    slots.push_back({format(TN_ATTN_Q, prefix, il, "bias"), &layer.q_b});
+    slots.push_back({format(TN_ATTN_K, prefix, il, "bias"), &layer.k_b});
+    slots.push_back({format(TN_ATTN_V, prefix, il, "bias"), &layer.v_b});
+    slots.push_back({format(TN_ATTN_OUTPUT, prefix, il, "weight"), &layer.o_w});
+    slots.push_back({format(TN_ATTN_OUTPUT, prefix, il, "bias"), &layer.o_b});
+    slots.push_back({format(TN_LN_2, prefix, il, "weight"), &layer.ln_2_w});
+    slots.push_back({format(TN_LN_2, prefix, il, "bias"), &layer.ln_2_b});
+    slots.push_back({format(TN_FFN_DOWN, prefix, il, "weight"), &layer.ff_i_w});
+    slots.push_back({format(TN_FFN_DOWN, prefix, il, "bias"), &layer.ff_i_b});
+    slots.push_back({format(TN_FFN_UP, prefix, il, "weight"), &layer.ff_o_w});
+    slots.push_back({format(TN_FFN_UP, prefix, il, "bias"), &layer.ff_o_b});
+}
+
+// The weights of a tower in the order the encoder uses them, for hparams.n_layer layers. A weight cache stores them
+// in this order, so a cached model binds them by position instead of looking each one up by name, and the q, k and v
+// projections of a layer are stored back to back, so their stacked tensors are used in place.
+static void clip_text_tensors(clip_text_model & model, std::vector<clip_tensor_slot> & slots) {
+    model.layers.resize(model.hparams.n_layer);
+
+    slots.push_back({format(TN_TOKEN_EMBD, "t"), &model.token_embeddings});
+    slots.push_back({format(TN_POS_EMBD, "t"), &model.position_embeddings});
+    for (int il = 0; il < model.hparams.n_layer; ++il) {
+        clip_layer_tensors("t", il, model.layers[il], slots);
+    }
+    slots.push_back({format(TN_LN_POST, "t", "weight"), &model.post_ln_w});
+    slots.push_back({format(TN_LN_POST, "t", "bias"), &model.post_ln_b});
+    slots.push_back({TN_TEXT_PROJ, &model.projection});
+}
+
+static void clip_vision_tensors(clip_vision_model & model, std::vector<clip_tensor_slot> & slots) {
+    model.layers.resize(model.hparams.n_layer);
+
+    slots.push_back({TN_PATCH_EMBD, &model.patch_embeddings});
+    slots.push_back({TN_CLASS_EMBD, &model.class_embedding});
+    slots.push_back({format(TN_POS_EMBD, "v"), &model.position_embeddings});
+    slots.push_back({format(TN_LN_PRE, "v", "weight"), &model.pre_ln_w});
+    slots.push_back({format(TN_LN_PRE, "v", "bias"), &model.pre_ln_b});
+    for (int il = 0; il < model.hparams.n_layer; ++il) {
+        clip_layer_tensors("v", il, model.layers[il], slots);
+    }
+    slots.push_back({format(TN_LN_POST, "v", "weight"), &model.post_ln_w});
+    slots.push_back({format(TN_LN_POST, "v", "bias"), &model.post_ln_b});
+    slots.push_back({TN_VIS_PROJ, &model.projection});
+}
+
+// When name is the weight or bias of a q, k or v projection, the name of the tensor the three are stacked into and
+// the position of this one in it.
+static bool clip_qkv_part(const std::string & name, std::string & qkv_name, int & part) {
+    static const char * parts[] = {".attn_q.", ".attn_k.", ".attn_v."};
+    for (int i = 0; i < 3; ++i) {
+        const size_t pos = name.find(parts[i]);
+        if (pos != std::string::npos) {
+            qkv_name = name.substr(0, pos) + ".attn_qkv." + name.substr(pos + strlen(parts[i]));
+            part = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the stacked q, k and v projections of the layers of a tower, for those loaded as views of them
+static void clip_bind_qkv(struct ggml_context * ctx, const char * prefix, std::vector<clip_layer> & layers) {
+    for (size_t il = 0; il < layers.size(); ++il) {
+        struct ggml_tensor * w = ggml_get_tensor(ctx, format(TN_ATTN_QKV, prefix, (int)il, "weight").c_str());
+        struct ggml_tensor * b = ggml_get_tensor(ctx, format(TN_ATTN_QKV, prefix, (int)il, "bias").c_str());
+        if (w && b) {
+            layers[il].qkv_w = w;
+            layers[il].qkv_b = b;
+        }
+    }
+}
+
+// point the q, k and v projections of a layer at their rows of its stacked tensors
+static void clip_split_qkv(struct ggml_context * ctx, clip_layer & layer) {
+    struct ggml_tensor ** weights[] = {&layer.q_w, &layer.k_w, &layer.v_w};
+    struct ggml_tensor ** biases[] = {&layer.q_b, &layer.k_b, &layer.v_b};
+    for (int i = 0; i < 3; ++i) {
+        const struct ggml_tensor * w = *weights[i];
+        *weights[i] = ggml_view_2d(ctx, layer.qkv_w, w->ne[0], w->ne[1], layer.qkv_w->nb[1], i * ggml_nbytes(w));
+        *biases[i] = ggml_view_1d(ctx, layer.qkv_b, (*biases[i])->ne[0], i * ggml_nbytes(*biases[i]));
+    }
+}
+
 // Replacement for std::vector<uint8_t> that doesn't require zero-initialization.
 struct clip_buffer {
     uint8_t * data = NULL;
     size_t size = 0;
 
-    void resize(size_t size) {
+    // false, with the buffer left empty, when the memory is not available
+    bool resize(size_t size) {
+        delete[] data;
+        data = new (std::nothrow) uint8_t[size];
+        this->size = data ? size : 0;
+        return data != NULL;
+    }
+
+    void clear() {
         delete[] data;
-        data = new uint8_t[size];
-        this->size = size;
+        data = NULL;
+        size = 0;
     }
 
     ~clip_buffer() { delete[] data; }
 };
 
-struct clip_ctx {
-    bool has_text_encoder = false;
-    bool has_vision_encoder = false;
-    struct clip_text_model text_model;
-    struct clip_vision_model vision_model;
-    struct clip_vocab vocab;
-    float image_mean[3];
-    float image_std[3];
-    bool use_gelu = false;
-    int32_t ftype = 1;
-    struct ggml_context * ctx;
-    struct gguf_context * ctx_gguf;
-    struct clip_buffer buf_compute;
-};
+// Read-only mapping of a model file, or of a region of one. Tensor data points directly into it, so weights are paged
+// in on first use and the page cache copy is shared by every process that maps the same file.
+struct clip_mmap {
+    // start and size of the model data
+    void * addr = NULL;
+    size_t size = 0;
 
-//
-// memory allocation and management
-//
+    // the mapping itself, which starts at the page boundary below addr
+    void * base = NULL;
+    size_t base_size = 0;
 
-// utility function for a workaround until https://github.com/ggerganov/ggml/issues/260 is resolved
-// after that, remove this and use the mechanism implemented in GGML directly
-size_t get_mem_req_by_size(struct clip_ctx * ctx) {
-    size_t mb = 1024 * 1024;
-    const int n_tensors = gguf_get_n_tensors(ctx->ctx_gguf);
-    const auto & vision_hparams = clip_get_vision_hparams(ctx);
-    const int n_positions =
-        ctx->has_vision_encoder ? vision_hparams->image_size * vision_hparams->image_size / vision_hparams->patch_size + 1 : 77;
-    switch (n_tensors) {
-    case 397:                    // base, two-tower
-    case 200:                    // base, vision-only
-        if (n_positions == 50) { // patch size = 32
-            return 12 * mb;
-        } else { // patch size = 16
-            return 24 * mb;
-        }
-    case 197: // base or large, text-only
-        return 12 * mb;
-    case 589:                     // large, two-tower
-    case 392:                     // large, vision-only
-        if (n_positions == 257) { // input image size = 224
-            return 24 * mb;
-        } else { // input image size = 336
-            return 60 * mb;
-        }
-    case 909: // huge, two-tower
-    case 520: // huge, vision-only
-        return 232 * mb;
-    case 389: // huge, text-only
-        return 120 * mb;
-    default:
-        fprintf(stderr, "%s: Unrecognized number of tensors: %d. Check if you pass the correct model file\n", __func__,
-                n_tensors);
-        exit(1);
-    }
-}
+#ifdef _POSIX_MAPPED_FILES
+    static constexpr bool SUPPORTED = true;
 
-size_t get_scr_buf_req_by_size(struct clip_ctx * ctx) {
-    size_t mb = 1024 * 1024;
+    bool map(const char * fname) {
+        const int fd = open(fname, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
 
-    const int n_tensors = gguf_get_n_tensors(ctx->ctx_gguf);
-    const auto & vision_hparams = clip_get_vision_hparams(ctx);
-    const int n_positions =
-        ctx->has_vision_encoder ? vision_hparams->image_size * vision_hparams->image_size / vision_hparams->patch_size + 1 : 77;
+        struct stat st;
+        const bool ok = fstat(fd, &st) == 0 && st.st_size > 0 && map_fd(fd, 0, (size_t)st.st_size);
+        close(fd); // the mapping keeps its own reference to the file
+        return ok;
+    }
 
-    switch (n_tensors) {
-    case 397:
-    case 200:
-        if (n_positions <= 50) {
-            return 32 * mb;
-        } else {
-            return 96 * mb;
-        }
-    case 197:
-        return 32 * mb;
-    case 589:
-    case 392:
-        if (n_positions <= 257) {
-            return 96 * mb;
-        } else {
-            return 192 * mb;
+    bool map_fd(int fd, size_t offset, size_t length) {
+        const size_t delta = offset % (size_t)sysconf(_SC_PAGESIZE);
+
+        void * ptr = mmap(NULL, length + delta, PROT_READ, MAP_SHARED, fd, (off_t)(offset - delta));
+        if (ptr == MAP_FAILED) {
+            return false;
         }
-    case 909:
-    case 520:
-        return 144 * mb;
-    case 389:
-        return 60 * mb;
-    default:
-        fprintf(stderr, "%s: Unrecognized number of tensors: %d. Check if you pass the correct model file\n", __func__,
-                n_tensors);
-        exit(1);
-    }
-}
 
-// read and create ggml_context containing the tensors and their data
-struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
+        base = ptr;
+        base_size = length + delta;
+        addr = (uint8_t *)ptr + delta;
+        size = length;
+        return true;
+    }
 
-    struct ggml_context * meta = NULL;
+    // hint that a range of the mapping is about to be used, or that it won't be for a while. pages dropped from
+    // memory this way are read back from the file on their next use
+    void prefetch(const void * ptr, size_t len) const {
+#ifdef MADV_WILLNEED
+        advise(ptr, len, MADV_WILLNEED);
+#endif
+    }
 
-    struct gguf_init_params params = {
-        /*.no_alloc = */ true,
-        /*.ctx      = */ &meta,
-    };
+    void release(const void * ptr, size_t len) const {
+#ifdef MADV_DONTNEED
+        advise(ptr, len, MADV_DONTNEED);
+#endif
+    }
 
-    struct gguf_context * ctx = gguf_init_from_file(fname, params);
+    static void advise(const void * ptr, size_t len, int advice) {
+        const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+        const uintptr_t begin = (uintptr_t)ptr & ~(page_size - 1);
+        const uintptr_t end = ((uintptr_t)ptr + len + page_size - 1) & ~(page_size - 1);
+        madvise((void *)begin, end - begin, advice);
+    }
 
-    if (verbosity >= 1) {
-        const int n_tensors = gguf_get_n_tensors(ctx);
-        const int n_kv = gguf_get_n_kv(ctx);
-        const int ftype = get_u32(ctx, KEY_FTYPE);
-        const std::string ftype_str = get_ftype(ftype);
-        const int idx_desc = get_key_idx(ctx, KEY_DESCRIPTION);
-        const std::string description = gguf_get_val_str(ctx, idx_desc);
-        const int idx_name = gguf_find_key(ctx, KEY_NAME);
-        if (idx_name != -1) { // make name optional temporarily as some of the uploaded models missing it due to a bug
-            const std::string name = gguf_get_val_str(ctx, idx_name);
-            printf("%s: model name:   %s\n", __func__, name.c_str());
+    ~clip_mmap() {
+        if (base) {
+            munmap(base, base_size);
         }
-        printf("%s: description:  %s\n", __func__, description.c_str());
-        printf("%s: GGUF version: %d\n", __func__, gguf_get_version(ctx));
-        printf("%s: alignment:    %zu\n", __func__, gguf_get_alignment(ctx));
-        printf("%s: n_tensors:    %d\n", __func__, n_tensors);
-        printf("%s: n_kv:         %d\n", __func__, n_kv);
-        printf("%s: ftype:        %s\n", __func__, ftype_str.c_str());
-        printf("\n");
     }
+#else
+    static constexpr bool SUPPORTED = false;
 
-    // kv
-    if (verbosity >= 3) {
-        const int n_kv = gguf_get_n_kv(ctx);
+    bool map(const char * fname) { return false; }
+    bool map_fd(int fd, size_t offset, size_t length) { return false; }
+    void prefetch(const void * ptr, size_t len) const {}
+    void release(const void * ptr, size_t len) const {}
+#endif
+};
 
-        for (int i = 0; i < n_kv; ++i) {
-            const char * key = gguf_get_key(ctx, i);
+// Where a model is loaded from. With data set, the whole GGUF file is in memory and tensors are views into it whenever
+// their alignment permits, otherwise the metadata is parsed from fname and the tensor data is read from it.
+struct clip_model_source {
+    const char * fname = NULL;
+    const uint8_t * data = NULL;
+    size_t size = 0;
 
-            printf("%s: kv[%d]: key = %s\n", __func__, i, key);
-        }
-        printf("\n");
-    }
+    // modification time of the file, 0 if unknown
+    int64_t mtime = 0;
 
-    // data
-    size_t ctx_size = 0;
-    {
-        const int n_tensors = gguf_get_n_tensors(ctx);
+    // set when this is a weight cache, which must have been written from this model to be used
+    const struct clip_model_source * cache_of = NULL;
 
-        for (int i = 0; i < n_tensors; ++i) {
-            const char * name = gguf_get_tensor_name(ctx, i);
-            const size_t offset = gguf_get_tensor_offset(ctx, i);
+    // backing memory of data that the loaded model takes ownership of, if any
+    struct clip_mmap * mapping = NULL;
+    struct clip_buffer * buffer = NULL;
+};
 
-            struct ggml_tensor * cur = ggml_get_tensor(meta, name);
-            ctx_size += sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE;
-            size_t tensor_size = ggml_nbytes(cur);
-            size_t padded_size = ggml_nbytes_pad(cur);
-            ctx_size += padded_size;
-            if (verbosity >= 3) {
-                printf("%s: tensor[%d]: n_dims = %d, name = %s, tensor_size=%zu, padded_size=%zu, offset=%zu\n", __func__, i,
-                       cur->n_dims, cur->name, tensor_size, padded_size, offset);
-            }
-        }
-    }
+// Reads tensor data from the model file on a few threads. Each thread claims the next tensor in file order and
+// fetches it with a positional read while hinting the kernel about the tensors it is likely to claim next, so that
+// slow or high-latency storage always has several requests in flight. Reading runs in the background until wait().
+struct clip_tensor_loader {
+    struct job {
+        void * dst;
+        size_t offset;
+        size_t size;
+    };
 
-    clip_ctx * new_clip = new clip_ctx;
+    std::vector<job> jobs;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    size_t total = 0;
+    int fd = -1;
+
+    clip_progress_callback progress_callback = NULL;
+    void * progress_callback_user_data = NULL;
+    std::mutex progress_mutex;
+    size_t loaded = 0; // guarded by progress_mutex, so that the callback sees the bytes loaded in increasing order
+
+    void add(void * dst, size_t offset, size_t size) {
+        jobs.push_back({dst, offset, size});
+        total += size;
+    }
 
-    // model size and capabilities
-    {
-        int idx = get_key_idx(ctx, KEY_HAS_TEXT_ENC);
-        new_clip->has_text_encoder = gguf_get_val_bool(ctx, idx);
+    void report(size_t size) {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        loaded += size;
+        if (progress_callback) {
+            progress_callback(loaded, total, progress_callback_user_data);
+        }
+    }
 
-        idx = get_key_idx(ctx, KEY_HAS_VIS_ENC);
-        new_clip->has_vision_encoder = gguf_get_val_bool(ctx, idx);
+#ifdef _POSIX_VERSION
+    void hint(size_t i) {
+#ifdef POSIX_FADV_WILLNEED
+        if (i < jobs.size()) {
+            posix_fadvise(fd, jobs[i].offset, jobs[i].size, POSIX_FADV_WILLNEED);
+        }
+#endif
+    }
 
-        idx = get_key_idx(ctx, KEY_USE_GELU);
-        new_clip->use_gelu = gguf_get_val_bool(ctx, idx);
+    void work(const int n_threads) {
+        for (size_t i = next++; i < jobs.size() && !failed; i = next++) {
+            hint(i + n_threads);
+
+            const job & j = jobs[i];
+            size_t done = 0;
+            while (done < j.size) {
+                const ssize_t n = pread(fd, (char *)j.dst + done, j.size - done, j.offset + done);
+                if (n <= 0) {
+                    failed = true;
+                    return;
+                }
+                done += n;
+            }
 
-        if (verbosity >= 1) {
-            printf("%s: text_encoder:   %d\n", __func__, new_clip->has_text_encoder);
-            printf("%s: vision_encoder: %d\n", __func__, new_clip->has_vision_encoder);
-            printf("%s: model size:     %.2f MB\n", __func__, (ctx_size / 1024.0 / 1024.0));
-            printf("%s: metadata size:  %.2f MB\n", __func__, ggml_get_mem_size(meta) / 1024.0 / 1024.0);
+            report(j.size);
         }
     }
 
-    // load tensors
-    {
-        struct ggml_init_params params = {
-            .mem_size = ctx_size,
-            .mem_buffer = NULL,
-            .no_alloc = false,
-        };
+    bool start(const char * fname, int n_threads) {
+        fd = open(fname, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
 
-        new_clip->ctx = ggml_init(params);
-        if (!new_clip->ctx) {
-            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
-            clip_free(new_clip);
-            return nullptr;
+        n_threads = std::max(1, std::min(n_threads, (int)jobs.size()));
+        for (int i = 0; i < n_threads; ++i) {
+            hint(i);
+        }
+        for (int i = 0; i < n_threads; ++i) {
+            workers.emplace_back([this, n_threads] { work(n_threads); });
         }
 
+        return true;
+    }
+#else
+    bool start(const char * fname, int n_threads) {
         auto fin = std::ifstream(fname, std::ios::binary);
         if (!fin) {
-            printf("cannot open model file for loading tensors\n");
-            clip_free(new_clip);
-            return nullptr;
+            return false;
         }
 
-        const int n_tensors = gguf_get_n_tensors(ctx);
-        for (int i = 0; i < n_tensors; ++i) {
-            const char * name = gguf_get_tensor_name(ctx, i);
-            struct ggml_tensor * t = ggml_get_tensor(meta, name);
-            struct ggml_tensor * cur = ggml_dup_tensor(new_clip->ctx, t);
-            ggml_set_name(cur, name);
-
-            const size_t offset = gguf_get_data_offset(ctx) + gguf_get_tensor_offset(ctx, i);
-            fin.seekg(offset, std::ios::beg);
+        for (const job & j : jobs) {
+            fin.seekg(j.offset, std::ios::beg);
+            fin.read(reinterpret_cast<char *>(j.dst), j.size);
             if (!fin) {
-                printf("%s: failed to seek for tensor %s\n", __func__, name);
-                clip_free(new_clip);
-                return nullptr;
+                failed = true;
+                break;
             }
-
-            fin.read(reinterpret_cast<char *>(cur->data), ggml_nbytes(t));
+            report(j.size);
         }
 
-        fin.close();
+        return true;
     }
+#endif
 
-    // text model
-    if (new_clip->has_text_encoder) {
-        // load text model
-        auto & text_model = new_clip->text_model;
-        auto & hparams = text_model.hparams;
-        hparams.hidden_size = get_u32(ctx, format(KEY_N_EMBD, "text"));
-        hparams.n_head = get_u32(ctx, format(KEY_N_HEAD, "text"));
-        hparams.n_intermediate = get_u32(ctx, format(KEY_N_FF, "text"));
-        hparams.n_layer = get_u32(ctx, format(KEY_N_BLOCK, "text"));
-        hparams.num_positions = get_u32(ctx, KEY_N_POSITIONS);
-        hparams.projection_dim = get_u32(ctx, format(KEY_PROJ_DIM, "text"));
-        hparams.eps = get_f32(ctx, format(KEY_LAYER_NORM_EPS, "text"));
-
-        const int idx_tokens = get_key_idx(ctx, KEY_TOKENS);
-        hparams.n_vocab = gguf_get_arr_n(ctx, idx_tokens);
-        auto & vocab = new_clip->vocab;
-        for (int id = 0; id < hparams.n_vocab; ++id) {
-            const std::string token = gguf_get_arr_str(ctx, idx_tokens, id);
-            vocab.id_to_token[id] = token;
-            vocab.token_to_id[token] = id;
+    // wait for all reads to finish, returns false if any of them failed
+    bool wait() {
+        for (auto & w : workers) {
+            w.join();
         }
+        workers.clear();
 
-        if (verbosity >= 2) {
-            printf("\n%s: text model hparams\n", __func__);
-            printf("n_vocab            %d\n", hparams.n_vocab);
-            printf("num_positions      %d\n", hparams.num_positions);
-            printf("t_hidden_size      %d\n", hparams.hidden_size);
-            printf("t_n_intermediate   %d\n", hparams.n_intermediate);
-            printf("t_projection_dim   %d\n", hparams.projection_dim);
-            printf("t_n_head           %d\n", hparams.n_head);
-            printf("t_n_layer          %d\n", hparams.n_layer);
+#ifdef _POSIX_VERSION
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
         }
+#endif
 
-        text_model.token_embeddings = get_tensor(new_clip->ctx, format(TN_TOKEN_EMBD, "t"));
-        text_model.position_embeddings = get_tensor(new_clip->ctx, format(TN_POS_EMBD, "t"));
-        text_model.post_ln_w = get_tensor(new_clip->ctx, format(TN_LN_POST, "t", "weight"));
-        text_model.post_ln_b = get_tensor(new_clip->ctx, format(TN_LN_POST, "t", "bias"));
-        text_model.projection = get_tensor(new_clip->ctx, TN_TEXT_PROJ);
-        text_model.layers.resize(hparams.n_layer);
-        for (int il = 0; il < hparams.n_layer; ++il) {
-            auto & layer = text_model.layers[il];
-            layer.k_w = get_tensor(new_clip->ctx, format(TN_ATTN_K, "t", il, "weight"));
-            layer.q_w = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "t", il, "weight"));
-            layer.v_w = get_tensor(new_clip->ctx, format(TN_ATTN_V, "t", il, "weight"));
-            layer.o_w = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "t", il, "weight"));
-            layer.ln_1_w = get_tensor(new_clip->ctx, format(TN_LN_1, "t", il, "weight"));
-            layer.ln_2_w = get_tensor(new_clip->ctx, format(TN_LN_2, "t", il, "weight"));
-            layer.ff_i_w = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "t", il, "weight"));
-            layer.ff_o_w = get_tensor(new_clip->ctx, format(TN_FFN_UP, "t", il, "weight"));
-            layer.k_b = get_tensor(new_clip->ctx, format(TN_ATTN_K, "t", il, "bias"));
-            layer.q_b = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "t", il, "bias"));
-            layer.v_b = get_tensor(new_clip->ctx, format(TN_ATTN_V, "t", il, "bias"));
-            layer.o_b = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "t", il, "bias"));
-            layer.ln_1_b = get_tensor(new_clip->ctx, format(TN_LN_1, "t", il, "bias"));
-            layer.ln_2_b = get_tensor(new_clip->ctx, format(TN_LN_2, "t", il, "bias"));
-            layer.ff_i_b = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "t", il, "bias"));
-            layer.ff_o_b = get_tensor(new_clip->ctx, format(TN_FFN_UP, "t", il, "bias"));
-        }
+        return !failed;
     }
 
-    // vision model
-    if (new_clip->has_vision_encoder) {
-        // load vision model
-        auto & vision_model = new_clip->vision_model;
-        auto & hparams = vision_model.hparams;
-        hparams.hidden_size = get_u32(ctx, format(KEY_N_EMBD, "vision"));
-        hparams.n_head = get_u32(ctx, format(KEY_N_HEAD, "vision"));
-        hparams.n_intermediate = get_u32(ctx, format(KEY_N_FF, "vision"));
-        hparams.n_layer = get_u32(ctx, format(KEY_N_BLOCK, "vision"));
-        hparams.image_size = get_u32(ctx, KEY_IMAGE_SIZE);
-        hparams.patch_size = get_u32(ctx, KEY_PATCH_SIZE);
-        hparams.projection_dim = get_u32(ctx, format(KEY_PROJ_DIM, "vision"));
-        hparams.eps = get_f32(ctx, format(KEY_LAYER_NORM_EPS, "vision"));
+    ~clip_tensor_loader() { wait(); }
+};
 
-        int idx_mean = get_key_idx(ctx, KEY_IMAGE_MEAN);
-        int idx_std = get_key_idx(ctx, KEY_IMAGE_STD);
-        for (int i = 0; i < 3; ++i) {
-            new_clip->image_mean[i] = ((float *)gguf_get_arr_data(ctx, idx_mean))[i];
-            new_clip->image_std[i] = ((float *)gguf_get_arr_data(ctx, idx_std))[i];
+struct clip_state;
+
+// Threads for the parallel loops of a model outside of its graphs, such as batch preprocessing. They are started on
+// first use, more are added when a loop asks for more, and they sleep between loops. One loop runs at a time and the
+// calling thread takes part in it.
+struct clip_task_pool {
+    std::mutex run_mutex; // held for the duration of a loop
+
+    std::mutex mutex;
+    std::condition_variable cond;      // a loop was posted, or stop
+    std::condition_variable cond_done; // the last pool thread finished its part of a loop
+    std::vector<std::thread> threads;
+
+    // the loop being run: fn(data, i) for every i in [0, n_items), on n_threads threads
+    void (*fn)(void * data, int i) = NULL;
+    void * data = NULL;
+    int n_items = 0;
+    int n_threads = 0;
+    std::atomic<int> next{0}; // next item to be taken
+    int n_loop = 0;           // number of loops posted so far
+    int n_busy = 0;           // pool threads that haven't finished their part of the loop
+    bool stop = false;
+
+    ~clip_task_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
         }
-
-        if (verbosity >= 2) {
-            printf("\n%s: vision model hparams\n", __func__);
-            printf("image_size         %d\n", hparams.image_size);
-            printf("patch_size         %d\n", hparams.patch_size);
-            printf("v_hidden_size      %d\n", hparams.hidden_size);
-            printf("v_n_intermediate   %d\n", hparams.n_intermediate);
-            printf("v_projection_dim   %d\n", hparams.projection_dim);
-            printf("v_n_head           %d\n", hparams.n_head);
-            printf("v_n_layer          %d\n", hparams.n_layer);
+        cond.notify_all();
+        for (auto & thread : threads) {
+            thread.join();
         }
+    }
+};
 
-        vision_model.patch_embeddings = get_tensor(new_clip->ctx, TN_PATCH_EMBD);
-        vision_model.class_embedding = get_tensor(new_clip->ctx, TN_CLASS_EMBD);
-        vision_model.position_embeddings = get_tensor(new_clip->ctx, format(TN_POS_EMBD, "v"));
-        vision_model.pre_ln_w = get_tensor(new_clip->ctx, format(TN_LN_PRE, "v", "weight"));
-        vision_model.pre_ln_b = get_tensor(new_clip->ctx, format(TN_LN_PRE, "v", "bias"));
-        vision_model.post_ln_w = get_tensor(new_clip->ctx, format(TN_LN_POST, "v", "weight"));
-        vision_model.post_ln_b = get_tensor(new_clip->ctx, format(TN_LN_POST, "v", "bias"));
-        vision_model.projection = get_tensor(new_clip->ctx, TN_VIS_PROJ);
-        vision_model.layers.resize(hparams.n_layer);
-        for (int il = 0; il < hparams.n_layer; ++il) {
-            auto & layer = vision_model.layers[il];
-            layer.k_w = get_tensor(new_clip->ctx, format(TN_ATTN_K, "v", il, "weight"));
-            layer.q_w = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "v", il, "weight"));
-            layer.v_w = get_tensor(new_clip->ctx, format(TN_ATTN_V, "v", il, "weight"));
-            layer.o_w = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "v", il, "weight"));
-            layer.ln_1_w = get_tensor(new_clip->ctx, format(TN_LN_1, "v", il, "weight"));
-            layer.ln_2_w = get_tensor(new_clip->ctx, format(TN_LN_2, "v", il, "weight"));
-            layer.ff_i_w = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "v", il, "weight"));
-            layer.ff_o_w = get_tensor(new_clip->ctx, format(TN_FFN_UP, "v", il, "weight"));
-            layer.k_b = get_tensor(new_clip->ctx, format(TN_ATTN_K, "v", il, "bias"));
-            layer.q_b = get_tensor(new_clip->ctx, format(TN_ATTN_Q, "v", il, "bias"));
-            layer.v_b = get_tensor(new_clip->ctx, format(TN_ATTN_V, "v", il, "bias"));
-            layer.o_b = get_tensor(new_clip->ctx, format(TN_ATTN_OUTPUT, "v", il, "bias"));
-            layer.ln_1_b = get_tensor(new_clip->ctx, format(TN_LN_1, "v", il, "bias"));
-            layer.ln_2_b = get_tensor(new_clip->ctx, format(TN_LN_2, "v", il, "bias"));
-            layer.ff_i_b = get_tensor(new_clip->ctx, format(TN_FFN_DOWN, "v", il, "bias"));
-            layer.ff_o_b = get_tensor(new_clip->ctx, format(TN_FFN_UP, "v", il, "bias"));
-        }
+static void clip_task_pool_work(clip_task_pool * pool) {
+    for (int i = pool->next++; i < pool->n_items; i = pool->next++) {
+        pool->fn(pool->data, i);
     }
+}
 
-    ggml_free(meta);
+// pool thread ith, the calling thread of a loop being thread 0
+static void clip_task_pool_thread(clip_task_pool * pool, const int ith, int n_seen) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->cond.wait(lock, [&] { return pool->stop || pool->n_loop != n_seen; });
+            if (pool->stop) {
+                return;
+            }
+            n_seen = pool->n_loop;
+            if (ith >= pool->n_threads) {
+                continue;
+            }
+        }
 
-    new_clip->ctx_gguf = ctx;
+        clip_task_pool_work(pool);
 
-    const size_t mem_req = get_mem_req_by_size(new_clip);
-    new_clip->buf_compute.resize(mem_req);
-    if (verbosity >= 1) {
-        printf("\n%s: %zu MB of memory allocated\n", __func__, mem_req / 1024 / 1024);
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->n_busy == 0) {
+            pool->cond_done.notify_one();
+        }
     }
-
-    return new_clip;
 }
 
-bool clip_tokenize(const clip_ctx * ctx, const char * text, struct clip_tokens * tokens) {
-    if (!ctx->has_text_encoder) {
-        printf("This GGUF file seems to have no text encoder\n");
-        return false;
+// call fn(data, i) for every i in [0, n_items) on up to n_threads threads. the items are taken one at a time in order,
+// so a thread that is done with a cheap item moves on to the next one instead of waiting for a fixed share. without
+// wait, a loop posted while the pool runs another one runs on the calling thread alone instead of waiting for it
+static void clip_task_pool_run(clip_task_pool * pool, int n_threads, const int n_items, void (*fn)(void * data, int i),
+                               void * data, const bool wait = true) {
+    n_threads = std::max(1, std::min(n_threads, n_items));
+
+    std::unique_lock<std::mutex> run_lock(pool->run_mutex, std::defer_lock);
+    if (wait) {
+        run_lock.lock();
+    } else if (n_threads > 1 && !run_lock.try_lock()) {
+        n_threads = 1;
     }
 
-    std::vector<std::string> words;
+    if (n_threads == 1) {
+        for (int i = 0; i < n_items; i++) {
+            fn(data, i);
+        }
+        return;
+    }
 
-    // first split the text into words
     {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        while ((int)pool->threads.size() < n_threads - 1) {
+            pool->threads.emplace_back(clip_task_pool_thread, pool, (int)pool->threads.size() + 1, pool->n_loop);
+        }
 
-        // Generate the subpattern from the special_tokens vector if it's not empty
-        if (!ctx->vocab.special_tokens.empty()) {
-            std::string special_tokens_subpattern;
-            for (const auto & token : ctx->vocab.special_tokens) {
-                if (!special_tokens_subpattern.empty()) {
-                    special_tokens_subpattern += "|";
-                }
-                special_tokens_subpattern += token;
-            }
+        pool->fn = fn;
+        pool->data = data;
+        pool->n_items = n_items;
+        pool->n_threads = n_threads;
+        pool->next = 0;
+        pool->n_busy = n_threads - 1;
+        pool->n_loop++;
+    }
+    pool->cond.notify_all();
 
-            // Modify the regex pattern with the generated special tokens subpattern
-            pat = special_tokens_subpattern + "|" + pat;
-        }
+    clip_task_pool_work(pool);
 
-        std::regex re(pat);
-        std::smatch m;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->cond_done.wait(lock, [&] { return pool->n_busy == 0; });
+}
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+// A graph built for one input shape. Its tensors stay placed in the activation buffer of the state that built it, so
+// later calls with the same shape only write their inputs and compute it again.
+struct clip_graph {
+    // the number of tokens of a text graph, the batch size of an image graph
+    bool vision = false;
+    int size = 0;
+    bool normalize = false;
+
+    struct clip_buffer buf;
+    struct ggml_context * ctx0 = NULL;
+    struct ggml_cgraph * gf = NULL;
+
+    // index of the last node of every layer, followed by that of the last node of the graph
+    std::vector<int> layer_ends;
+
+    // number of nodes from every node to the end of its concurrent step, see ggml_graph_find_concurrency()
+    std::vector<int> steps;
+
+    // number of nodes from every node to the end of its chain of row-wise nodes, see ggml_graph_find_chains()
+    std::vector<int> chains;
+
+    ~clip_graph() {
+        if (ctx0) {
+            ggml_free(ctx0);
         }
     }
+};
 
-    std::vector<clip_vocab::id> v_tokens;
-    v_tokens.push_back(49406); // startoftext
+// A copy of the weights of the loaded towers in the memory of one NUMA node, with the cpus of the node. An encoder
+// running on those cpus reads every weight from local memory instead of across the interconnect.
+struct clip_replica {
+    int node = 0;
+    std::vector<int> cpus;
 
-    for (const auto & word : words) {
-        // feel lucky? let's try if it's a full word
-        std::string full_word = "";
-        if (word.find(" ") == 0) // starts_with for C++11
-        {
-            full_word += word.substr(1);
-        } else {
-            full_word += word;
-        }
-        full_word += "</w>";
-        auto wit = ctx->vocab.token_to_id.find(full_word);
-        if (wit != ctx->vocab.token_to_id.end()) {
-            v_tokens.push_back(wit->second);
-            continue;
-        }
+    struct clip_text_model text_model;
+    struct clip_vision_model vision_model;
 
-        for (int i = 0; i < word.size();) {
-            for (int j = word.size() - 1; j >= i; j--) {
-                auto cand = word.substr(i, j - i + 1);
-                auto it = ctx->vocab.token_to_id.find(cand);
-                if (it != ctx->vocab.token_to_id.end()) { // word.substr(i, j-i+1) in vocab
-                    v_tokens.push_back(it->second);
-                    i = j + 1;
-                    break;
-                } else if (j == i) { // word.substr(i, 1) has no matching
-                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, word.substr(i, 1).data());
-                    i++;
-                }
-            }
+    // metadata of the copied tensors, and their data
+    struct ggml_context * ctx = NULL;
+    struct clip_buffer buffer;
+
+    ~clip_replica() {
+        if (ctx) {
+            ggml_free(ctx);
         }
     }
+};
 
-    v_tokens.push_back(49407); // endoftext
+struct clip_ctx {
+    bool has_text_encoder = false;
+    bool has_vision_encoder = false;
+    struct clip_text_model text_model;
+    struct clip_vision_model vision_model;
+    struct clip_vocab vocab;
+    float image_mean[3];
+    float image_std[3];
+    bool use_gelu = false;
+    int32_t ftype = 1;
+    struct ggml_context * ctx = NULL;
+    struct gguf_context * ctx_gguf = NULL;
 
-    tokens->size = v_tokens.size();
+    // non-NULL when the weights live in a read-only mapping of the model file
+    struct clip_mmap * mapping = NULL;
 
-    tokens->data = new int[v_tokens.size()];
-    std::copy(v_tokens.begin(), v_tokens.end(), tokens->data);
+    // non-NULL when the weights live in a copy of the model file read from a file descriptor
+    struct clip_buffer * buffer = NULL;
 
-    return true;
-}
+    // stacked q, k and v projections copied out of a model that is otherwise used in place
+    struct clip_buffer qkv_buffer;
 
-clip_image_u8 * clip_image_u8_make() { return new clip_image_u8(); }
+    // number of layers of each tower kept resident while encoding under a layer budget, 0 when not streaming
+    int text_window = 0;
+    int vision_window = 0;
 
-clip_image_f32 * clip_image_f32_make() { return new clip_image_f32(); }
+    // cpu of every compute thread, empty to leave them to the OS
+    std::vector<int> cpus;
 
-void clip_image_u8_clean(clip_image_u8* img) {
-    if (img->data){
-	delete[] img->data;
-	img->data = NULL;
+    // a copy of the weights for every NUMA node, empty on a single node or unless asked for
+    std::vector<std::unique_ptr<clip_replica>> replicas;
+
+    // used by the encode functions that don't take an explicit state
+    struct clip_state * state = NULL;
+
+    // threads of the parallel loops outside of the graphs
+    struct clip_task_pool * task_pool = NULL;
+};
+
+// everything an encode call writes to; the model itself stays read-only
+struct clip_state {
+    // tensor and graph metadata of the graph being built
+    struct clip_buffer buf_compute;
+
+    // activations, laid out by ggml-alloc
+    struct clip_buffer buf_alloc;
+    struct ggml_allocr * alloc = NULL;
+
+    // largest inputs buf_alloc has been measured for, and what each encoder needs at that size
+    int max_text_tokens = 0;
+    int max_image_batch = 0;
+    size_t text_mem = 0;
+    size_t vision_mem = 0;
+
+    // metadata size of the graph of each encoder at those sizes, an upper bound for smaller inputs
+    size_t text_graph_mem = 0;
+    size_t vision_graph_mem = 0;
+
+    // layers the image graphs of the state cover, all of them unless the state computes a stage of a clip_pipeline
+    int layer_begin = 0;
+    int layer_end = -1;
+
+    // weights the graphs of the state read, those of the model when NULL
+    const struct clip_replica * replica = NULL;
+
+    // graphs built by earlier calls, most recently used last. they are dropped whenever buf_alloc is reallocated
+    std::vector<std::unique_ptr<clip_graph>> graphs;
+
+    // scratch of the compute threads. it only grows, to the largest plan seen so far, and after a trim it is
+    // allocated again at that high-water mark right away
+    struct clip_buffer buf_work;
+    size_t work_hwm = 0;
+
+    // threads and work data of the members of the steps of the graph being computed, one entry per node
+    std::vector<ggml_step_member> step_members;
+
+    // compute threads, kept between calls and started again when a call asks for a different number of threads.
+    // they are pinned to the cpus of the model, or to those of the state when it has cpus of its own
+    struct ggml_threadpool * threadpool = NULL;
+    std::vector<int> cpus;
+
+    // the part of a graph computed at once when streaming layers
+    struct ggml_cgraph * segment = NULL;
+
+    ~clip_state() {
+        if (alloc) {
+            ggml_allocr_free(alloc);
+        }
+        delete segment;
+        ggml_threadpool_free(threadpool);
     }
+};
+
+//
+// layer streaming
+//
+
+// Under a layer budget only a window of layers is kept in memory. Weights are mapped from the model file, so a layer
+// is dropped by releasing its pages and brought back by asking the kernel to read them ahead of their use, which
+// happens in the background while the layers before it compute.
+
+static std::array<const struct ggml_tensor *, 16> clip_layer_weights(const clip_layer & layer) {
+    return {{layer.k_w, layer.k_b, layer.q_w, layer.q_b, layer.v_w, layer.v_b, layer.o_w, layer.o_b, layer.ln_1_w,
+             layer.ln_1_b, layer.ff_i_w, layer.ff_i_b, layer.ff_o_w, layer.ff_o_b, layer.ln_2_w, layer.ln_2_b}};
 }
 
-void clip_image_f32_clean(clip_image_f32* res) {
-    if (res->data){
-	delete[] res->data;
-	res->data = NULL;
+// number of layers of a tower that fit in the budget, 0 if all of them do
+static int clip_stream_window(const std::vector<clip_layer> & layers, const size_t budget) {
+    size_t total = 0;
+    size_t max_size = 0;
+    for (const auto & layer : layers) {
+        size_t size = 0;
+        for (const struct ggml_tensor * t : clip_layer_weights(layer)) {
+            size += ggml_nbytes(t);
+        }
+        total += size;
+        max_size = std::max(max_size, size);
+    }
+
+    if (budget == 0 || total <= budget) {
+        return 0;
     }
+
+    return std::max(1, (int)(budget / max_size));
 }
 
-void clip_image_u8_free(clip_image_u8* img) {
-    clip_image_u8_clean(img);
-    delete img;
+static void clip_layer_prefetch(const clip_ctx * ctx, const clip_layer & layer) {
+    for (const struct ggml_tensor * t : clip_layer_weights(layer)) {
+        ctx->mapping->prefetch(t->data, ggml_nbytes(t));
+    }
 }
 
-void clip_image_f32_free(clip_image_f32* res) {
-    clip_image_f32_clean(res);
-    delete res;
+static void clip_layer_release(const clip_ctx * ctx, const clip_layer & layer) {
+    for (const struct ggml_tensor * t : clip_layer_weights(layer)) {
+        ctx->mapping->release(t->data, ggml_nbytes(t));
+    }
 }
 
-bool clip_image_load_from_file(const char * fname, clip_image_u8 * img) {
-    int nx, ny, nc;
-    auto data = stbi_load(fname, &nx, &ny, &nc, 3);
-    if (!data) {
-        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
-        return false;
+// drop the layers of the streamed towers, e.g. after their pages were read while loading
+static void clip_release_layers(const clip_ctx * ctx) {
+    if (ctx->text_window > 0) {
+        for (const auto & layer : ctx->text_model.layers) {
+            clip_layer_release(ctx, layer);
+        }
+    }
+    if (ctx->vision_window > 0) {
+        for (const auto & layer : ctx->vision_model.layers) {
+            clip_layer_release(ctx, layer);
+        }
     }
+}
 
-    img->nx = nx;
-    img->ny = ny;
-    img->size = nx * ny * 3;
-    img->data = new uint8_t[img->size]();
-    memcpy(img->data, data, img->size);
+// value of a sysfs attribute of a cpu, 0 if it can't be read
+static long clip_cpu_attribute(const int cpu, const char * attribute) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, attribute);
 
-    stbi_image_free(data);
+    long value = 0;
+    FILE * f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%ld", &value) != 1) {
+            value = 0;
+        }
+        fclose(f);
+    }
 
-    return true;
+    return value;
 }
 
-static inline double bicubic_filter(double x) {
-#define a -0.5
-    if (x < 0.0) {
-        x = -x;
+// Performance cores of a mixed-core cpu, ranked by the capacity the scheduler gives each core or else by its maximum
+// frequency. Cores within 80% of the fastest one count, which keeps the middle cluster of a phone along with its prime
+// core. Cores whose attribute can't be read, e.g. offline cores of a phone that hot-plugs them, are left out. Empty
+// when no core has either attribute.
+static std::vector<int> clip_performance_cpus() {
+    std::vector<int> cpus;
+
+#if defined(__linux__)
+    // configured cores, so that a core numbered above an offline one is seen too
+    const int n_cpus = std::max((int)sysconf(_SC_NPROCESSORS_CONF), (int)std::thread::hardware_concurrency());
+    for (const char * attribute : {"cpu_capacity", "cpufreq/cpuinfo_max_freq"}) {
+        std::vector<long> perf(n_cpus);
+        for (int cpu = 0; cpu < n_cpus; ++cpu) {
+            perf[cpu] = clip_cpu_attribute(cpu, attribute);
+        }
+        const long max_perf = perf.empty() ? 0 : *std::max_element(perf.begin(), perf.end());
+        if (max_perf <= 0) {
+            continue;
+        }
+
+        for (int cpu = 0; cpu < n_cpus; ++cpu) {
+            if (perf[cpu] > 0 && perf[cpu] * 5 >= max_perf * 4) {
+                cpus.push_back(cpu);
+            }
+        }
+        break;
     }
-    if (x < 1.0) {
-        return ((a + 2.0) * x - (a + 3.0)) * x * x + 1;
+#endif
+
+    return cpus;
+}
+
+// compute a graph on the worker threads and with the work arena of a state. with cpus to run on, there is at most
+// one thread per cpu
+static bool clip_state_compute(const clip_ctx * ctx, clip_state * state, struct ggml_cgraph * gf, int n_threads,
+                               const int * steps, const int * chains) {
+    const std::vector<int> & cpus = state->cpus.empty() ? ctx->cpus : state->cpus;
+    if (!cpus.empty()) {
+        n_threads = std::min(n_threads, (int)cpus.size());
     }
-    if (x < 2.0) {
-        return (((x - 5) * x + 8) * x - 4) * a;
+
+    if (steps && state->step_members.size() < (size_t)gf->n_nodes) {
+        state->step_members.resize(gf->n_nodes);
     }
-    return 0.0;
-#undef a
+    ggml_cplan cplan =
+        ggml_graph_plan_concurrent(gf, n_threads, steps, steps ? state->step_members.data() : NULL, chains);
+
+    if (cplan.work_size != 0) {
+        state->work_hwm = std::max(state->work_hwm, cplan.work_size);
+        if (state->buf_work.size < cplan.work_size && !state->buf_work.resize(state->work_hwm)) {
+            fprintf(stderr, "%s: failed to allocate %zu bytes for the work data\n", __func__, state->work_hwm);
+            return false;
+        }
+        cplan.work_data = state->buf_work.data;
+    }
+
+    if (cplan.n_threads > 1) {
+        if (state->threadpool && ggml_threadpool_n_threads(state->threadpool) != cplan.n_threads) {
+            ggml_threadpool_free(state->threadpool);
+            state->threadpool = NULL;
+        }
+        if (!state->threadpool) {
+            state->threadpool = ggml_threadpool_new(cplan.n_threads, cpus.empty() ? NULL : cpus.data());
+        }
+        cplan.threadpool = state->threadpool;
+    }
+
+    return ggml_graph_compute(gf, &cplan) == GGML_EXIT_SUCCESS;
 }
 
-static bool precompute_coeffs(int inSize, float in0, float in1, int outSize, double ** kkp, int ** boundsp, int * ksize) {
-    double support = 2.0; // Bicubic filter support from Resample.c
-    double filterscale = (double)(in1 - in0) / outSize;
-    if (filterscale < 1.0) {
-        filterscale = 1.0;
+// Run an encoder graph. When its tower is streamed the graph is computed one layer at a time: every node of a layer
+// depends on the output of the layer before, so the nodes between two layer outputs are exactly those of a layer.
+// The layer window ahead of the current one is prefetched before it computes and the layer is released after it.
+// Stops at the first segment that fails to compute and returns false.
+static bool clip_graph_compute(const clip_ctx * ctx, clip_state * state, struct ggml_cgraph * gf, const int n_threads,
+                               const std::vector<clip_layer> & layers, const std::vector<int> & ends,
+                               const std::vector<int> & steps, const std::vector<int> & chains, const int window) {
+    if (window == 0) {
+        return clip_state_compute(ctx, state, gf, n_threads, steps.data(), chains.data());
     }
-    support *= filterscale;
-    int ksize_local = (int)ceil(support) * 2 + 1;
 
-    double * kk = (double *)malloc(outSize * ksize_local * sizeof(double));
-    int * bounds = (int *)malloc(outSize * 2 * sizeof(int));
-    if (!kk || !bounds) {
-        free(kk);
-        free(bounds);
-        return false;
+    GGML_ASSERT(ends.size() == layers.size() + 1);
+
+    if (!state->segment) {
+        state->segment = new ggml_cgraph();
     }
+    struct ggml_cgraph * segment = state->segment;
 
-    for (int xx = 0; xx < outSize; xx++) {
-        double center = in0 + (xx + 0.5) * (in1 - in0) / outSize;
-        double ww = 0.0;
-        double ss = 1.0 / filterscale;
-        int xmin = (int)(center - support + 0.5);
-        if (xmin < 0)
-            xmin = 0;
-        int xmax = (int)(center + support + 0.5);
-        if (xmax > inSize)
-            xmax = inSize;
-        xmax -= xmin;
+    const int n_layer = layers.size();
+    for (int il = 0; il < std::min(window - 1, n_layer); ++il) {
+        clip_layer_prefetch(ctx, layers[il]);
+    }
 
-        double * k = &kk[xx * ksize_local];
-        for (int x = 0; x < xmax; x++) {
-            double w = bicubic_filter((x + xmin - center + 0.5) * ss);
-            k[x] = w;
-            ww += w;
+    int begin = 0;
+    for (int il = 0; il <= n_layer; ++il) {
+        if (il + window - 1 < n_layer) {
+            clip_layer_prefetch(ctx, layers[il + window - 1]);
         }
-        for (int x = 0; x < xmax; x++) {
-            if (ww != 0.0) {
-                k[x] /= ww;
-            }
+
+        segment->n_nodes = ends[il] + 1 - begin;
+        memcpy(segment->nodes, gf->nodes + begin, segment->n_nodes * sizeof(struct ggml_tensor *));
+
+        const bool ok = clip_state_compute(ctx, state, segment, n_threads, steps.data() + begin, chains.data() + begin);
+
+        if (il < n_layer) {
+            clip_layer_release(ctx, layers[il]);
         }
-        for (int x = xmax; x < ksize_local; x++) {
-            k[x] = 0.0;
+        if (!ok) {
+            return false;
         }
-        bounds[xx * 2 + 0] = xmin;
-        bounds[xx * 2 + 1] = xmax;
+        begin = ends[il] + 1;
     }
 
-    *kkp = kk;
-    *boundsp = bounds;
-    *ksize = ksize_local;
     return true;
 }
 
-// normalize: x = (x - mean) / std
-bool clip_image_preprocess(const clip_ctx * ctx, const clip_image_u8 * img, clip_image_f32 * res) {
-    if (!ctx->has_vision_encoder) {
-        printf("This gguf file seems to have no vision encoder\n");
-        return false;
-    }
+//
+// NUMA
+//
 
-    const int nx = img->nx;
-    const int ny = img->ny;
-    const int nx2 = ctx->vision_model.hparams.image_size;
-    const int ny2 = ctx->vision_model.hparams.image_size;
+// On a machine with several NUMA nodes every node gets its own copy of the weights, and executors that compute on
+// the cpus of a node read the copy of that node. Interleaving the weights over the nodes would save the memory, but
+// still sends most reads of an executor across the interconnect.
 
-    // Setting the output image size and allocating memory
-    res->nx = nx2;
-    res->ny = ny2;
-    res->size = 3 * nx2 * ny2;
-    res->data = new float[res->size]();
-    if (!res->data) {
-        printf("clip_image_f32 Memory allocation failed\n");
-        return false;
-    }
+static const clip_text_model & clip_state_text_model(const clip_ctx * ctx, const clip_state * state) {
+    return state->replica ? state->replica->text_model : ctx->text_model;
+}
 
-    // Calculate aspect ratio maintaining scaling
-    const float scale = std::min((float)nx, (float)ny) / (float)ctx->vision_model.hparams.image_size;
-    const int nx3 = (int)(nx / scale + 0.5f);
-    const int ny3 = (int)(ny / scale + 0.5f);
+static const clip_vision_model & clip_state_vision_model(const clip_ctx * ctx, const clip_state * state) {
+    return state->replica ? state->replica->vision_model : ctx->vision_model;
+}
 
-    const auto & m3 = ctx->image_mean;
-    const auto & s3 = ctx->image_std;
+// Copy the weights of the model to a node. The copy is computed as graphs on threads pinned to the cpus of the node,
+// so the pages of the replica are first touched there, which under the default allocation policy of Linux places
+// them in the memory of the node. NULL when the copy could not be made.
+static clip_replica * clip_replica_new(const clip_ctx * ctx, const int node, const std::vector<int> & cpus) {
+    clip_replica * replica = new clip_replica;
+    replica->node = node;
+    replica->cpus = cpus;
+    replica->text_model = ctx->text_model;
+    replica->vision_model = ctx->vision_model;
+
+    // the fields of the copied models still point to the weights of the model at this point
+    std::vector<clip_tensor_slot> slots;
+    if (ctx->has_text_encoder) {
+        clip_text_tensors(replica->text_model, slots);
+    }
+    if (ctx->has_vision_encoder) {
+        clip_vision_tensors(replica->vision_model, slots);
+    }
 
-    // Calculating horizontal and vertical coeffs
-    double *kk_horiz, *kk_vert;
-    int *bounds_horiz, *bounds_vert;
-    int ksize_horiz, ksize_vert;
+    // stacked q, k and v projections are copied whole, and their parts become views of the copies
+    std::vector<clip_layer *> stacked;
+    for (auto * layers : {&replica->text_model.layers, &replica->vision_model.layers}) {
+        for (auto & layer : *layers) {
+            if (layer.qkv_w) {
+                stacked.push_back(&layer);
+            }
+        }
+    }
+    std::vector<struct ggml_tensor **> parts;
+    for (clip_layer * layer : stacked) {
+        parts.insert(parts.end(), {&layer->q_w, &layer->k_w, &layer->v_w, &layer->q_b, &layer->k_b, &layer->v_b});
+    }
+    slots.erase(std::remove_if(slots.begin(), slots.end(),
+                               [&](const clip_tensor_slot & slot) {
+                                   return std::find(parts.begin(), parts.end(), slot.tensor) != parts.end();
+                               }),
+                slots.end());
+    for (clip_layer * layer : stacked) {
+        slots.push_back({"", &layer->qkv_w});
+        slots.push_back({"", &layer->qkv_b});
+    }
 
-    if (!precompute_coeffs(nx, 0.0f, (float)nx, nx3, &kk_horiz, &bounds_horiz, &ksize_horiz) ||
-        !precompute_coeffs(ny, 0.0f, (float)ny, ny3, &kk_vert, &bounds_vert, &ksize_vert)) {
-        delete[] res->data;
-        free(kk_horiz);
-        free(bounds_horiz);
-        free(kk_vert);
-        free(bounds_vert);
-        printf("Failed to calculate coeffs\n");
-        return false;
+    size_t size = 0;
+    for (const auto & slot : slots) {
+        size += GGML_PAD(ggml_nbytes(*slot.tensor), GGML_MEM_ALIGN);
+    }
+    if (!replica->buffer.resize(size + GGML_MEM_ALIGN)) {
+        delete replica;
+        return NULL;
+    }
+    uint8_t * data = (uint8_t *)GGML_PAD((uintptr_t)replica->buffer.data, GGML_MEM_ALIGN);
+
+    struct ggml_init_params params = {
+        .mem_size = ggml_tensor_overhead() * (slots.size() + 6 * stacked.size()),
+        .mem_buffer = NULL,
+        .no_alloc = true,
+    };
+    replica->ctx = ggml_init(params);
+    if (!replica->ctx) {
+        delete replica;
+        return NULL;
+    }
+
+    // the pages of the copy are placed on the node of the thread that first writes them, so the copy runs on the cpus
+    // of the node even when it has a single one: a pool of one thread pins the calling thread for the compute
+    struct ggml_threadpool * threadpool = cpus.empty() ? NULL : ggml_threadpool_new(cpus.size(), cpus.data());
+
+    // every copy adds its source and destination as leafs of the graph
+    const size_t n_per_graph = GGML_MAX_NODES / 2;
+    bool ok = true;
+    for (size_t i0 = 0; i0 < slots.size() && ok; i0 += n_per_graph) {
+        const size_t i1 = std::min(slots.size(), i0 + n_per_graph);
+
+        struct ggml_init_params graph_params = {
+            .mem_size = ggml_tensor_overhead() * (i1 - i0) + ggml_graph_overhead(),
+            .mem_buffer = NULL,
+            .no_alloc = true,
+        };
+        struct ggml_context * ctx0 = ggml_init(graph_params);
+        if (!ctx0) {
+            ok = false;
+            break;
+        }
+        struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+        for (size_t i = i0; i < i1; ++i) {
+            struct ggml_tensor * src = *slots[i].tensor;
+            struct ggml_tensor * dst = ggml_dup_tensor(replica->ctx, src);
+            ggml_set_name(dst, ggml_get_name(src));
+            dst->data = data;
+            data += GGML_PAD(ggml_nbytes(src), GGML_MEM_ALIGN);
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, src, dst));
+            *slots[i].tensor = dst;
+        }
+
+        ggml_cplan cplan = ggml_graph_plan(gf, cpus.size());
+        std::vector<uint8_t> work(cplan.work_size);
+        cplan.work_data = work.data();
+        cplan.threadpool = threadpool;
+        ok = ggml_graph_compute(gf, &cplan) == GGML_EXIT_SUCCESS;
+
+        ggml_free(ctx0);
+    }
+
+    ggml_threadpool_free(threadpool);
+
+    if (!ok) {
+        delete replica;
+        return NULL;
+    }
+
+    for (clip_layer * layer : stacked) {
+        clip_split_qkv(replica->ctx, *layer);
+    }
+
+    return replica;
+}
+
+// the replica on the node of a cpu, NULL if there is none
+static const clip_replica * clip_cpu_replica(const clip_ctx * ctx, const int cpu) {
+    for (const auto & replica : ctx->replicas) {
+        if (std::find(replica->cpus.begin(), replica->cpus.end(), cpu) != replica->cpus.end()) {
+            return replica.get();
+        }
+    }
+    return NULL;
+}
+
+// give every NUMA node with cpus a copy of the weights
+static void clip_numa_replicate(clip_ctx * ctx, const int verbosity) {
+    static std::once_flag numa_once;
+    std::call_once(numa_once, [] {
+        if (ggml_numa_n_nodes() == 0) {
+            ggml_numa_init();
+        }
+    });
+
+    if (!ggml_is_numa()) {
+        if (verbosity >= 1) {
+            printf("%s: a single NUMA node, the weights are not replicated\n", __func__);
+        }
+        return;
+    }
+
+    // a streamed tower keeps only a window of its layers in memory, a replica would keep all of them
+    if (ctx->text_window > 0 || ctx->vision_window > 0) {
+        fprintf(stderr, "%s: not replicating the weights of a model streamed under a layer budget\n", __func__);
+        return;
+    }
+
+    for (int node = 0; node < ggml_numa_n_nodes(); ++node) {
+        std::vector<int> cpus(std::max(1u, std::thread::hardware_concurrency()));
+        cpus.resize(ggml_numa_node_cpus(node, cpus.data(), cpus.size()));
+        // a node with memory but no cpus has no executors to read a copy
+        if (cpus.empty()) {
+            continue;
+        }
+        clip_replica * replica = clip_replica_new(ctx, node, cpus);
+        if (!replica) {
+            // the executors on the node read the weights of the model instead
+            fprintf(stderr, "%s: failed to copy the weights to NUMA node %d\n", __func__, node);
+            continue;
+        }
+        ctx->replicas.emplace_back(replica);
+    }
+
+    if (verbosity >= 1 && !ctx->replicas.empty()) {
+        printf("%s: weights replicated on %zu NUMA nodes, %.2f MB each\n", __func__, ctx->replicas.size(),
+               ctx->replicas[0]->buffer.size / 1024.0 / 1024.0);
+    }
+}
+
+//
+// memory allocation and management
+//
+
+// Activations are placed by ggml-alloc. Each encoder graph is first built against a measuring allocator, which
+// replays the tensor lifetimes of the graph, and the activation buffer of a state is sized to the measured peak.
+
+static const size_t tensor_alignment = 32;
+
+struct clip_model_params clip_model_default_params() {
+    struct clip_model_params result = {
+        /*.verbosity = */ 1,
+        /*.use_mmap  = */ true,
+        /*.load_text_encoder   = */ true,
+        /*.load_vision_encoder = */ true,
+        /*.n_load_threads      = */ 4,
+        /*.progress_callback   = */ NULL,
+        /*.progress_callback_user_data = */ NULL,
+        /*.cache_path          = */ NULL,
+        /*.layer_budget        = */ 0,
+        /*.cpus                = */ NULL,
+        /*.n_cpus              = */ 0,
+        /*.performance_cores_only = */ false,
+        /*.numa                = */ false,
+    };
+
+    return result;
+}
+
+struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
+    struct clip_model_params params = clip_model_default_params();
+    params.verbosity = verbosity;
+
+    return clip_model_load_with_params(fname, params);
+}
+
+static struct clip_ctx * clip_model_load_impl(const struct clip_model_source & src, const struct clip_model_params model_params);
+
+// returns false if the file does not exist
+static bool clip_source_from_file(clip_model_source & src, const char * fname, const bool use_mmap) {
+    src.fname = fname;
+
+#ifdef _POSIX_VERSION
+    struct stat st;
+    if (stat(fname, &st) != 0) {
+        return false;
+    }
+    src.size = st.st_size;
+    src.mtime = st.st_mtime;
+#else
+    auto fin = std::ifstream(fname, std::ios::binary | std::ios::ate);
+    if (!fin) {
+        return false;
+    }
+    src.size = fin.tellg();
+#endif
+
+    if (use_mmap && clip_mmap::SUPPORTED) {
+        src.mapping = new clip_mmap;
+        if (src.mapping->map(fname)) {
+            src.data = (const uint8_t *)src.mapping->addr;
+            src.size = src.mapping->size;
+        } else {
+            fprintf(stderr, "%s: failed to mmap '%s', falling back to reading it\n", __func__, fname);
+            delete src.mapping;
+            src.mapping = NULL;
+        }
+    }
+
+    return true;
+}
+
+static const uint64_t clip_fnv_offset_basis = 0xcbf29ce484222325ULL;
+
+// continue the FNV-1a hash with the n bytes at offset of the model
+static bool clip_source_hash(const clip_model_source & src, std::ifstream & fin, const size_t offset, const size_t n,
+                             uint64_t & hash) {
+    std::vector<uint8_t> buf;
+    const uint8_t * data = NULL;
+    if (!src.data) {
+        buf.resize(n);
+        if (!fin.seekg(offset, std::ios::beg) || !fin.read(reinterpret_cast<char *>(buf.data()), n)) {
+            return false;
+        }
+        data = buf.data();
+    } else if (offset + n <= src.size) {
+        data = src.data + offset;
+    } else {
+        return false;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return true;
+}
+
+// FNV-1a of the first n bytes of the model, which hold the GGUF header and metadata including the name, type, shape
+// and offset of every tensor
+static bool clip_source_checksum(const clip_model_source & src, const size_t n, uint64_t & sum) {
+    auto fin = src.data ? std::ifstream() : std::ifstream(src.fname, std::ios::binary);
+    sum = clip_fnv_offset_basis;
+    return clip_source_hash(src, fin, 0, n, sum);
+}
+
+// FNV-1a of blocks spread evenly over the tensor data after the first meta_size bytes of the model. a model whose
+// weights changed under the same metadata, size and modification time is still told apart, at the cost of reading
+// a small part of it
+static bool clip_source_data_checksum(const clip_model_source & src, const size_t meta_size, uint64_t & sum) {
+    const size_t n_blocks = 64;
+    const size_t block_size = 4096;
+
+    if (meta_size > src.size) {
+        return false;
+    }
+
+    auto fin = src.data ? std::ifstream() : std::ifstream(src.fname, std::ios::binary);
+    sum = clip_fnv_offset_basis;
+
+    const size_t n_data = src.size - meta_size;
+    if (n_data <= n_blocks * block_size) {
+        return clip_source_hash(src, fin, meta_size, n_data, sum);
+    }
+    for (size_t k = 0; k < n_blocks; ++k) {
+        const size_t offset = meta_size + (n_data - block_size) / (n_blocks - 1) * k;
+        if (!clip_source_hash(src, fin, offset, block_size, sum)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a weight cache is only used if it was written from the very model file being loaded. a model without a
+// modification time, e.g. one in a buffer, cannot be told apart from another one with the same metadata and size
+static bool clip_cache_matches(const gguf_context * ctx, const clip_model_source & model) {
+    if (model.mtime == 0) {
+        return false;
+    }
+
+    const int idx_version = gguf_find_key(ctx, KEY_CACHE_VERSION);
+    const int idx_size = gguf_find_key(ctx, KEY_CACHE_SOURCE_SIZE);
+    const int idx_mtime = gguf_find_key(ctx, KEY_CACHE_SOURCE_MTIME);
+    const int idx_meta_size = gguf_find_key(ctx, KEY_CACHE_SOURCE_META_SIZE);
+    const int idx_checksum = gguf_find_key(ctx, KEY_CACHE_SOURCE_CHECKSUM);
+    const int idx_data_checksum = gguf_find_key(ctx, KEY_CACHE_SOURCE_DATA_CHECKSUM);
+    if (idx_version == -1 || idx_size == -1 || idx_mtime == -1 || idx_meta_size == -1 || idx_checksum == -1 ||
+        idx_data_checksum == -1) {
+        return false;
+    }
+
+    if (gguf_get_val_u32(ctx, idx_version) != CLIP_CACHE_VERSION || gguf_get_val_u64(ctx, idx_size) != model.size ||
+        gguf_get_val_i64(ctx, idx_mtime) != model.mtime) {
+        return false;
+    }
+
+    const size_t meta_size = gguf_get_val_u64(ctx, idx_meta_size);
+    uint64_t checksum;
+    if (!clip_source_checksum(model, meta_size, checksum) || checksum != gguf_get_val_u64(ctx, idx_checksum)) {
+        return false;
+    }
+    return clip_source_data_checksum(model, meta_size, checksum) &&
+           checksum == gguf_get_val_u64(ctx, idx_data_checksum);
+}
+
+// A weight cache is a GGUF file with the metadata of the model it was written from, what identifies that model file,
+// the vocab ids in token order and the weights of every tower in binding order. It is written aligned and the weights
+// of a mapped cache are always used in place.
+static bool clip_cache_write(const char * path, const clip_model_source & src) {
+    struct ggml_context * meta = NULL;
+
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &meta,
+    };
+
+    struct gguf_context * ctx_src =
+        src.data ? gguf_init_from_buffer(src.data, src.size, params) : gguf_init_from_file(src.fname, params);
+    if (!ctx_src) {
+        return false;
+    }
+
+    const size_t meta_size = gguf_get_data_offset(ctx_src);
+    uint64_t checksum;
+    uint64_t data_checksum;
+    if (!clip_source_checksum(src, meta_size, checksum) || !clip_source_data_checksum(src, meta_size, data_checksum)) {
+        ggml_free(meta);
+        gguf_free(ctx_src);
+        return false;
+    }
+
+    struct gguf_context * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ctx_src);
+    gguf_set_val_u32(ctx_out, "general.alignment", gguf_get_alignment(ctx_out));
+    gguf_set_val_u32(ctx_out, KEY_CACHE_VERSION, CLIP_CACHE_VERSION);
+    gguf_set_val_u64(ctx_out, KEY_CACHE_SOURCE_SIZE, src.size);
+    gguf_set_val_i64(ctx_out, KEY_CACHE_SOURCE_MTIME, src.mtime);
+    gguf_set_val_u64(ctx_out, KEY_CACHE_SOURCE_META_SIZE, meta_size);
+    gguf_set_val_u64(ctx_out, KEY_CACHE_SOURCE_CHECKSUM, checksum);
+    gguf_set_val_u64(ctx_out, KEY_CACHE_SOURCE_DATA_CHECKSUM, data_checksum);
+
+    clip_text_model text_model;
+    clip_vision_model vision_model;
+    std::vector<clip_tensor_slot> slots;
+
+    if (gguf_get_val_bool(ctx_src, get_key_idx(ctx_src, KEY_HAS_TEXT_ENC))) {
+        text_model.hparams.n_layer = get_u32(ctx_src, format(KEY_N_BLOCK, "text"));
+        clip_text_tensors(text_model, slots);
+
+        // ids in the order of their tokens, with the id a duplicate token resolves to when loading
+        const int idx_tokens = get_key_idx(ctx_src, KEY_TOKENS);
+        const int n_vocab = gguf_get_arr_n(ctx_src, idx_tokens);
+        std::map<std::string, int32_t> token_to_id;
+        for (int id = 0; id < n_vocab; ++id) {
+            token_to_id[gguf_get_arr_str(ctx_src, idx_tokens, id)] = id;
+        }
+        std::vector<int32_t> order;
+        order.reserve(token_to_id.size());
+        for (const auto & it : token_to_id) {
+            order.push_back(it.second);
+        }
+        gguf_set_arr_data(ctx_out, KEY_CACHE_VOCAB_ORDER, GGUF_TYPE_INT32, order.data(), order.size());
+    }
+
+    if (gguf_get_val_bool(ctx_src, get_key_idx(ctx_src, KEY_HAS_VIS_ENC))) {
+        vision_model.hparams.n_layer = get_u32(ctx_src, format(KEY_N_BLOCK, "vision"));
+        clip_vision_tensors(vision_model, slots);
+    }
+
+    bool ok = true;
+    for (const auto & slot : slots) {
+        const struct ggml_tensor * cur = ggml_get_tensor(meta, slot.name.c_str());
+        if (!cur) {
+            ok = false;
+            break;
+        }
+        gguf_add_tensor(ctx_out, cur);
+    }
+
+    // write to a temporary file first, so that a cache is never seen half written
+    const std::string tmp_path = std::string(path) + ".tmp";
+    if (ok) {
+        auto fout = std::ofstream(tmp_path, std::ios::binary);
+        auto fin = src.data ? std::ifstream() : std::ifstream(src.fname, std::ios::binary);
+
+        const size_t meta_size_out = gguf_get_meta_size(ctx_out);
+        for (size_t i = 0; i < meta_size_out; ++i) {
+            fout.put(0);
+        }
+
+        std::vector<uint8_t> read_data;
+        for (const auto & slot : slots) {
+            const int i = gguf_find_tensor(ctx_src, slot.name.c_str());
+            const size_t offset = meta_size + gguf_get_tensor_offset(ctx_src, i);
+            const size_t size = ggml_nbytes(ggml_get_tensor(meta, slot.name.c_str()));
+
+            const uint8_t * data = src.data + offset;
+            if (!src.data) {
+                read_data.resize(size);
+                fin.seekg(offset, std::ios::beg);
+                fin.read(reinterpret_cast<char *>(read_data.data()), size);
+                data = read_data.data();
+            } else if (offset + size > src.size) {
+                ok = false;
+                break;
+            }
+
+            fout.write((const char *)data, size);
+            const size_t pad = GGML_PAD(size, gguf_get_alignment(ctx_out)) - size;
+            for (size_t j = 0; j < pad; ++j) {
+                fout.put(0);
+            }
+        }
+
+        fout.seekp(0, std::ios::beg);
+        std::vector<uint8_t> meta_data(meta_size_out);
+        gguf_get_meta_data(ctx_out, meta_data.data());
+        fout.write((const char *)meta_data.data(), meta_size_out);
+
+        fout.close();
+        ok = ok && fout && (src.data || fin);
+    }
+
+    if (ok) {
+        ok = std::rename(tmp_path.c_str(), path) == 0;
+    }
+    if (!ok) {
+        std::remove(tmp_path.c_str());
+    }
+
+    ggml_free(meta);
+    gguf_free(ctx_src);
+    gguf_free(ctx_out);
+
+    return ok;
+}
+
+// load through the weight cache when there is a valid one, and (re)write it from the model otherwise
+static struct clip_ctx * clip_model_load_cached(const struct clip_model_source & src,
+                                                const struct clip_model_params model_params) {
+    if (!model_params.cache_path) {
+        return clip_model_load_impl(src, model_params);
+    }
+
+    // a cache could never be matched to a model without a modification time
+    if (src.mtime == 0) {
+        if (model_params.verbosity >= 1) {
+            printf("%s: '%s' has no modification time, loading it without the weight cache\n", __func__, src.fname);
+        }
+        return clip_model_load_impl(src, model_params);
+    }
+
+    clip_model_source cache;
+    if (clip_source_from_file(cache, model_params.cache_path, model_params.use_mmap)) {
+        cache.cache_of = &src;
+        clip_ctx * ctx = clip_model_load_impl(cache, model_params);
+        if (ctx) {
+            delete src.mapping;
+            delete src.buffer;
+            return ctx;
+        }
+    }
+
+    clip_ctx * ctx = clip_model_load_impl(src, model_params);
+    if (ctx && !clip_cache_write(model_params.cache_path, src)) {
+        fprintf(stderr, "%s: failed to write weight cache '%s'\n", __func__, model_params.cache_path);
+    }
+    if (ctx) {
+        // writing the cache read every weight of the model
+        clip_release_layers(ctx);
+    }
+
+    return ctx;
+}
+
+struct clip_ctx * clip_model_load_with_params(const char * fname, const struct clip_model_params model_params) {
+    clip_model_source src;
+    clip_source_from_file(src, fname, model_params.use_mmap);
+
+    return clip_model_load_cached(src, model_params);
+}
+
+struct clip_ctx * clip_model_load_from_fd(int fd, size_t offset, size_t size, const struct clip_model_params model_params) {
+    clip_model_source src;
+    src.fname = "<fd>";
+
+#ifdef _POSIX_VERSION
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        src.mtime = st.st_mtime;
+    }
+#endif
+
+    if (model_params.use_mmap && clip_mmap::SUPPORTED) {
+        src.mapping = new clip_mmap;
+        if (src.mapping->map_fd(fd, offset, size)) {
+            src.data = (const uint8_t *)src.mapping->addr;
+            src.size = src.mapping->size;
+            return clip_model_load_cached(src, model_params);
+        }
+
+        fprintf(stderr, "%s: failed to mmap fd %d, falling back to reading it\n", __func__, fd);
+        delete src.mapping;
+        src.mapping = NULL;
+    }
+
+#ifdef _POSIX_VERSION
+    // a single read of the whole region, the tensors then point into the copy
+    src.buffer = new clip_buffer;
+    if (!src.buffer->resize(size)) {
+        fprintf(stderr, "%s: failed to allocate %zu bytes for the model in fd %d\n", __func__, size, fd);
+        delete src.buffer;
+        return nullptr;
+    }
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = pread(fd, src.buffer->data + done, size - done, (off_t)(offset + done));
+        if (n <= 0) {
+            fprintf(stderr, "%s: failed to read %zu bytes at offset %zu from fd %d\n", __func__, size, offset, fd);
+            delete src.buffer;
+            return nullptr;
+        }
+        done += n;
+    }
+
+    src.data = src.buffer->data;
+    src.size = size;
+    return clip_model_load_cached(src, model_params);
+#else
+    fprintf(stderr, "%s: not supported on this platform\n", __func__);
+    return nullptr;
+#endif
+}
+
+struct clip_ctx * clip_model_load_from_buffer(const void * data, size_t size, const struct clip_model_params model_params) {
+    clip_model_source src;
+    src.fname = "<buffer>";
+    src.data = (const uint8_t *)data;
+    src.size = size;
+
+    return clip_model_load_cached(src, model_params);
+}
+
+// read and create ggml_context containing the tensors and their data
+static struct clip_ctx * clip_model_load_impl(const struct clip_model_source & src, const struct clip_model_params model_params) {
+    const int verbosity = model_params.verbosity;
+    const char * fname = src.fname;
+
+    struct ggml_context * meta = NULL;
+
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &meta,
+    };
+
+    struct gguf_context * ctx = src.data ? gguf_init_from_buffer(src.data, src.size, params) : gguf_init_from_file(fname, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to read model file '%s'\n", __func__, fname);
+        delete src.mapping;
+        delete src.buffer;
+        return nullptr;
+    }
+
+    if (src.cache_of && !clip_cache_matches(ctx, *src.cache_of)) {
+        if (verbosity >= 1) {
+            printf("%s: weight cache '%s' was not written from this model, rebuilding it\n", __func__, fname);
+        }
+        ggml_free(meta);
+        gguf_free(ctx);
+        delete src.mapping;
+        delete src.buffer;
+        return nullptr;
+    }
+
+    // the weights of a cache are stored in binding order
+    const bool from_cache = gguf_find_key(ctx, KEY_CACHE_VERSION) != -1;
+
+    if (verbosity >= 1) {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+        const int n_kv = gguf_get_n_kv(ctx);
+        const int ftype = get_u32(ctx, KEY_FTYPE);
+        const std::string ftype_str = get_ftype(ftype);
+        const int idx_desc = get_key_idx(ctx, KEY_DESCRIPTION);
+        const std::string description = gguf_get_val_str(ctx, idx_desc);
+        const int idx_name = gguf_find_key(ctx, KEY_NAME);
+        if (idx_name != -1) { // make name optional temporarily as some of the uploaded models missing it due to a bug
+            const std::string name = gguf_get_val_str(ctx, idx_name);
+            printf("%s: model name:   %s\n", __func__, name.c_str());
+        }
+        printf("%s: description:  %s\n", __func__, description.c_str());
+        printf("%s: GGUF version: %d\n", __func__, gguf_get_version(ctx));
+        printf("%s: alignment:    %zu\n", __func__, gguf_get_alignment(ctx));
+        printf("%s: n_tensors:    %d\n", __func__, n_tensors);
+        printf("%s: n_kv:         %d\n", __func__, n_kv);
+        printf("%s: ftype:        %s\n", __func__, ftype_str.c_str());
+        printf("\n");
+    }
+
+    // kv
+    if (verbosity >= 3) {
+        const int n_kv = gguf_get_n_kv(ctx);
+
+        for (int i = 0; i < n_kv; ++i) {
+            const char * key = gguf_get_key(ctx, i);
+
+            printf("%s: kv[%d]: key = %s\n", __func__, i, key);
+        }
+        printf("\n");
+    }
+
+    // tensors of a tower that is not going to be loaded are neither read nor kept
+    auto skip_tensor = [&](const char * name) {
+        const std::string tn = name;
+        if (!model_params.load_text_encoder && (tn.compare(0, 2, "t.") == 0 || tn == TN_TEXT_PROJ)) {
+            return true;
+        }
+        if (!model_params.load_vision_encoder && (tn.compare(0, 2, "v.") == 0 || tn == TN_VIS_PROJ)) {
+            return true;
+        }
+        return false;
+    };
+
+    // tensor data in memory is used in place as long as it is as aligned as ggml would allocate it
+    const bool zero_copy = src.data && ((uintptr_t)(src.data + gguf_get_data_offset(ctx)) % GGML_MEM_ALIGN) == 0;
+
+    // layers are streamed from a mapping used in place
+    const bool streaming = model_params.layer_budget > 0 && src.mapping && zero_copy;
+
+    // The q, k and v projections of a layer are loaded as views of one tensor they are stacked into, so that a single
+    // matmul computes all three. For a model used in place, that tensor is the three themselves when they are stored
+    // back to back, as a weight cache stores them. Otherwise they are copied out of a mapping, whose pages of them are
+    // released, and they are left apart when the copy would add to the memory in use or layers are streamed.
+    // The groups are keyed by the name of the stacked tensor.
+    struct qkv_group {
+        int idx[3] = {-1, -1, -1};
+        bool in_place = false;
+        size_t copy_offset = 0;
+    };
+    std::map<std::string, qkv_group> qkv_groups;
+    size_t qkv_copy_size = 0;
+    {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+
+        std::string qkv_name;
+        int part;
+        for (int i = 0; i < n_tensors; ++i) {
+            const char * name = gguf_get_tensor_name(ctx, i);
+            if (!skip_tensor(name) && clip_qkv_part(name, qkv_name, part)) {
+                qkv_groups[qkv_name].idx[part] = i;
+            }
+        }
+
+        for (auto it = qkv_groups.begin(); it != qkv_groups.end();) {
+            qkv_group & group = it->second;
+            bool ok = group.idx[0] != -1 && group.idx[1] != -1 && group.idx[2] != -1;
+            const struct ggml_tensor * q = ok ? ggml_get_tensor(meta, gguf_get_tensor_name(ctx, group.idx[0])) : NULL;
+            size_t offset = ok ? gguf_get_tensor_offset(ctx, group.idx[0]) : 0;
+            ok = ok && q->n_dims <= 2;
+            group.in_place = true;
+            for (int i = 1; ok && i < 3; ++i) {
+                const struct ggml_tensor * t = ggml_get_tensor(meta, gguf_get_tensor_name(ctx, group.idx[i]));
+                ok = t->type == q->type && ggml_are_same_shape(t, q);
+                offset += ggml_nbytes(q);
+                group.in_place = group.in_place && gguf_get_tensor_offset(ctx, group.idx[i]) == offset;
+            }
+            if (ok && zero_copy && !group.in_place) {
+                ok = src.mapping && !streaming;
+                group.copy_offset = qkv_copy_size;
+                qkv_copy_size += ok ? GGML_PAD(3 * ggml_nbytes(q), GGML_MEM_ALIGN) : 0;
+            }
+            it = ok ? std::next(it) : qkv_groups.erase(it);
+        }
+    }
+
+    // data
+    size_t ctx_size = 0;
+    size_t data_size = 0;
+    int n_loaded = 0;
+    {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+
+        for (int i = 0; i < n_tensors; ++i) {
+            const char * name = gguf_get_tensor_name(ctx, i);
+            const size_t offset = gguf_get_tensor_offset(ctx, i);
+            if (skip_tensor(name)) {
+                continue;
+            }
+            n_loaded++;
+
+            struct ggml_tensor * cur = ggml_get_tensor(meta, name);
+            ctx_size += sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE;
+            size_t tensor_size = ggml_nbytes(cur);
+            size_t padded_size = ggml_nbytes_pad(cur);
+            ctx_size += padded_size;
+            data_size += tensor_size;
+            if (verbosity >= 3) {
+                printf("%s: tensor[%d]: n_dims = %d, name = %s, tensor_size=%zu, padded_size=%zu, offset=%zu\n", __func__, i,
+                       cur->n_dims, cur->name, tensor_size, padded_size, offset);
+            }
+        }
+
+        // the stacked tensors, whose data the padded size of their parts covers
+        ctx_size += qkv_groups.size() * (sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE);
+    }
+
+    clip_ctx * new_clip = new clip_ctx;
+    new_clip->mapping = src.mapping;
+    new_clip->buffer = src.buffer;
+
+    // towers present in the file. their hparams are always read, their weights only if requested
+    bool file_has_text = false;
+    bool file_has_vision = false;
+
+    // model size and capabilities
+    {
+        int idx = get_key_idx(ctx, KEY_HAS_TEXT_ENC);
+        file_has_text = gguf_get_val_bool(ctx, idx);
+        new_clip->has_text_encoder = file_has_text && model_params.load_text_encoder;
+
+        idx = get_key_idx(ctx, KEY_HAS_VIS_ENC);
+        file_has_vision = gguf_get_val_bool(ctx, idx);
+        new_clip->has_vision_encoder = file_has_vision && model_params.load_vision_encoder;
+
+        idx = get_key_idx(ctx, KEY_USE_GELU);
+        new_clip->use_gelu = gguf_get_val_bool(ctx, idx);
+
+        if (verbosity >= 1) {
+            printf("%s: text_encoder:   %d%s\n", __func__, new_clip->has_text_encoder,
+                   file_has_text && !new_clip->has_text_encoder ? " (not loaded)" : "");
+            printf("%s: vision_encoder: %d%s\n", __func__, new_clip->has_vision_encoder,
+                   file_has_vision && !new_clip->has_vision_encoder ? " (not loaded)" : "");
+            printf("%s: model size:     %.2f MB\n", __func__, (ctx_size / 1024.0 / 1024.0));
+            printf("%s: mmap:           %d\n", __func__, new_clip->mapping != NULL);
+            printf("%s: zero-copy:      %d\n", __func__, zero_copy);
+            printf("%s: weight cache:   %d\n", __func__, from_cache);
+            printf("%s: metadata size:  %.2f MB\n", __func__, ggml_get_mem_size(meta) / 1024.0 / 1024.0);
+        }
+
+        if (!new_clip->has_text_encoder && !new_clip->has_vision_encoder) {
+            fprintf(stderr, "%s: none of the requested encoders is present in '%s'\n", __func__, fname);
+            ggml_free(meta);
+            gguf_free(ctx);
+            clip_free(new_clip);
+            return nullptr;
+        }
+    }
+
+    // load tensors
+    clip_tensor_loader loader;
+    std::vector<struct ggml_tensor *> tensors;
+    {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+
+        // with zero-copy only the tensor metadata lives in the context, the data stays where the model is
+        struct ggml_init_params params = {
+            .mem_size = zero_copy ? (n_loaded + qkv_groups.size()) * ggml_tensor_overhead() : ctx_size,
+            .mem_buffer = NULL,
+            .no_alloc = zero_copy,
+        };
+
+        new_clip->ctx = ggml_init(params);
+        if (!new_clip->ctx) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            ggml_free(meta);
+            gguf_free(ctx);
+            clip_free(new_clip);
+            return nullptr;
+        }
+
+        if (zero_copy && qkv_copy_size > 0 && !new_clip->qkv_buffer.resize(qkv_copy_size + GGML_MEM_ALIGN)) {
+            fprintf(stderr, "%s: failed to allocate %zu bytes for the stacked projections\n", __func__,
+                    qkv_copy_size);
+            ggml_free(meta);
+            gguf_free(ctx);
+            clip_free(new_clip);
+            return nullptr;
+        }
+        uint8_t * qkv_data = (uint8_t *)GGML_PAD((uintptr_t)new_clip->qkv_buffer.data, GGML_MEM_ALIGN);
+
+        // a tensor of the model, or a view of the stacked tensor it is part of, which is created with its first part
+        std::map<std::string, struct ggml_tensor *> qkv_tensors;
+        auto new_tensor = [&](const int i, const qkv_group *& group) {
+            const char * name = gguf_get_tensor_name(ctx, i);
+            struct ggml_tensor * t = ggml_get_tensor(meta, name);
+
+            std::string qkv_name;
+            int part = 0;
+            const auto it = clip_qkv_part(name, qkv_name, part) ? qkv_groups.find(qkv_name) : qkv_groups.end();
+            group = it != qkv_groups.end() ? &it->second : NULL;
+
+            struct ggml_tensor * cur;
+            if (!group) {
+                cur = ggml_dup_tensor(new_clip->ctx, t);
+            } else {
+                struct ggml_tensor *& qkv = qkv_tensors[qkv_name];
+                if (!qkv) {
+                    qkv = t->n_dims == 1 ? ggml_new_tensor_1d(new_clip->ctx, t->type, 3 * t->ne[0])
+                                         : ggml_new_tensor_2d(new_clip->ctx, t->type, t->ne[0], 3 * t->ne[1]);
+                    ggml_set_name(qkv, qkv_name.c_str());
+                    if (zero_copy && group->in_place) {
+                        // read-only like every mapped weight, the stacked tensor is never written
+                        qkv->data = const_cast<uint8_t *>(src.data) + gguf_get_data_offset(ctx) +
+                                    gguf_get_tensor_offset(ctx, group->idx[0]);
+                    } else if (zero_copy) {
+                        qkv->data = qkv_data + group->copy_offset;
+                    }
+                }
+                cur = t->n_dims == 1 ? ggml_view_1d(new_clip->ctx, qkv, t->ne[0], part * ggml_nbytes(t))
+                                     : ggml_view_2d(new_clip->ctx, qkv, t->ne[0], t->ne[1], qkv->nb[1],
+                                                    part * ggml_nbytes(t));
+            }
+            ggml_set_name(cur, name);
+            tensors.push_back(cur);
+            return cur;
+        };
+
+        if (src.data) {
+            for (int i = 0; i < n_tensors; ++i) {
+                const char * name = gguf_get_tensor_name(ctx, i);
+                if (skip_tensor(name)) {
+                    continue;
+                }
+                struct ggml_tensor * t = ggml_get_tensor(meta, name);
+                const qkv_group * group;
+                struct ggml_tensor * cur = new_tensor(i, group);
+
+                const size_t offset = gguf_get_data_offset(ctx) + gguf_get_tensor_offset(ctx, i);
+                if (offset + ggml_nbytes(t) > src.size) {
+                    fprintf(stderr, "%s: tensor %s is out of bounds of the model file\n", __func__, name);
+                    ggml_free(meta);
+                    gguf_free(ctx);
+                    clip_free(new_clip);
+                    return nullptr;
+                }
+
+                if (zero_copy && !group) {
+                    // the model is mapped or owned read-only and the weights are never written through the tensor
+                    cur->data = const_cast<uint8_t *>(src.data) + offset;
+                } else if (!zero_copy || !group->in_place) {
+                    memcpy(cur->data, src.data + offset, ggml_nbytes(t));
+                    // the mapped pages of a copied projection are not used again
+                    if (zero_copy) {
+                        new_clip->mapping->release(src.data + offset, ggml_nbytes(t));
+                    }
+                }
+            }
+        } else {
+            for (int i = 0; i < n_tensors; ++i) {
+                const char * name = gguf_get_tensor_name(ctx, i);
+                if (skip_tensor(name)) {
+                    continue;
+                }
+                struct ggml_tensor * t = ggml_get_tensor(meta, name);
+                const qkv_group * group;
+                struct ggml_tensor * cur = new_tensor(i, group);
+
+                const size_t offset = gguf_get_data_offset(ctx) + gguf_get_tensor_offset(ctx, i);
+                loader.add(cur->data, offset, ggml_nbytes(t));
+            }
+
+            // the tensor data is read in the background while the vocab and the model structure are set up below
+            loader.progress_callback = model_params.progress_callback;
+            loader.progress_callback_user_data = model_params.progress_callback_user_data;
+            if (!loader.start(fname, model_params.n_load_threads)) {
+                printf("cannot open model file for loading tensors\n");
+                ggml_free(meta);
+                gguf_free(ctx);
+                clip_free(new_clip);
+                return nullptr;
+            }
+        }
+    }
+
+    // text model
+    if (file_has_text) {
+        // load text model
+        auto & text_model = new_clip->text_model;
+        auto & hparams = text_model.hparams;
+        hparams.hidden_size = get_u32(ctx, format(KEY_N_EMBD, "text"));
+        hparams.n_head = get_u32(ctx, format(KEY_N_HEAD, "text"));
+        hparams.n_intermediate = get_u32(ctx, format(KEY_N_FF, "text"));
+        hparams.n_layer = get_u32(ctx, format(KEY_N_BLOCK, "text"));
+        hparams.num_positions = get_u32(ctx, KEY_N_POSITIONS);
+        hparams.projection_dim = get_u32(ctx, format(KEY_PROJ_DIM, "text"));
+        hparams.eps = get_f32(ctx, format(KEY_LAYER_NORM_EPS, "text"));
+
+        const int idx_tokens = get_key_idx(ctx, KEY_TOKENS);
+        hparams.n_vocab = gguf_get_arr_n(ctx, idx_tokens);
+        if (new_clip->has_text_encoder) {
+            auto & vocab = new_clip->vocab;
+            const int idx_order = gguf_find_key(ctx, KEY_CACHE_VOCAB_ORDER);
+            for (int id = 0; id < hparams.n_vocab; ++id) {
+                const std::string token = gguf_get_arr_str(ctx, idx_tokens, id);
+                vocab.id_to_token.emplace_hint(vocab.id_to_token.end(), id, token);
+                if (idx_order == -1) {
+                    vocab.token_to_id[token] = id;
+                }
+            }
+
+            // a cache lists the ids in token order, which builds the lookup in linear time
+            if (idx_order != -1) {
+                const int32_t * order = (const int32_t *)gguf_get_arr_data(ctx, idx_order);
+                const int n_order = gguf_get_arr_n(ctx, idx_order);
+                for (int i = 0; i < n_order && order[i] >= 0 && order[i] < hparams.n_vocab; ++i) {
+                    vocab.token_to_id.emplace_hint(vocab.token_to_id.end(), gguf_get_arr_str(ctx, idx_tokens, order[i]),
+                                                   order[i]);
+                }
+            }
+        }
+
+        if (verbosity >= 2) {
+            printf("\n%s: text model hparams\n", __func__);
+            printf("n_vocab            %d\n", hparams.n_vocab);
+            printf("num_positions      %d\n", hparams.num_positions);
+            printf("t_hidden_size      %d\n", hparams.hidden_size);
+            printf("t_n_intermediate   %d\n", hparams.n_intermediate);
+            printf("t_projection_dim   %d\n", hparams.projection_dim);
+            printf("t_n_head           %d\n", hparams.n_head);
+            printf("t_n_layer          %d\n", hparams.n_layer);
+        }
+    }
+
+    // vision model
+    if (file_has_vision) {
+        // load vision model
+        auto & vision_model = new_clip->vision_model;
+        auto & hparams = vision_model.hparams;
+        hparams.hidden_size = get_u32(ctx, format(KEY_N_EMBD, "vision"));
+        hparams.n_head = get_u32(ctx, format(KEY_N_HEAD, "vision"));
+        hparams.n_intermediate = get_u32(ctx, format(KEY_N_FF, "vision"));
+        hparams.n_layer = get_u32(ctx, format(KEY_N_BLOCK, "vision"));
+        hparams.image_size = get_u32(ctx, KEY_IMAGE_SIZE);
+        hparams.patch_size = get_u32(ctx, KEY_PATCH_SIZE);
+        hparams.projection_dim = get_u32(ctx, format(KEY_PROJ_DIM, "vision"));
+        hparams.eps = get_f32(ctx, format(KEY_LAYER_NORM_EPS, "vision"));
+
+        if (new_clip->has_vision_encoder) {
+            int idx_mean = get_key_idx(ctx, KEY_IMAGE_MEAN);
+            int idx_std = get_key_idx(ctx, KEY_IMAGE_STD);
+            for (int i = 0; i < 3; ++i) {
+                new_clip->image_mean[i] = ((float *)gguf_get_arr_data(ctx, idx_mean))[i];
+                new_clip->image_std[i] = ((float *)gguf_get_arr_data(ctx, idx_std))[i];
+            }
+        }
+
+        if (verbosity >= 2) {
+            printf("\n%s: vision model hparams\n", __func__);
+            printf("image_size         %d\n", hparams.image_size);
+            printf("patch_size         %d\n", hparams.patch_size);
+            printf("v_hidden_size      %d\n", hparams.hidden_size);
+            printf("v_n_intermediate   %d\n", hparams.n_intermediate);
+            printf("v_projection_dim   %d\n", hparams.projection_dim);
+            printf("v_n_head           %d\n", hparams.n_head);
+            printf("v_n_layer          %d\n", hparams.n_layer);
+        }
+    }
+
+    // bind the weights of the loaded towers
+    {
+        std::vector<clip_tensor_slot> slots;
+        if (new_clip->has_text_encoder) {
+            clip_text_tensors(new_clip->text_model, slots);
+        }
+        if (new_clip->has_vision_encoder) {
+            clip_vision_tensors(new_clip->vision_model, slots);
+        }
+
+        if (from_cache && slots.size() != tensors.size()) {
+            fprintf(stderr, "%s: weight cache '%s' has %zu tensors, expected %zu\n", __func__, fname, tensors.size(),
+                    slots.size());
+            loader.wait();
+            ggml_free(meta);
+            gguf_free(ctx);
+            clip_free(new_clip);
+            return nullptr;
+        }
+
+        for (size_t i = 0; i < slots.size(); ++i) {
+            *slots[i].tensor = from_cache ? tensors[i] : get_tensor(new_clip->ctx, slots[i].name);
+        }
+
+        if (new_clip->has_text_encoder) {
+            clip_bind_qkv(new_clip->ctx, "t", new_clip->text_model.layers);
+        }
+        if (new_clip->has_vision_encoder) {
+            clip_bind_qkv(new_clip->ctx, "v", new_clip->vision_model.layers);
+        }
+    }
+
+    if (!loader.wait()) {
+        fprintf(stderr, "%s: failed to read tensor data from '%s'\n", __func__, fname);
+        ggml_free(meta);
+        gguf_free(ctx);
+        clip_free(new_clip);
+        return nullptr;
+    }
+
+    // a model already in memory is fully loaded once its tensors are set up
+    if (src.data && model_params.progress_callback) {
+        model_params.progress_callback(data_size, data_size, model_params.progress_callback_user_data);
+    }
+
+    // layers can only be streamed when their pages can be dropped and read back from the model file
+    if (model_params.layer_budget > 0) {
+        if (new_clip->mapping && zero_copy) {
+            if (new_clip->has_text_encoder) {
+                new_clip->text_window = clip_stream_window(new_clip->text_model.layers, model_params.layer_budget);
+            }
+            if (new_clip->has_vision_encoder) {
+                new_clip->vision_window = clip_stream_window(new_clip->vision_model.layers, model_params.layer_budget);
+            }
+            clip_release_layers(new_clip);
+        } else {
+            fprintf(stderr, "%s: ignoring the layer budget, the weights are not mapped in place\n", __func__);
+        }
+
+        if (verbosity >= 1) {
+            printf("%s: layer budget:   %.2f MB, resident layers text %d, vision %d (0 = all)\n", __func__,
+                   model_params.layer_budget / 1024.0 / 1024.0, new_clip->text_window, new_clip->vision_window);
+        }
+    }
+
+    if (model_params.cpus && model_params.n_cpus > 0) {
+        new_clip->cpus.assign(model_params.cpus, model_params.cpus + model_params.n_cpus);
+    } else if (model_params.performance_cores_only) {
+        new_clip->cpus = clip_performance_cpus();
+        if (new_clip->cpus.empty()) {
+            fprintf(stderr, "%s: can't tell the performance cores apart, not pinning compute threads\n", __func__);
+        }
+    }
+
+    if (verbosity >= 1 && !new_clip->cpus.empty()) {
+        printf("%s: compute cpus:  ", __func__);
+        for (const int cpu : new_clip->cpus) {
+            printf(" %d", cpu);
+        }
+        printf("\n");
+    }
+
+    if (model_params.numa) {
+        clip_numa_replicate(new_clip, verbosity);
+    }
+
+    ggml_free(meta);
+
+    new_clip->ctx_gguf = ctx;
+
+    new_clip->task_pool = new clip_task_pool;
+    new_clip->state = clip_init_state(new_clip);
+    if (!new_clip->state) {
+        fprintf(stderr, "%s: failed to allocate the compute buffers\n", __func__);
+        clip_free(new_clip);
+        return nullptr;
+    }
+    if (verbosity >= 1) {
+        printf("\n%s: compute buffer: text %.2f MB, vision %.2f MB (batch size 1)\n", __func__,
+               new_clip->state->text_mem / 1024.0 / 1024.0, new_clip->state->vision_mem / 1024.0 / 1024.0);
+    }
+
+    return new_clip;
+}
+
+bool clip_tokenize(const clip_ctx * ctx, const char * text, struct clip_tokens * tokens) {
+    if (!ctx->has_text_encoder) {
+        printf("This GGUF file seems to have no text encoder\n");
+        return false;
+    }
+
+    std::vector<std::string> words;
+
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+
+        // Generate the subpattern from the special_tokens vector if it's not empty
+        if (!ctx->vocab.special_tokens.empty()) {
+            std::string special_tokens_subpattern;
+            for (const auto & token : ctx->vocab.special_tokens) {
+                if (!special_tokens_subpattern.empty()) {
+                    special_tokens_subpattern += "|";
+                }
+                special_tokens_subpattern += token;
+            }
+
+            // Modify the regex pattern with the generated special tokens subpattern
+            pat = special_tokens_subpattern + "|" + pat;
+        }
+
+        std::regex re(pat);
+        std::smatch m;
+
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
+        }
+    }
+
+    std::vector<clip_vocab::id> v_tokens;
+    v_tokens.push_back(49406); // startoftext
+
+    for (const auto & word : words) {
+        // feel lucky? let's try if it's a full word
+        std::string full_word = "";
+        if (word.find(" ") == 0) // starts_with for C++11
+        {
+            full_word += word.substr(1);
+        } else {
+            full_word += word;
+        }
+        full_word += "</w>";
+        auto wit = ctx->vocab.token_to_id.find(full_word);
+        if (wit != ctx->vocab.token_to_id.end()) {
+            v_tokens.push_back(wit->second);
+            continue;
+        }
+
+        for (int i = 0; i < word.size();) {
+            for (int j = word.size() - 1; j >= i; j--) {
+                auto cand = word.substr(i, j - i + 1);
+                auto it = ctx->vocab.token_to_id.find(cand);
+                if (it != ctx->vocab.token_to_id.end()) { // word.substr(i, j-i+1) in vocab
+                    v_tokens.push_back(it->second);
+                    i = j + 1;
+                    break;
+                } else if (j == i) { // word.substr(i, 1) has no matching
+                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, word.substr(i, 1).data());
+                    i++;
+                }
+            }
+        }
+    }
+
+    v_tokens.push_back(49407); // endoftext
+
+    tokens->size = v_tokens.size();
+
+    tokens->data = new int[v_tokens.size()];
+    std::copy(v_tokens.begin(), v_tokens.end(), tokens->data);
+
+    return true;
+}
+
+clip_image_u8 * clip_image_u8_make() { return new clip_image_u8(); }
+
+clip_image_f32 * clip_image_f32_make() { return new clip_image_f32(); }
+
+void clip_image_u8_clean(clip_image_u8* img) {
+    if (img->data){
+	delete[] img->data;
+	img->data = NULL;
+    }
+}
+
+void clip_image_f32_clean(clip_image_f32* res) {
+    if (res->data){
+	delete[] res->data;
+	res->data = NULL;
+    }
+}
+
+void clip_image_u8_free(clip_image_u8* img) {
+    clip_image_u8_clean(img);
+    delete img;
+}
+
+void clip_image_f32_free(clip_image_f32* res) {
+    clip_image_f32_clean(res);
+    delete res;
+}
+
+bool clip_image_load_from_file(const char * fname, clip_image_u8 * img) {
+    int nx, ny, nc;
+    auto data = stbi_load(fname, &nx, &ny, &nc, 3);
+    if (!data) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return false;
+    }
+
+    img->nx = nx;
+    img->ny = ny;
+    img->size = nx * ny * 3;
+    img->data = new uint8_t[img->size]();
+    memcpy(img->data, data, img->size);
+
+    stbi_image_free(data);
+
+    return true;
+}
+
+static inline double bicubic_filter(double x) {
+#define a -0.5
+    if (x < 0.0) {
+        x = -x;
+    }
+    if (x < 1.0) {
+        return ((a + 2.0) * x - (a + 3.0)) * x * x + 1;
+    }
+    if (x < 2.0) {
+        return (((x - 5) * x + 8) * x - 4) * a;
+    }
+    return 0.0;
+#undef a
+}
+
+static bool precompute_coeffs(int inSize, float in0, float in1, int outSize, double ** kkp, int ** boundsp, int * ksize) {
+    double support = 2.0; // Bicubic filter support from Resample.c
+    double filterscale = (double)(in1 - in0) / outSize;
+    if (filterscale < 1.0) {
+        filterscale = 1.0;
+    }
+    support *= filterscale;
+    int ksize_local = (int)ceil(support) * 2 + 1;
+
+    double * kk = (double *)malloc(outSize * ksize_local * sizeof(double));
+    int * bounds = (int *)malloc(outSize * 2 * sizeof(int));
+    if (!kk || !bounds) {
+        free(kk);
+        free(bounds);
+        return false;
+    }
+
+    for (int xx = 0; xx < outSize; xx++) {
+        double center = in0 + (xx + 0.5) * (in1 - in0) / outSize;
+        double ww = 0.0;
+        double ss = 1.0 / filterscale;
+        int xmin = (int)(center - support + 0.5);
+        if (xmin < 0)
+            xmin = 0;
+        int xmax = (int)(center + support + 0.5);
+        if (xmax > inSize)
+            xmax = inSize;
+        xmax -= xmin;
+
+        double * k = &kk[xx * ksize_local];
+        for (int x = 0; x < xmax; x++) {
+            double w = bicubic_filter((x + xmin - center + 0.5) * ss);
+            k[x] = w;
+            ww += w;
+        }
+        for (int x = 0; x < xmax; x++) {
+            if (ww != 0.0) {
+                k[x] /= ww;
+            }
+        }
+        for (int x = xmax; x < ksize_local; x++) {
+            k[x] = 0.0;
+        }
+        bounds[xx * 2 + 0] = xmin;
+        bounds[xx * 2 + 1] = xmax;
+    }
+
+    *kkp = kk;
+    *boundsp = bounds;
+    *ksize = ksize_local;
+    return true;
+}
+
+// normalize: x = (x - mean) / std
+bool clip_image_preprocess(const clip_ctx * ctx, const clip_image_u8 * img, clip_image_f32 * res) {
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return false;
+    }
+
+    const int nx = img->nx;
+    const int ny = img->ny;
+    const int nx2 = ctx->vision_model.hparams.image_size;
+    const int ny2 = ctx->vision_model.hparams.image_size;
+
+    // Setting the output image size and allocating memory
+    res->nx = nx2;
+    res->ny = ny2;
+    res->size = 3 * nx2 * ny2;
+    res->data = new float[res->size]();
+    if (!res->data) {
+        printf("clip_image_f32 Memory allocation failed\n");
+        return false;
+    }
+
+    // Calculate aspect ratio maintaining scaling
+    const float scale = std::min((float)nx, (float)ny) / (float)ctx->vision_model.hparams.image_size;
+    const int nx3 = (int)(nx / scale + 0.5f);
+    const int ny3 = (int)(ny / scale + 0.5f);
+
+    const auto & m3 = ctx->image_mean;
+    const auto & s3 = ctx->image_std;
+
+    // Calculating horizontal and vertical coeffs
+    double *kk_horiz, *kk_vert;
+    int *bounds_horiz, *bounds_vert;
+    int ksize_horiz, ksize_vert;
+
+    if (!precompute_coeffs(nx, 0.0f, (float)nx, nx3, &kk_horiz, &bounds_horiz, &ksize_horiz) ||
+        !precompute_coeffs(ny, 0.0f, (float)ny, ny3, &kk_vert, &bounds_vert, &ksize_vert)) {
+        delete[] res->data;
+        free(kk_horiz);
+        free(bounds_horiz);
+        free(kk_vert);
+        free(bounds_vert);
+        printf("Failed to calculate coeffs\n");
+        return false;
     }
 
     // Intermediate image buffer (stores horizontal resampling results)
@@ -859,322 +2408,955 @@ bool clip_image_preprocess(const clip_ctx * ctx, const clip_image_u8 * img, clip
             double * k = &kk_horiz[xx * ksize_horiz];
             for (int c = 0; c < 3; c++) {
                 double ss = 0.0;
-                for (int x = 0; x < xmax; x++) {
-                    int src_idx = 3 * (y * nx + (x + xmin)) + c;
-                    ss += (double)img->data[src_idx] * k[x];
+                for (int x = 0; x < xmax; x++) {
+                    int src_idx = 3 * (y * nx + (x + xmin)) + c;
+                    ss += (double)img->data[src_idx] * k[x];
+                }
+                int dst_idx = 3 * (y * nx3 + xx) + c;
+                temp[dst_idx] = std::min(std::max((float)ss, 0.0f), 255.0f);
+            }
+        }
+    }
+
+    // Vertical bicubic resampling
+    float * resampled = new float[3 * nx3 * ny3]();
+    if (!resampled) {
+        delete[] temp;
+        delete[] res->data;
+        free(kk_horiz);
+        free(bounds_horiz);
+        free(kk_vert);
+        free(bounds_vert);
+        printf("Failed to allocate resampling buffer memory\n");
+        return false;
+    }
+
+    for (int yy = 0; yy < ny3; yy++) {
+        int ymin = bounds_vert[yy * 2 + 0];
+        int ymax = bounds_vert[yy * 2 + 1];
+        double * k = &kk_vert[yy * ksize_vert];
+        for (int x = 0; x < nx3; x++) {
+            for (int c = 0; c < 3; c++) {
+                double ss = 0.0;
+                for (int y = 0; y < ymax; y++) {
+                    int src_idx = 3 * ((y + ymin) * nx3 + x) + c;
+                    ss += (double)temp[src_idx] * k[y];
                 }
-                int dst_idx = 3 * (y * nx3 + xx) + c;
-                temp[dst_idx] = std::min(std::max((float)ss, 0.0f), 255.0f);
+                int dst_idx = 3 * (yy * nx3 + x) + c;
+                resampled[dst_idx] = std::min(std::max((float)ss, 0.0f), 255.0f);
+            }
+        }
+    }
+
+    // Center crop and normalize
+    int x_offset = (nx3 - nx2) / 2;
+    int y_offset = (ny3 - ny2) / 2;
+
+    for (int yy = 0; yy < ny2; yy++) {
+        for (int x = 0; x < nx2; x++) {
+            int src_y = yy + y_offset;
+            int src_x = x + x_offset;
+            int src_idx = 3 * (src_y * nx3 + src_x);
+            int dst_idx = 3 * (yy * nx2 + x);
+            for (int c = 0; c < 3; c++) {
+                float v = resampled[src_idx + c];
+                res->data[dst_idx + c] = ((v / 255.0f) - m3[c]) / s3[c];
             }
         }
     }
 
-    // Vertical bicubic resampling
-    float * resampled = new float[3 * nx3 * ny3]();
-    if (!resampled) {
-        delete[] temp;
-        delete[] res->data;
-        free(kk_horiz);
-        free(bounds_horiz);
-        free(kk_vert);
-        free(bounds_vert);
-        printf("Failed to allocate resampling buffer memory\n");
-        return false;
-    }
+    delete[] resampled;
+    delete[] temp;
+    free(kk_horiz);
+    free(bounds_horiz);
+    free(kk_vert);
+    free(bounds_vert);
+
+    return true;
+}
+
+struct clip_preprocess_task {
+    const clip_ctx * ctx;
+    const clip_image_u8_batch * inputs;
+    clip_image_f32_batch * outputs;
+    std::vector<int> order; // images by decreasing pixel count
+};
+
+// Preprocess a batch on the task pool of the model. The time to resize an image grows with its pixel count, so the
+// images are handed out largest first: the small ones at the end fill the gaps, and no thread is left with a large
+// image when the others run out of work.
+void clip_image_batch_preprocess(const clip_ctx * ctx, const int n_threads, const clip_image_u8_batch * img_inputs,
+                                 clip_image_f32_batch * imgs_resized) {
+    imgs_resized->size = img_inputs->size;
+
+    clip_preprocess_task task = {ctx, img_inputs, imgs_resized, std::vector<int>(img_inputs->size)};
+    for (size_t i = 0; i < img_inputs->size; i++) {
+        task.order[i] = i;
+    }
+    std::stable_sort(task.order.begin(), task.order.end(), [&](const int a, const int b) {
+        return (int64_t)img_inputs->data[a].nx * img_inputs->data[a].ny >
+               (int64_t)img_inputs->data[b].nx * img_inputs->data[b].ny;
+    });
+
+    const auto preprocess = [](void * data, const int i) {
+        const clip_preprocess_task * task = (const clip_preprocess_task *)data;
+        const int k = task->order[i];
+        clip_image_preprocess(task->ctx, &task->inputs->data[k], &task->outputs->data[k]);
+    };
+    clip_task_pool_run(ctx->task_pool, n_threads, img_inputs->size, preprocess, &task);
+}
+
+void clip_free(clip_ctx * ctx) {
+    if (ctx->ctx) {
+        ggml_free(ctx->ctx);
+    }
+    gguf_free(ctx->ctx_gguf);
+    clip_free_state(ctx->state);
+    delete ctx->task_pool;
+    delete ctx->mapping;
+    delete ctx->buffer;
+    delete ctx;
+}
+
+//
+// compute graphs
+//
+
+// The q, k and v projections of cur split into heads, as [d_head, n_head, n_pos, n_batch] tensors. A layer with
+// stacked projections computes the three with one matmul and the heads are views of its result.
+static void clip_qkv_heads(struct ggml_context * ctx0, const clip_layer & layer, struct ggml_tensor * cur,
+                           const int d_head, const int n_head, const int n_pos, const int n_batch,
+                           struct ggml_tensor * heads[3]) {
+    if (layer.qkv_w) {
+        struct ggml_tensor * qkv = ggml_add(ctx0, ggml_mul_mat(ctx0, layer.qkv_w, cur), layer.qkv_b);
+        for (int i = 0; i < 3; ++i) {
+            heads[i] = ggml_view_4d(ctx0, qkv, d_head, n_head, n_pos, n_batch, d_head * ggml_element_size(qkv),
+                                    qkv->nb[1], qkv->nb[2], i * d_head * n_head * ggml_element_size(qkv));
+        }
+        return;
+    }
+
+    struct ggml_tensor * weights[3] = {layer.q_w, layer.k_w, layer.v_w};
+    struct ggml_tensor * biases[3] = {layer.q_b, layer.k_b, layer.v_b};
+    for (int i = 0; i < 3; ++i) {
+        struct ggml_tensor * cur_i = ggml_add(ctx0, ggml_mul_mat(ctx0, weights[i], cur), biases[i]);
+        heads[i] = ggml_reshape_4d(ctx0, cur_i, d_head, n_head, n_pos, n_batch);
+    }
+}
+
+// layer_outputs, if given, receives the output of every layer
+static struct ggml_cgraph * clip_text_build_graph(const clip_ctx * ctx, const clip_text_model & model,
+                                                  struct ggml_context * ctx0, struct ggml_allocr * alloc,
+                                                  const clip_tokens * tokens, const bool normalize,
+                                                  std::vector<struct ggml_tensor *> * layer_outputs = NULL) {
+    const auto & hparams = model.hparams;
+    const int N = tokens->size;
+
+    const int hidden_size = hparams.hidden_size;
+    const int n_head = hparams.n_head;
+    const int d_head = hidden_size / n_head;
+    const int n_layer = hparams.n_layer;
+    const float eps = hparams.eps;
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    // inputs are named and written by clip_text_set_inputs()
+    struct ggml_tensor * input_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_name(input_ids, "input_ids");
+    ggml_allocr_alloc(alloc, input_ids);
+
+    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_name(positions, "positions");
+    ggml_allocr_alloc(alloc, positions);
+
+    struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+    ggml_set_name(KQ_scale, "KQ_scale");
+    ggml_allocr_alloc(alloc, KQ_scale);
+
+    struct ggml_tensor * embeddings = ggml_get_rows(ctx0, model.token_embeddings, input_ids);
+
+    embeddings = ggml_add(ctx0, ggml_get_rows(ctx0, model.position_embeddings, positions), embeddings);
+
+    // loop over layers
+    for (int il = 0; il < n_layer; il++) {
+        struct ggml_tensor * cur = embeddings; // embeddings = residual, cur = hidden_states
+
+        // layernorm1
+        {
+            cur = ggml_norm_affine(ctx0, cur, model.layers[il].ln_1_w, model.layers[il].ln_1_b, eps);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * QKV[3];
+            clip_qkv_heads(ctx0, model.layers[il], cur, d_head, n_head, N, 1, QKV);
+
+            struct ggml_tensor * Q = ggml_cont(ctx0, ggml_permute(ctx0, QKV[0], 0, 2, 1, 3));
+            Q = ggml_scale_inplace(ctx0, Q, KQ_scale);
+            Q = ggml_reshape_3d(ctx0, Q, d_head, N, n_head);
+
+            struct ggml_tensor * K = ggml_cont(ctx0, ggml_permute(ctx0, QKV[1], 0, 2, 1, 3));
+            K = ggml_reshape_3d(ctx0, K, d_head, N, n_head);
+
+            struct ggml_tensor * V = ggml_cont(ctx0, ggml_permute(ctx0, QKV[2], 1, 2, 0, 3));
+            V = ggml_reshape_3d(ctx0, V, N, d_head, n_head);
+
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            KQ = ggml_diag_mask_inf_inplace(ctx0, KQ, 0); // causal masking
+            KQ = ggml_soft_max_inplace(ctx0, KQ);
+
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ);
+            KQV = ggml_reshape_4d(ctx0, KQV, d_head, N, n_head, 1);
+            KQV = ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
+
+            cur = ggml_cpy(ctx0, KQV, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, hidden_size, N));
+        }
+
+        // attention output
+        cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].o_w, cur), model.layers[il].o_b);
+
+        // re-add the layer input, e.g., residual
+        cur = ggml_add(ctx0, cur, embeddings);
+
+        embeddings = cur; // embeddings = residual, cur = hidden_states
+
+        // layernorm2
+        {
+            cur = ggml_norm_affine(ctx0, cur, model.layers[il].ln_2_w, model.layers[il].ln_2_b, eps);
+        }
+
+        cur = ggml_mul_mat(ctx0, model.layers[il].ff_i_w, cur);
+        cur = ggml_add(ctx0, cur, model.layers[il].ff_i_b);
+
+        if (ctx->use_gelu) {
+            cur = ggml_gelu_inplace(ctx0, cur);
+        } else {
+            cur = ggml_gelu_quick_inplace(ctx0, cur);
+        }
+
+        cur = ggml_mul_mat(ctx0, model.layers[il].ff_o_w, cur);
+        cur = ggml_add(ctx0, cur, model.layers[il].ff_o_b);
+
+        // residual 2
+        cur = ggml_add(ctx0, embeddings, cur);
+
+        embeddings = cur;
+
+        if (layer_outputs) {
+            layer_outputs->push_back(embeddings);
+        }
+    }
+
+    // final -layer_norm
+    {
+        embeddings = ggml_norm_affine(ctx0, embeddings, model.post_ln_w, model.post_ln_b, eps);
+    }
+
+    // get the output of eot token, e.g., last index
+    struct ggml_tensor * eot = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, 1);
+    ggml_set_name(eot, "eot");
+    ggml_allocr_alloc(alloc, eot);
+    embeddings = ggml_get_rows(ctx0, embeddings, eot);
+
+    // text projection
+    embeddings = ggml_mul_mat(ctx0, model.projection, embeddings);
+
+    // normalize output embeddings
+    if (normalize) {
+        struct ggml_tensor * one = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+        ggml_set_name(one, "one");
+        ggml_allocr_alloc(alloc, one);
+
+        ggml_tensor * length = ggml_sqrt(ctx0, ggml_sum(ctx0, ggml_sqr(ctx0, embeddings)));
+        embeddings = ggml_scale_inplace(ctx0, embeddings, ggml_div(ctx0, one, length));
+    }
+
+    ggml_set_name(embeddings, "check");
+
+    ggml_build_forward_expand(gf, embeddings);
+
+    return gf;
+}
+
+// il_begin and il_end limit the graph to a range of layers for a pipeline stage: a range that doesn't start at the
+// first layer takes the hidden states after the layer before it as input, one that doesn't end at the last layer
+// gives the hidden states after it as output
+static struct ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_vision_model & model,
+                                                   struct ggml_context * ctx0, struct ggml_allocr * alloc,
+                                                   const clip_image_f32_batch * imgs, const bool normalize,
+                                                   std::vector<struct ggml_tensor *> * layer_outputs = NULL,
+                                                   const int il_begin = 0, int il_end = -1) {
+    const auto & hparams = model.hparams;
+
+    const int image_size = hparams.image_size;
+    const int patch_size = hparams.patch_size;
+    const int num_patches = ((image_size / patch_size) * (image_size / patch_size));
+    const int num_positions = num_patches + 1;
+    const int hidden_size = hparams.hidden_size;
+    const int n_head = hparams.n_head;
+    const int d_head = hidden_size / n_head;
+    const int n_layer = hparams.n_layer;
+    const int projection_dim = hparams.projection_dim;
+    const float eps = hparams.eps;
+    const int batch_size = imgs->size;
+
+    if (il_end < 0) {
+        il_end = n_layer;
+    }
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    // inputs are named and written by clip_image_set_inputs()
+    struct ggml_tensor * embeddings = NULL;
+    if (il_begin > 0) {
+        embeddings = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size);
+        ggml_set_name(embeddings, "inp_hidden");
+        ggml_allocr_alloc(alloc, embeddings);
+    } else {
+        // the image comes in as one row of pixels per patch after an empty row in the place of the class token, so
+        // the patch embedding is a plain matmul, with any weight type, whose result is already in position order
+        const int patch_dim = 3 * patch_size * patch_size;
+
+        struct ggml_tensor * inp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, patch_dim, num_positions, batch_size);
+        ggml_set_name(inp, "inp_patches");
+        ggml_allocr_alloc(alloc, inp);
+
+        struct ggml_tensor * patch_w = model.patch_embeddings;
+        if (patch_w->n_dims > 2) {
+            patch_w = ggml_reshape_2d(ctx0, patch_w, patch_dim, hidden_size);
+        }
+
+        embeddings = ggml_mul_mat(ctx0, patch_w, inp);
+
+        struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_positions);
+        ggml_set_name(positions, "positions");
+        ggml_allocr_alloc(alloc, positions);
+
+        // the class embedding goes into the empty first row along with its position embedding
+        struct ggml_tensor * pos = ggml_get_rows(ctx0, model.position_embeddings, positions);
+        pos = ggml_acc(ctx0, pos, model.class_embedding, pos->nb[1], pos->nb[2], pos->nb[3], 0);
+
+        embeddings = ggml_add(ctx0, embeddings, pos);
+
+        // pre-layernorm
+        {
+            embeddings = ggml_norm_affine(ctx0, embeddings, model.pre_ln_w, model.pre_ln_b, eps);
+        }
+    }
+
+    // loop over layers
+    for (int il = il_begin; il < il_end; il++) {
+        struct ggml_tensor * cur = embeddings; // embeddings = residual, cur = hidden_states
+
+        // layernorm1
+        {
+            cur = ggml_norm_affine(ctx0, cur, model.layers[il].ln_1_w, model.layers[il].ln_1_b, eps);
+        }
+
+        // self-attention
+        {
+
+            struct ggml_tensor * QKV[3];
+            clip_qkv_heads(ctx0, model.layers[il], cur, d_head, n_head, num_positions, batch_size, QKV);
+
+            // the heads are read in place from the projections, and the scores never leave the op
+            struct ggml_tensor * Q = ggml_permute(ctx0, QKV[0], 0, 2, 1, 3);
+            struct ggml_tensor * K = ggml_permute(ctx0, QKV[1], 0, 2, 1, 3);
+            struct ggml_tensor * V = ggml_permute(ctx0, QKV[2], 0, 2, 1, 3);
+
+            cur = ggml_flash_attn_ext(ctx0, Q, K, V, 1.0f / sqrtf((float)d_head));
+            cur = ggml_reshape_3d(ctx0, cur, hidden_size, num_positions, batch_size);
+        }
+
+        // attention output
+        cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].o_w, cur), model.layers[il].o_b);
+
+        // re-add the layer input, e.g., residual
+        cur = ggml_add(ctx0, cur, embeddings);
+
+        embeddings = cur; // embeddings = residual, cur = hidden_states
+
+        // layernorm2
+        {
+            cur = ggml_norm_affine(ctx0, cur, model.layers[il].ln_2_w, model.layers[il].ln_2_b, eps);
+        }
+
+        cur = ggml_mul_mat(ctx0, model.layers[il].ff_i_w, cur);
+        cur = ggml_add(ctx0, cur, model.layers[il].ff_i_b);
+
+        if (ctx->use_gelu) {
+            cur = ggml_gelu_inplace(ctx0, cur);
+        } else {
+            cur = ggml_gelu_quick_inplace(ctx0, cur);
+        }
+
+        cur = ggml_mul_mat(ctx0, model.layers[il].ff_o_w, cur);
+        cur = ggml_add(ctx0, cur, model.layers[il].ff_o_b);
+
+        // residual 2
+        cur = ggml_add(ctx0, embeddings, cur);
+
+        embeddings = cur;
+
+        if (layer_outputs) {
+            layer_outputs->push_back(embeddings);
+        }
+    }
+
+    // a stage before the last one hands its hidden states on
+    if (il_end < n_layer) {
+        ggml_set_name(embeddings, "out_hidden");
+        ggml_build_forward_expand(gf, embeddings);
+
+        return gf;
+    }
+
+    // get the output of cls token, e.g., 0th index
+    struct ggml_tensor * cls = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, batch_size);
+    ggml_set_name(cls, "cls");
+    ggml_allocr_alloc(alloc, cls);
+    embeddings = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, embeddings, hidden_size, num_positions * batch_size), cls);
+
+    // post-layernorm
+    {
+        embeddings = ggml_norm_affine(ctx0, embeddings, model.post_ln_w, model.post_ln_b, eps);
+    }
+
+    // final visual projection
+    embeddings = ggml_mul_mat(ctx0, model.projection, embeddings);
+
+    // normalize output embeddings
+    struct ggml_tensor * output = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, projection_dim, batch_size);
+    ggml_set_name(output, "output");
+    ggml_allocr_alloc(alloc, output);
+
+    struct ggml_tensor * one = NULL;
+    if (normalize) {
+        one = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+        ggml_set_name(one, "one");
+        ggml_allocr_alloc(alloc, one);
+    }
+
+    for (int b = 0; b < batch_size; b++) {
+        struct ggml_tensor * row = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, 1);
+        ggml_format_name(row, "row%d", b);
+        ggml_allocr_alloc(alloc, row);
 
-    for (int yy = 0; yy < ny3; yy++) {
-        int ymin = bounds_vert[yy * 2 + 0];
-        int ymax = bounds_vert[yy * 2 + 1];
-        double * k = &kk_vert[yy * ksize_vert];
-        for (int x = 0; x < nx3; x++) {
-            for (int c = 0; c < 3; c++) {
-                double ss = 0.0;
-                for (int y = 0; y < ymax; y++) {
-                    int src_idx = 3 * ((y + ymin) * nx3 + x) + c;
-                    ss += (double)temp[src_idx] * k[y];
-                }
-                int dst_idx = 3 * (yy * nx3 + x) + c;
-                resampled[dst_idx] = std::min(std::max((float)ss, 0.0f), 255.0f);
-            }
+        struct ggml_tensor * embedding = ggml_get_rows(ctx0, embeddings, row);
+        if (normalize) {
+            ggml_tensor * length = ggml_sqrt(ctx0, ggml_sum(ctx0, ggml_sqr(ctx0, embedding)));
+            embedding = ggml_scale_inplace(ctx0, embedding, ggml_div(ctx0, one, length));
         }
+        output = ggml_acc(ctx0, output, embedding, output->nb[1], output->nb[2], output->nb[3], b * ggml_nbytes(embedding));
     }
+    ggml_set_name(output, "check");
 
-    // Center crop and normalize
-    int x_offset = (nx3 - nx2) / 2;
-    int y_offset = (ny3 - ny2) / 2;
+    ggml_build_forward_expand(gf, output);
 
-    for (int yy = 0; yy < ny2; yy++) {
-        for (int x = 0; x < nx2; x++) {
-            int src_y = yy + y_offset;
-            int src_x = x + x_offset;
-            int src_idx = 3 * (src_y * nx3 + src_x);
-            int dst_idx = 3 * (yy * nx2 + x);
-            for (int c = 0; c < 3; c++) {
-                float v = resampled[src_idx + c];
-                res->data[dst_idx + c] = ((v / 255.0f) - m3[c]) / s3[c];
-            }
+    return gf;
+}
+
+// how many of the pending nodes are searched for nodes that can be computed side by side with the first one
+static const int concurrency_lookahead = 32;
+
+// group the nodes of a graph that don't depend on each other into steps that are computed side by side and runs of
+// row-wise nodes into chains that are computed without barriers in between, then place its activations with a barrier
+// only after a node that ends both its step and its chain, so that no node reuses memory another one still reads
+static size_t clip_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * gf, std::vector<int> & steps,
+                               std::vector<int> & chains) {
+    steps.resize(gf->n_nodes);
+    ggml_graph_find_concurrency(gf, steps.data(), concurrency_lookahead);
+    chains.resize(gf->n_nodes);
+    ggml_graph_find_chains(gf, steps.data(), chains.data());
+
+    std::vector<int> seq;
+    seq.reserve(2 * gf->n_nodes);
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        seq.push_back(i);
+        if (steps[i] == 1 && chains[i] == 1) {
+            seq.push_back(-1);
         }
     }
 
-    delete[] resampled;
-    delete[] temp;
-    free(kk_horiz);
-    free(bounds_horiz);
-    free(kk_vert);
-    free(bounds_vert);
+    ggml_allocr_set_parse_seq(alloc, seq.data(), seq.size());
+    const size_t size = ggml_allocr_alloc_graph(alloc, gf);
+    ggml_allocr_set_parse_seq(alloc, NULL, 0);
 
-    return true;
+    return size;
 }
 
-// Structure to hold the image data as an input to function to be executed for thread
-typedef struct {
-    const clip_image_u8 * input;
-    clip_image_f32 * resized;
-    const clip_ctx * ctx;
-} ImageData;
-
-// Structure to hold the range of images to be processed by a thread
-// closed interval
-typedef struct {
-    ImageData* start;
-    ImageData* end;
-} ImageDataRange;
+// build a graph against a measuring allocator and return the activation memory it needs
+static size_t clip_measure_text(const clip_ctx * ctx, clip_state * state, const int n_tokens) {
+    struct ggml_init_params params = {
+        .mem_size = state->buf_compute.size,
+        .mem_buffer = state->buf_compute.data,
+        .no_alloc = true,
+    };
 
-// Function to preprocess a single image in a thread
-void * preprocess_image(void * arg) {
-    ImageDataRange * imageDataRange = static_cast<ImageDataRange *>(arg);
+    struct ggml_context * ctx0 = ggml_init(params);
+    struct ggml_allocr * measure = ggml_allocr_new_measure(tensor_alignment);
 
-    ImageData * imageData_start = imageDataRange->start;
-    ImageData * imageData_end = imageDataRange->end;
+    const clip_tokens tokens = {NULL, (size_t)n_tokens};
+    struct ggml_cgraph * gf =
+        clip_text_build_graph(ctx, clip_state_text_model(ctx, state), ctx0, measure, &tokens, true);
+    std::vector<int> steps;
+    std::vector<int> chains;
+    const size_t size = clip_alloc_graph(measure, gf, steps, chains) + tensor_alignment;
+    state->text_graph_mem = ggml_used_mem(ctx0);
 
-    for (ImageData * imageData = imageData_start; imageData <= imageData_end; imageData++) {
-        const clip_image_u8 * input = imageData->input;
-        clip_image_f32 * resized = imageData->resized; 
-        const clip_ctx * ctx = imageData->ctx;
+    ggml_allocr_free(measure);
+    ggml_free(ctx0);
 
-        // Call the original preprocess function on the image
-        clip_image_preprocess(ctx, input, resized); 
-    }
-    
-    pthread_exit(NULL);
+    return size;
 }
 
-// Function to batch-preprocess multiple images i
-void clip_image_batch_preprocess(const clip_ctx * ctx, const int n_threads, const clip_image_u8_batch * img_inputs,
-                                 clip_image_f32_batch * imgs_resized) {
-    imgs_resized->size = img_inputs->size;
+static size_t clip_measure_image(const clip_ctx * ctx, clip_state * state, const int batch_size) {
+    struct ggml_init_params params = {
+        .mem_size = state->buf_compute.size,
+        .mem_buffer = state->buf_compute.data,
+        .no_alloc = true,
+    };
 
-    int num_threads = std::min(n_threads, static_cast<int>(img_inputs->size));
-    int i, t;
+    struct ggml_context * ctx0 = ggml_init(params);
+    struct ggml_allocr * measure = ggml_allocr_new_measure(tensor_alignment);
 
-    // Divide the images among the threads
-    int images_per_thread = img_inputs->size / num_threads;
+    const clip_image_f32_batch imgs = {NULL, (size_t)batch_size};
+    struct ggml_cgraph * gf = clip_image_build_graph(ctx, clip_state_vision_model(ctx, state), ctx0, measure, &imgs,
+                                                     true, NULL, state->layer_begin, state->layer_end);
+    std::vector<int> steps;
+    std::vector<int> chains;
+    const size_t size = clip_alloc_graph(measure, gf, steps, chains) + tensor_alignment;
+    state->vision_graph_mem = ggml_used_mem(ctx0);
 
-    if (num_threads == 1) {
-        // Single-threaded case
-        for (i = 0; i < img_inputs->size; i++) {
-            clip_image_preprocess(ctx, &img_inputs->data[i], &imgs_resized->data[i]);
-        }
-    } else {
-        // Multi-threaded case
-
-        std::vector<pthread_t> threads(num_threads);
-        std::vector<ImageData> imageData(img_inputs->size);
-        ImageDataRange* imageDataRange = new ImageDataRange[num_threads]();
-        
-        for (t = 0; t < num_threads; t++) {
-            int start_index = t * images_per_thread;
-            int end_index = (t == num_threads - 1) ? img_inputs->size : start_index + images_per_thread;
-
-            // Create ImageData for each thread
-            for (i = start_index; i < end_index; i++) {
-                imageData[i].input = &img_inputs->data[i];
-                imageData[i].resized = &imgs_resized->data[i];
-                imageData[i].ctx = ctx;
-            }
+    ggml_allocr_free(measure);
+    ggml_free(ctx0);
 
-            // Create a thread for each batch of images
-            imageDataRange[t] = {&imageData[start_index], &imageData[end_index - 1]};
-            pthread_create(&threads[t], NULL, preprocess_image, static_cast<void *>(&imageDataRange[t]));
-        }
+    return size;
+}
 
-        // Wait for all threads to finish
-        for (t = 0; t < num_threads; t++) {
-            pthread_join(threads[t], NULL);
-        }
+// make sure the activation buffer fits text graphs of up to n_tokens and image graphs of up to batch_size images,
+// false when it could not be allocated
+static bool clip_state_reserve(const clip_ctx * ctx, clip_state * state, const int n_tokens, const int batch_size) {
+    if (n_tokens > state->max_text_tokens) {
+        state->text_mem = clip_measure_text(ctx, state, n_tokens);
+        state->max_text_tokens = n_tokens;
+    }
 
-        delete[] imageDataRange;
+    if (batch_size > state->max_image_batch) {
+        state->vision_mem = clip_measure_image(ctx, state, batch_size);
+        state->max_image_batch = batch_size;
     }
-}
 
-void clip_free(clip_ctx * ctx) {
-    ggml_free(ctx->ctx);
-    gguf_free(ctx->ctx_gguf);
-    delete ctx;
-}
+    const size_t size = std::max(state->text_mem, state->vision_mem);
+    if (state->alloc && size <= state->buf_alloc.size) {
+        return true;
+    }
 
-bool clip_text_encode(const clip_ctx * ctx, const int n_threads, const clip_tokens * tokens, float * vec,
-                      const bool normalize) {
-    if (!ctx->has_text_encoder) {
-        printf("This GGUF file seems to have no text encoder\n");
+    if (state->alloc) {
+        ggml_allocr_free(state->alloc);
+        state->alloc = NULL;
+    }
+    state->graphs.clear();
+    if (!state->buf_alloc.resize(size)) {
+        fprintf(stderr, "%s: failed to allocate %zu bytes for the activations\n", __func__, size);
         return false;
     }
+    state->alloc = ggml_allocr_new(state->buf_alloc.data, state->buf_alloc.size, tensor_alignment);
+    return true;
+}
 
-    const auto & model = ctx->text_model;
-    const auto & hparams = model.hparams;
-    const size_t N = tokens->size;
+static const size_t max_cached_graphs = 4;
+
+// return the graph for an input shape, building it with build(ctx0, layer_outputs) if no earlier call used the same
+// shape. NULL when the memory for a new graph could not be allocated
+template <typename F>
+static clip_graph * clip_state_graph(clip_state * state, const bool vision, const int size, const bool normalize,
+                                     const F & build) {
+    auto & graphs = state->graphs;
+    for (size_t i = 0; i < graphs.size(); ++i) {
+        if (graphs[i]->vision == vision && graphs[i]->size == size && graphs[i]->normalize == normalize) {
+            std::rotate(graphs.begin() + i, graphs.begin() + i + 1, graphs.end());
+            return graphs.back().get();
+        }
+    }
 
-    const int n_vocab = hparams.n_vocab;
-    const int num_positions = hparams.num_positions;
-    const int hidden_size = hparams.hidden_size;
-    const int n_head = hparams.n_head;
-    const int d_head = hidden_size / n_head;
-    const int n_layer = hparams.n_layer;
-    const int n_intermediate = hparams.n_intermediate;
-    const int projection_dim = hparams.projection_dim;
-    const float eps = hparams.eps;
+    if (graphs.size() >= max_cached_graphs) {
+        graphs.erase(graphs.begin());
+    }
 
-    auto & buf_compute = ctx->buf_compute;
+    std::unique_ptr<clip_graph> graph(new clip_graph);
+    graph->vision = vision;
+    graph->size = size;
+    graph->normalize = normalize;
+    const size_t mem_size = vision ? state->vision_graph_mem : state->text_graph_mem;
+    if (!graph->buf.resize(mem_size)) {
+        fprintf(stderr, "%s: failed to allocate %zu bytes for the graph\n", __func__, mem_size);
+        return NULL;
+    }
 
     struct ggml_init_params params = {
-        .mem_size = buf_compute.size,
-        .mem_buffer = buf_compute.data,
-        .no_alloc = false,
+        .mem_size = graph->buf.size,
+        .mem_buffer = graph->buf.data,
+        .no_alloc = true,
     };
 
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf = {};
+    graph->ctx0 = ggml_init(params);
+    if (!graph->ctx0) {
+        return NULL;
+    }
 
-    static size_t scr0_size = get_scr_buf_req_by_size((struct clip_ctx *)ctx);
-    static void * scr0 = malloc(scr0_size);
+    ggml_allocr_reset(state->alloc);
+    std::vector<struct ggml_tensor *> layer_outputs;
+    graph->gf = build(graph->ctx0, &layer_outputs);
+    clip_alloc_graph(state->alloc, graph->gf, graph->steps, graph->chains);
 
-    struct ggml_tensor * input_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    // a layer ends with the step or the chain of its output, segments never split either
+    for (int i = 0; i < graph->gf->n_nodes && graph->layer_ends.size() < layer_outputs.size(); ++i) {
+        if (graph->gf->nodes[i] == layer_outputs[graph->layer_ends.size()]) {
+            i += std::max(graph->steps[i], graph->chains[i]) - 1;
+            graph->layer_ends.push_back(i);
+        }
+    }
+    graph->layer_ends.push_back(graph->gf->n_nodes - 1);
+
+    graphs.push_back(std::move(graph));
+    return graphs.back().get();
+}
+
+static void clip_text_set_inputs(const clip_ctx * ctx, struct ggml_cgraph * gf, const clip_tokens * tokens) {
+    const auto & hparams = ctx->text_model.hparams;
+    const int N = tokens->size;
+
+    struct ggml_tensor * input_ids = ggml_graph_get_tensor(gf, "input_ids");
     memcpy(input_ids->data, tokens->data, N * ggml_element_size(input_ids));
 
-    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    struct ggml_tensor * positions = ggml_graph_get_tensor(gf, "positions");
     for (int i = 0; i < N; i++) {
         ggml_set_i32_1d(positions, i, i);
     }
 
-    struct ggml_tensor * embeddings = ggml_get_rows(ctx0, model.token_embeddings, input_ids);
+    ggml_set_f32(ggml_graph_get_tensor(gf, "KQ_scale"), 1.0f / sqrt((float)(hparams.hidden_size / hparams.n_head)));
+    ggml_set_i32(ggml_graph_get_tensor(gf, "eot"), N - 1);
 
-    embeddings = ggml_add(ctx0, ggml_get_rows(ctx0, model.position_embeddings, positions), embeddings);
+    struct ggml_tensor * one = ggml_graph_get_tensor(gf, "one");
+    if (one) {
+        ggml_set_f32(one, 1.0f);
+    }
+}
 
-    // loop over layers
-    for (int il = 0; il < n_layer; il++) {
-        struct ggml_tensor * cur = embeddings; // embeddings = residual, cur = hidden_states
+struct clip_patchify_task {
+    const clip_image_f32_batch * imgs;
+    float * data;    // inp_patches
+    int patch_size;
+    int n_side;      // patches along a side of an image
+    int patch_dim;
+};
 
-        ggml_set_scratch(ctx0, {0, scr0_size, scr0});
+// gather the patches of one row of patches of an image, item i being row i % n_side of image i / n_side, into rows of
+// their channels, each of them in the row-major order of the kernel
+static void clip_patchify_row(void * data, const int i) {
+    const clip_patchify_task * task = (const clip_patchify_task *)data;
+    const int patch_size = task->patch_size;
+    const int n_side = task->n_side;
+    const int patch_dim = task->patch_dim;
+    const int b = i / n_side;
+    const int py = i % n_side;
+
+    const int nx = task->imgs->data[b].nx;
+    const float * src = task->imgs->data[b].data;
+    float * dst = task->data + (size_t)b * (n_side * n_side + 1) * patch_dim;
+
+    // the row of the class token
+    if (py == 0) {
+        memset(dst, 0, patch_dim * sizeof(float));
+    }
 
-        // layernorm1
-        {
-            cur = ggml_norm(ctx0, cur, eps);
+    for (int px = 0; px < n_side; px++) {
+        float * row = dst + (size_t)(1 + py * n_side + px) * patch_dim;
+        for (int ky = 0; ky < patch_size; ky++) {
+            const float * pixel = src + 3 * ((py * patch_size + ky) * nx + px * patch_size);
+            for (int kx = 0; kx < patch_size; kx++) {
+                for (int k = 0; k < 3; k++) {
+                    row[(k * patch_size + ky) * patch_size + kx] = pixel[3 * kx + k];
+                }
+            }
+        }
+    }
+}
+
+// the graph of a pipeline stage after the first one takes hidden states instead of images, and only the last stage
+// has the inputs of the head. the patches are gathered on up to n_threads threads of the task pool of the model
+static void clip_image_set_inputs(const clip_ctx * ctx, struct ggml_cgraph * gf, const clip_image_f32_batch * imgs,
+                                  const int n_threads, const float * hidden = NULL) {
+    const auto & hparams = ctx->vision_model.hparams;
+    const int image_size = hparams.image_size;
+    const int patch_size = hparams.patch_size;
+    const int num_positions = (image_size / patch_size) * (image_size / patch_size) + 1;
+    const int batch_size = imgs->size;
 
-            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_1_w, cur), cur),
-                           ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
+    struct ggml_tensor * inp_hidden = ggml_graph_get_tensor(gf, "inp_hidden");
+    if (inp_hidden) {
+        memcpy(inp_hidden->data, hidden, ggml_nbytes(inp_hidden));
+    } else {
+        for (int b = 0; b < batch_size; b++) {
+            GGML_ASSERT(imgs->data[b].nx == image_size && imgs->data[b].ny == image_size);
         }
 
-        // self-attention
-        {
-            struct ggml_tensor * Q =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].q_b, cur), ggml_mul_mat(ctx0, model.layers[il].q_w, cur));
+        struct ggml_tensor * inp = ggml_graph_get_tensor(gf, "inp_patches");
+        const int n_side = image_size / patch_size;
 
-            Q = ggml_scale_inplace(ctx0, Q, ggml_new_f32(ctx0, 1.0f / sqrt((float)d_head)));
-            Q = ggml_reshape_4d(ctx0, Q, d_head, n_head, N, 1);
-            Q = ggml_cont(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
-            Q = ggml_reshape_3d(ctx0, Q, d_head, N, n_head);
+        // executors that encode side by side don't wait for each other's gather, each does its own on its thread
+        clip_patchify_task task = {imgs, (float *)inp->data, patch_size, n_side, (int)inp->ne[0]};
+        clip_task_pool_run(ctx->task_pool, n_threads, batch_size * n_side, clip_patchify_row, &task, false);
 
-            struct ggml_tensor * K =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].k_b, cur), ggml_mul_mat(ctx0, model.layers[il].k_w, cur));
+        struct ggml_tensor * positions = ggml_graph_get_tensor(gf, "positions");
+        for (int i = 0; i < num_positions; i++) {
+            ggml_set_i32_1d(positions, i, i);
+        }
+    }
 
-            K = ggml_reshape_4d(ctx0, K, d_head, n_head, N, 1);
-            K = ggml_cont(ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
-            K = ggml_reshape_3d(ctx0, K, d_head, N, n_head);
+    struct ggml_tensor * cls = ggml_graph_get_tensor(gf, "cls");
+    if (!cls) {
+        return;
+    }
+    for (int b = 0; b < batch_size; b++) {
+        ggml_set_i32_1d(cls, b, b * num_positions);
+    }
 
-            struct ggml_tensor * V =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].v_b, cur), ggml_mul_mat(ctx0, model.layers[il].v_w, cur));
-            V = ggml_reshape_4d(ctx0, V, d_head, n_head, N, 1);
-            V = ggml_cont(ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3));
-            V = ggml_reshape_3d(ctx0, V, N, d_head, n_head);
+    // accumulated into
+    ggml_set_zero(ggml_graph_get_tensor(gf, "output"));
 
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            KQ = ggml_diag_mask_inf_inplace(ctx0, KQ, 0); // causal masking
-            KQ = ggml_soft_max_inplace(ctx0, KQ);
+    struct ggml_tensor * one = ggml_graph_get_tensor(gf, "one");
+    if (one) {
+        ggml_set_f32(one, 1.0f);
+    }
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ);
-            KQV = ggml_reshape_4d(ctx0, KQV, d_head, N, n_head, 1);
-            KQV = ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
+    char name[GGML_MAX_NAME];
+    for (int b = 0; b < batch_size; b++) {
+        snprintf(name, sizeof(name), "row%d", b);
+        ggml_set_i32(ggml_graph_get_tensor(gf, name), b);
+    }
+}
 
-            cur = ggml_cpy(ctx0, KQV, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, hidden_size, N));
-        }
+// a state whose image graphs cover the layers [layer_begin, layer_end) of the vision tower, all of them with 0 and -1
+static clip_state * clip_state_new(const clip_ctx * ctx, const int layer_begin, const int layer_end) {
+    clip_state * state = new (std::nothrow) clip_state;
+    if (!state) {
+        return NULL;
+    }
+    state->layer_begin = layer_begin;
+    state->layer_end = layer_end;
 
-        // attention output
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].o_b, cur), ggml_mul_mat(ctx0, model.layers[il].o_w, cur));
+    if (!state->buf_compute.resize(ggml_tensor_overhead() * GGML_MAX_NODES + ggml_graph_overhead())) {
+        delete state;
+        return NULL;
+    }
 
-        // re-add the layer input, e.g., residual
-        cur = ggml_add(ctx0, cur, embeddings);
+    // size for the longest text and a single image up front, larger image batches grow the buffer on demand. a
+    // pipeline stage only encodes images
+    const bool all_layers = layer_begin == 0 && layer_end < 0;
+    const int n_tokens = ctx->has_text_encoder && all_layers ? ctx->text_model.hparams.num_positions : 0;
+    const int batch_size = ctx->has_vision_encoder ? 1 : 0;
+    if (!clip_state_reserve(ctx, state, n_tokens, batch_size)) {
+        delete state;
+        return NULL;
+    }
 
-        embeddings = cur; // embeddings = residual, cur = hidden_states
+    return state;
+}
 
-        // layernorm2
-        {
-            cur = ggml_norm(ctx0, cur, eps);
+struct clip_state * clip_init_state(const struct clip_ctx * ctx) { return clip_state_new(ctx, 0, -1); }
 
-            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_2_w, cur), cur),
-                           ggml_repeat(ctx0, model.layers[il].ln_2_b, cur));
+struct clip_state * clip_init_state_on_node(const struct clip_ctx * ctx, const int node) {
+    clip_state * state = clip_state_new(ctx, 0, -1);
+    for (const auto & replica : ctx->replicas) {
+        if (state && replica->node == node) {
+            state->replica = replica.get();
+            state->cpus = replica->cpus;
+            break;
         }
+    }
+    return state;
+}
 
-        cur = ggml_mul_mat(ctx0, model.layers[il].ff_i_w, cur);
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_i_b, cur), cur);
+void clip_free_state(struct clip_state * state) { delete state; }
 
-        if (ctx->use_gelu) {
-            cur = ggml_gelu_inplace(ctx0, cur);
+void clip_state_trim(struct clip_state * state) {
+    state->graphs.clear();
+    if (state->alloc) {
+        ggml_allocr_free(state->alloc);
+        state->alloc = NULL;
+    }
+    state->buf_alloc.clear();
+    state->buf_work.clear();
+    ggml_threadpool_free(state->threadpool);
+    state->threadpool = NULL;
+}
+
+void clip_trim(struct clip_ctx * ctx) { clip_state_trim(ctx->state); }
+
+void clip_calibrate(const clip_ctx * ctx, int n_threads) {
+    if (!ctx->cpus.empty()) {
+        n_threads = std::min(n_threads, (int)ctx->cpus.size());
+    }
+
+    struct ggml_threadpool * threadpool = NULL;
+    if (n_threads > 1) {
+        threadpool = ggml_threadpool_new(n_threads, ctx->cpus.empty() ? NULL : ctx->cpus.data());
+    }
+
+    ggml_set_cost_params(ggml_cost_calibrate(threadpool));
+    ggml_threadpool_free(threadpool);
+}
+
+bool clip_text_encode(const clip_ctx * ctx, const int n_threads, const clip_tokens * tokens, float * vec,
+                      const bool normalize) {
+    return clip_text_encode_with_state(ctx, ctx->state, n_threads, tokens, vec, normalize);
+}
+
+bool clip_text_encode_with_state(const clip_ctx * ctx, clip_state * state, const int n_threads, const clip_tokens * tokens,
+                                 float * vec, const bool normalize) {
+    if (!ctx->has_text_encoder) {
+        printf("This GGUF file seems to have no text encoder\n");
+        return false;
+    }
+
+    const int num_positions = ctx->text_model.hparams.num_positions;
+    const int projection_dim = ctx->text_model.hparams.projection_dim;
+
+    if ((int)tokens->size > num_positions) {
+        fprintf(stderr, "%s: too many tokens (%zu > %d)\n", __func__, tokens->size, num_positions);
+        return false;
+    }
+
+    if (!clip_state_reserve(ctx, state, tokens->size, 0)) {
+        return false;
+    }
+
+    const clip_graph * graph = clip_state_graph(
+        state, false, tokens->size, normalize, [&](struct ggml_context * ctx0, std::vector<struct ggml_tensor *> * outputs) {
+            return clip_text_build_graph(ctx, clip_state_text_model(ctx, state), ctx0, state->alloc, tokens, normalize,
+                                         outputs);
+        });
+    if (!graph) {
+        return false;
+    }
+    struct ggml_cgraph * gf = graph->gf;
+    clip_text_set_inputs(ctx, gf, tokens);
+
+    struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 1];
+
+    // run the computation
+    if (!clip_graph_compute(ctx, state, gf, n_threads, ctx->text_model.layers, graph->layer_ends, graph->steps,
+                            graph->chains, ctx->text_window)) {
+        return false;
+    }
+
+// print
+#ifdef CLIP_DEBUG
+    {
+        auto print_t_f32 = [&](struct ggml_tensor * t) {
+            float * data = (float *)t->data;
+            printf("dtype: f32, dims: %jd %jd %jd %jd, nb: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3], t->nb[0],
+                   t->nb[1], t->nb[2], t->nb[3]);
+            printf("data: ");
+            for (int i = 0; i < std::min((int)t->ne[0], 20); i++) {
+                printf("%f ", data[i]);
+            }
+
+            // printf("\n\n");
+            double sum = 0.0;
+            for (int i = 0; i < ggml_nelements(t); i++) {
+                sum += data[i];
+            }
+            printf("sum:  %f\n", sum);
+        };
+
+        auto print_t_f16 = [&](struct ggml_tensor * t) {
+            ggml_fp16_t * data = (ggml_fp16_t *)t->data;
+            printf("dtype: f16, dims: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3]);
+            printf("data: ");
+            for (int i = 0; i < std::min((int)t->ne[0], 10); i++) {
+                printf("%f ", ggml_fp16_to_fp32(data[i]));
+            }
+            printf("\n\n");
+            double sum = 0.0;
+            for (int i = 0; i < ggml_nelements(t); i++) {
+                sum += ggml_fp16_to_fp32(data[i]);
+            }
+            printf("sum:  %f\n", sum);
+        };
+
+        auto * t = ggml_graph_get_tensor(gf, "check");
+        if (t->type == GGML_TYPE_F32) {
+            print_t_f32(t);
         } else {
-            cur = ggml_gelu_quick_inplace(ctx0, cur);
+            print_t_f16(t);
         }
+    }
 
-        cur = ggml_mul_mat(ctx0, model.layers[il].ff_o_w, cur);
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_o_b, cur), cur);
+    printf("compute buffer = %zu\n", state->buf_alloc.size);
+#endif
+    memcpy(vec, ggml_get_data_f32(embeddings), sizeof(float) * projection_dim);
+
+    return true;
+}
+
+bool clip_image_encode(const clip_ctx * ctx, const int n_threads, clip_image_f32 * img, float * vec, const bool normalize) {
+    return clip_image_encode_with_state(ctx, ctx->state, n_threads, img, vec, normalize);
+}
+
+bool clip_image_encode_with_state(const clip_ctx * ctx, clip_state * state, const int n_threads, clip_image_f32 * img,
+                                  float * vec, const bool normalize) {
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return false;
+    }
 
-        // residual 2
-        cur = ggml_add(ctx0, embeddings, cur);
+    clip_image_f32_batch imgs{};
+    imgs.size = 1;
+    imgs.data = img;
+    return clip_image_batch_encode_with_state(ctx, state, n_threads, &imgs, vec, normalize);
+}
 
-        embeddings = cur;
-    }
+bool clip_image_batch_encode(const clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs, float * vec,
+                             const bool normalize) {
+    return clip_image_batch_encode_with_state(ctx, ctx->state, n_threads, imgs, vec, normalize);
+}
 
-    // final -layer_norm
-    {
-        embeddings = ggml_norm(ctx0, embeddings, eps);
+bool clip_image_batch_encode_with_state(const clip_ctx * ctx, clip_state * state, const int n_threads,
+                                        const clip_image_f32_batch * imgs, float * vec, const bool normalize) {
 
-        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.post_ln_w, embeddings), embeddings),
-                              ggml_repeat(ctx0, model.post_ln_b, embeddings));
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return false;
     }
 
-    // get the output of eot token, e.g., last index
-    struct ggml_tensor * eot = ggml_new_i32(ctx0, N - 1);
-    embeddings = ggml_get_rows(ctx0, embeddings, eot);
-
-    ggml_set_scratch(ctx0, {0, 0, nullptr});
+    const int projection_dim = ctx->vision_model.hparams.projection_dim;
+    const int batch_size = imgs->size;
 
-    // text projection
-    embeddings = ggml_mul_mat(ctx0, model.projection, embeddings);
+    if (!clip_state_reserve(ctx, state, 0, batch_size)) {
+        return false;
+    }
 
-    // normalize output embeddings
-    if (normalize) {
-        ggml_tensor * length = ggml_sqrt(ctx0, ggml_sum(ctx0, ggml_sqr(ctx0, embeddings)));
-        embeddings = ggml_scale_inplace(ctx0, embeddings, ggml_div(ctx0, ggml_new_f32(ctx0, 1.0f), length));
+    const clip_graph * graph = clip_state_graph(
+        state, true, batch_size, normalize, [&](struct ggml_context * ctx0, std::vector<struct ggml_tensor *> * outputs) {
+            return clip_image_build_graph(ctx, clip_state_vision_model(ctx, state), ctx0, state->alloc, imgs, normalize,
+                                          outputs);
+        });
+    if (!graph) {
+        return false;
     }
+    struct ggml_cgraph * gf = graph->gf;
+    clip_image_set_inputs(ctx, gf, imgs, n_threads);
 
-    ggml_set_name(embeddings, "check");
+    struct ggml_tensor * output = gf->nodes[gf->n_nodes - 1];
 
     // run the computation
-
-    ggml_build_forward_expand(&gf, embeddings);
-    ggml_cplan cplan = ggml_graph_plan(&gf, n_threads);
-    if (cplan.work_size != 0) {
-        cplan.work_data = (uint8_t *)malloc(cplan.work_size);
+    if (!clip_graph_compute(ctx, state, gf, n_threads, ctx->vision_model.layers, graph->layer_ends, graph->steps,
+                            graph->chains, ctx->vision_window)) {
+        return false;
     }
-    ggml_graph_compute(&gf, &cplan);
 
 // print
 #ifdef CLIP_DEBUG
@@ -1211,7 +3393,8 @@ bool clip_text_encode(const clip_ctx * ctx, const int n_threads, const clip_toke
             printf("sum:  %f\n", sum);
         };
 
-        auto * t = ggml_get_tensor(ctx0, "check");
+        auto * t = ggml_graph_get_tensor(gf, "check");
+        // auto t = inp_raw;
         if (t->type == GGML_TYPE_F32) {
             print_t_f32(t);
         } else {
@@ -1219,307 +3402,468 @@ bool clip_text_encode(const clip_ctx * ctx, const int n_threads, const clip_toke
         }
     }
 
-    printf("used_mem = %zu\n", ggml_used_mem(ctx0));
+    printf("compute buffer = %zu\n", state->buf_alloc.size);
 #endif
-    memcpy(vec, ggml_get_data_f32(embeddings), sizeof(float) * projection_dim);
-
-    if (cplan.work_size != 0) {
-        free(cplan.work_data);
-    }
 
-    ggml_free(ctx0);
+    memcpy(vec, ggml_get_data_f32(output), sizeof(float) * projection_dim * batch_size);
 
     return true;
 }
 
-bool clip_image_encode(const clip_ctx * ctx, const int n_threads, clip_image_f32 * img, float * vec, const bool normalize) {
-    if (!ctx->has_vision_encoder) {
-        printf("This gguf file seems to have no vision encoder\n");
-        return false;
+//
+// throughput mode
+//
+
+// Executors that each encode whole images on a few threads. Smaller thread groups pass fewer barriers per image than
+// all threads on one image, which wins once there are enough images to keep every group busy. The calling thread is
+// executor 0, the others wait on a condition variable between batches.
+struct clip_workers {
+    const clip_ctx * ctx = NULL;
+    int n_threads = 1; // compute threads of every executor
+
+    std::vector<clip_state *> states;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable cond;      // a batch was posted, or stop
+    std::condition_variable cond_done; // the last executor finished its part of a batch
+
+    // the batch being encoded
+    const clip_image_f32_batch * imgs = NULL;
+    float * vec = NULL;
+    bool normalize = false;
+    int n_batch = 0;  // number of batches posted so far
+    int n_busy = 0;   // executors that haven't finished the current batch
+    bool stop = false;
+    std::atomic<int> next{0}; // next image to be taken
+    std::atomic<bool> ok{true};
+
+    ~clip_workers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cond.notify_all();
+        for (auto & thread : threads) {
+            thread.join();
+        }
+        for (auto * state : states) {
+            clip_free_state(state);
+        }
     }
+};
 
-    clip_image_f32_batch imgs{};
-    imgs.size = 1;
-    imgs.data = img;
-    return clip_image_batch_encode(ctx, n_threads, &imgs, vec, normalize);
+// take images of the current batch until there are none left
+static void clip_workers_run(clip_workers * workers, clip_state * state) {
+    const int projection_dim = workers->ctx->vision_model.hparams.projection_dim;
+    const clip_image_f32_batch * imgs = workers->imgs;
+
+    for (int i = workers->next++; i < (int)imgs->size; i = workers->next++) {
+        if (!clip_image_encode_with_state(workers->ctx, state, workers->n_threads, &imgs->data[i],
+                                          workers->vec + (size_t)i * projection_dim, workers->normalize)) {
+            workers->ok = false;
+        }
+    }
 }
 
-bool clip_image_batch_encode(const clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs, float * vec,
-                             const bool normalize) {
+static void clip_workers_thread(clip_workers * workers, clip_state * state) {
+    int n_seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(workers->mutex);
+            workers->cond.wait(lock, [&] { return workers->stop || workers->n_batch != n_seen; });
+            if (workers->stop) {
+                return;
+            }
+            n_seen = workers->n_batch;
+        }
 
-    if (!ctx->has_vision_encoder) {
-        printf("This gguf file seems to have no vision encoder\n");
-        return false;
-    }
+        clip_workers_run(workers, state);
 
-    const auto & model = ctx->vision_model;
-    const auto & hparams = model.hparams;
+        std::lock_guard<std::mutex> lock(workers->mutex);
+        if (--workers->n_busy == 0) {
+            workers->cond_done.notify_one();
+        }
+    }
+}
 
-    const int image_size = hparams.image_size;
-    const int patch_size = hparams.patch_size;
-    const int num_patches = ((image_size / patch_size) * (image_size / patch_size));
-    const int num_positions = num_patches + 1;
-    const int hidden_size = hparams.hidden_size;
-    const int n_head = hparams.n_head;
-    const int d_head = hidden_size / n_head;
-    const int n_layer = hparams.n_layer;
-    const int n_intermediate = hparams.n_intermediate;
-    const int projection_dim = hparams.projection_dim;
-    const float eps = hparams.eps;
-    int batch_size = imgs->size;
+static clip_workers * clip_workers_start(const clip_ctx * ctx, const int n_threads, const int n_workers) {
+    clip_workers * workers = new clip_workers;
+    workers->ctx = ctx;
+    workers->n_threads = std::max(1, n_threads / n_workers);
+
+    std::vector<size_t> n_used(ctx->replicas.size()); // cpus of every node given to an executor
+    for (int w = 0; w < n_workers; ++w) {
+        clip_state * state = clip_init_state(ctx);
+        if (!state) {
+            // no thread has started yet, the executors made so far are freed with the set
+            fprintf(stderr, "%s: failed to create executor %d of %d\n", __func__, w + 1, n_workers);
+            delete workers;
+            return NULL;
+        }
+        if (!ctx->cpus.empty()) {
+            // every executor computes on its own slice of the cpus of the model, with the weights of their node
+            for (int t = 0; t < workers->n_threads; ++t) {
+                state->cpus.push_back(ctx->cpus[w * workers->n_threads + t]);
+            }
+            state->replica = clip_cpu_replica(ctx, state->cpus[0]);
+        } else if (!ctx->replicas.empty()) {
+            // the executors are spread evenly over the nodes, each on cpus of its node and with the local weights
+            const size_t r = w * ctx->replicas.size() / n_workers;
+            const clip_replica * replica = ctx->replicas[r].get();
+            for (int t = 0; t < workers->n_threads; ++t) {
+                state->cpus.push_back(replica->cpus[n_used[r]++ % replica->cpus.size()]);
+            }
+            state->replica = replica;
+        }
+        workers->states.push_back(state);
+    }
+    for (int w = 1; w < n_workers; ++w) {
+        workers->threads.emplace_back(clip_workers_thread, workers, workers->states[w]);
+    }
 
-    auto & buf_compute = ctx->buf_compute;
+    return workers;
+}
 
-    struct ggml_init_params params = {
-        .mem_size = buf_compute.size,
-        .mem_buffer = buf_compute.data,
-        .no_alloc = false,
-    };
+// images per second of a set of executors on synthetic images, after an image per executor that builds their graphs
+static double clip_workers_images_per_s(clip_workers * workers, const int n_images) {
+    const int image_size = workers->ctx->vision_model.hparams.image_size;
+    std::vector<float> pixels(3 * image_size * image_size, 0.5f);
+    std::vector<clip_image_f32> images(std::max(n_images, (int)workers->states.size()),
+                                       {image_size, image_size, pixels.data(), pixels.size()});
+    std::vector<float> vec((size_t)workers->ctx->vision_model.hparams.projection_dim * images.size());
+
+    const clip_image_f32_batch warmup = {images.data(), workers->states.size()};
+    if (!clip_workers_image_batch_encode(workers, &warmup, vec.data(), true)) {
+        return 0.0;
+    }
 
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf = {};
+    const clip_image_f32_batch batch = {images.data(), (size_t)n_images};
+    const int64_t t_start_us = ggml_time_us();
+    if (!clip_workers_image_batch_encode(workers, &batch, vec.data(), true)) {
+        return 0.0;
+    }
 
-    static size_t scr0_size = get_scr_buf_req_by_size((struct clip_ctx *)ctx);
-    static void * scr0 = malloc(scr0_size);
+    return n_images * 1e6 / std::max<int64_t>(1, ggml_time_us() - t_start_us);
+}
 
-    struct ggml_tensor * inp_raw = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, image_size, image_size, 3, batch_size);
+struct clip_workers * clip_workers_init(const struct clip_ctx * ctx, int n_threads, const int n_workers) {
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return NULL;
+    }
 
-    {
-        float * data = (float *)ggml_get_data(inp_raw);
+    if (!ctx->cpus.empty()) {
+        n_threads = std::min(n_threads, (int)ctx->cpus.size());
+    }
+    n_threads = std::max(1, n_threads);
 
-        for (int b = 0; b < imgs->size; b++) {
-            const int nx = imgs->data[b].nx;
-            const int ny = imgs->data[b].ny;
-            GGML_ASSERT(nx == image_size && ny == image_size);
+    if (n_workers > 0) {
+        return clip_workers_start(ctx, n_threads, std::min(n_workers, n_threads));
+    }
 
-            const int n = nx * ny;
+    // try every even split of the threads, on twice as many images as the largest split has executors
+    clip_workers * best = NULL;
+    double best_images_per_s = 0.0;
+    for (int k = 1; k <= n_threads; ++k) {
+        if (n_threads % k != 0) {
+            continue;
+        }
 
-            for (int b = 0; b < batch_size; b++) {
-                for (int k = 0; k < 3; k++) {
-                    for (int y = 0; y < ny; y++) {
-                        for (int x = 0; x < nx; x++) {
-                            data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].data[3 * (y * nx + x) + k];
-                        }
-                    }
-                }
-            }
+        clip_workers * workers = clip_workers_start(ctx, n_threads, k);
+        if (!workers) {
+            continue;
+        }
+        const double images_per_s = clip_workers_images_per_s(workers, 2 * n_threads);
+        if (!best || images_per_s > best_images_per_s) {
+            delete best;
+            best = workers;
+            best_images_per_s = images_per_s;
+        } else {
+            delete workers;
         }
     }
 
-    struct ggml_tensor * inp = ggml_conv_2d(ctx0, model.patch_embeddings, inp_raw, patch_size, patch_size, 0, 0, 1, 1);
-
-    inp = ggml_reshape_3d(ctx0, inp, num_patches, hidden_size, batch_size);
-    inp = ggml_cont(ctx0, ggml_permute(ctx0, inp, 1, 0, 2, 3));
+    return best;
+}
 
-    // concat class_embeddings and patch_embeddings
-    struct ggml_tensor * embeddings = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size);
+void clip_workers_free(struct clip_workers * workers) { delete workers; }
 
-    ggml_set_zero(embeddings);
-    struct ggml_tensor * temp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, 1, batch_size);
+int clip_workers_count(const struct clip_workers * workers) { return workers->states.size(); }
 
-    embeddings = ggml_acc(ctx0, embeddings, ggml_repeat(ctx0, model.class_embedding, temp), embeddings->nb[1],
-                          embeddings->nb[2], embeddings->nb[3], 0);
-    embeddings =
-        ggml_acc(ctx0, embeddings, inp, embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], model.class_embedding->nb[1]);
+int clip_workers_n_threads(const struct clip_workers * workers) { return workers->n_threads; }
 
-    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_positions);
-    for (int i = 0; i < num_positions; i++) {
-        ggml_set_i32_1d(positions, i, i);
+bool clip_workers_image_batch_encode(struct clip_workers * workers, const struct clip_image_f32_batch * imgs, float * vec,
+                                     const bool normalize) {
+    {
+        std::lock_guard<std::mutex> lock(workers->mutex);
+        workers->imgs = imgs;
+        workers->vec = vec;
+        workers->normalize = normalize;
+        workers->next = 0;
+        workers->ok = true;
+        workers->n_busy = workers->threads.size();
+        workers->n_batch++;
     }
+    workers->cond.notify_all();
 
-    embeddings =
-        ggml_add(ctx0, embeddings, ggml_repeat(ctx0, ggml_get_rows(ctx0, model.position_embeddings, positions), embeddings));
-
-    // pre-layernorm
-    {
-        embeddings = ggml_norm(ctx0, embeddings, eps);
+    clip_workers_run(workers, workers->states[0]);
 
-        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.pre_ln_w, embeddings), embeddings),
-                              ggml_repeat(ctx0, model.pre_ln_b, embeddings));
-    }
+    std::unique_lock<std::mutex> lock(workers->mutex);
+    workers->cond_done.wait(lock, [&] { return workers->n_busy == 0; });
 
-    // loop over layers
-    for (int il = 0; il < n_layer; il++) {
-        struct ggml_tensor * cur = embeddings; // embeddings = residual, cur = hidden_states
+    return workers->ok;
+}
 
-        const size_t nb_q_w = model.layers[il].q_w->nb[0];
+//
+// pipeline mode
+//
 
-        ggml_set_scratch(ctx0, {0, scr0_size, scr0});
+// Stages that each own a contiguous range of the vision layers and pass micro-batches of hidden states on to the next
+// one. Every stage only ever touches the weights of its own layers, which stay in the caches of its cores. The calling
+// thread computes the first stage.
 
-        // layernorm1
-        {
-            cur = ggml_norm(ctx0, cur, eps);
+static const int pipeline_depth = 2;
 
-            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_1_w, cur), cur),
-                           ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
-        }
+// hidden states on their way from one stage to the next, in a ring of pipeline_depth micro-batches
+struct clip_pipeline_link {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<std::vector<float>> slots;
+    bool slots_ok[pipeline_depth] = {}; // false for a micro-batch that failed in an earlier stage, with no data
+    int64_t n_pushed = 0;
+    int64_t n_popped = 0;
+};
 
-        // self-attention
+struct clip_pipeline {
+    const clip_ctx * ctx = NULL;
+    int n_threads = 1; // compute threads of every stage
+    int micro_batch = 1;
+
+    std::vector<clip_state *> states;                       // one per stage
+    std::vector<std::unique_ptr<clip_pipeline_link>> links; // links[s] feeds stage s + 1
+    std::vector<std::thread> threads;                       // every stage but the first
+
+    std::mutex mutex;
+    std::condition_variable cond;      // a batch was posted, or stop
+    std::condition_variable cond_done; // the last stage thread finished the batch
+
+    // the batch being encoded
+    const clip_image_f32_batch * imgs = NULL;
+    float * vec = NULL;
+    bool normalize = false;
+    int n_batch = 0; // number of batches posted so far
+    int n_busy = 0;  // stage threads that haven't finished the current batch
+    bool stop = false;
+    bool ok = true;  // no stage failed on a micro-batch of the current batch
+
+    ~clip_pipeline() {
         {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cond.notify_all();
+        for (auto & thread : threads) {
+            thread.join();
+        }
+        for (auto * state : states) {
+            clip_free_state(state);
+        }
+    }
+};
 
-            struct ggml_tensor * Q =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].q_b, cur), ggml_mul_mat(ctx0, model.layers[il].q_w, cur));
+// wait for the oldest micro-batch of a link, ok is false when an earlier stage failed it
+static const float * clip_pipeline_front(clip_pipeline_link * link, bool * ok) {
+    std::unique_lock<std::mutex> lock(link->mutex);
+    link->cond.wait(lock, [&] { return link->n_popped < link->n_pushed; });
+    *ok = link->slots_ok[link->n_popped % pipeline_depth];
+    return link->slots[link->n_popped % pipeline_depth].data();
+}
 
-            Q = ggml_scale_inplace(ctx0, Q, ggml_new_f32(ctx0, 1.0f / sqrt((float)d_head)));
-            Q = ggml_reshape_4d(ctx0, Q, d_head, n_head, num_positions, batch_size);
-            Q = ggml_cont(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3));
-            Q = ggml_reshape_3d(ctx0, Q, d_head, num_positions, n_head * batch_size);
+static void clip_pipeline_pop(clip_pipeline_link * link) {
+    {
+        std::lock_guard<std::mutex> lock(link->mutex);
+        link->n_popped++;
+    }
+    link->cond.notify_all();
+}
 
-            struct ggml_tensor * K =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].k_b, cur), ggml_mul_mat(ctx0, model.layers[il].k_w, cur));
+// wait for a free slot in a link
+static float * clip_pipeline_back(clip_pipeline_link * link) {
+    std::unique_lock<std::mutex> lock(link->mutex);
+    link->cond.wait(lock, [&] { return link->n_pushed - link->n_popped < pipeline_depth; });
+    return link->slots[link->n_pushed % pipeline_depth].data();
+}
 
-            K = ggml_reshape_4d(ctx0, K, d_head, n_head, num_positions, batch_size);
-            K = ggml_cont(ctx0, ggml_permute(ctx0, K, 0, 2, 1, 3));
-            K = ggml_reshape_3d(ctx0, K, d_head, num_positions, n_head * batch_size);
+static void clip_pipeline_push(clip_pipeline_link * link, const bool ok) {
+    {
+        std::lock_guard<std::mutex> lock(link->mutex);
+        link->slots_ok[link->n_pushed % pipeline_depth] = ok;
+        link->n_pushed++;
+    }
+    link->cond.notify_all();
+}
 
-            struct ggml_tensor * V =
-                ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].v_b, cur), ggml_mul_mat(ctx0, model.layers[il].v_w, cur));
+// take every micro-batch of the current batch through stage s
+static void clip_pipeline_run(clip_pipeline * pipeline, const int s) {
+    const clip_ctx * ctx = pipeline->ctx;
+    clip_state * state = pipeline->states[s];
+    const clip_image_f32_batch * imgs = pipeline->imgs;
+    const bool normalize = pipeline->normalize;
+    const int projection_dim = ctx->vision_model.hparams.projection_dim;
+    const int image_size = ctx->vision_model.hparams.image_size;
 
-            V = ggml_reshape_4d(ctx0, V, d_head, n_head, num_positions, batch_size);
-            V = ggml_cont(ctx0, ggml_permute(ctx0, V, 1, 2, 0, 3));
-            V = ggml_reshape_3d(ctx0, V, num_positions, d_head, n_head * batch_size);
+    clip_pipeline_link * in = s > 0 ? pipeline->links[s - 1].get() : NULL;
+    clip_pipeline_link * out = s + 1 < (int)pipeline->states.size() ? pipeline->links[s].get() : NULL;
 
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            KQ = ggml_soft_max_inplace(ctx0, KQ);
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ);
-            KQV = ggml_reshape_4d(ctx0, KQV, d_head, num_positions, n_head, batch_size);
-            KQV = ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
+    for (size_t i = 0; i < imgs->size; i += pipeline->micro_batch) {
+        // stages after the first only look at the number of images
+        const size_t batch_size = std::min((size_t)pipeline->micro_batch, imgs->size - i);
+        clip_image_f32_batch batch = {in ? NULL : imgs->data + i, batch_size};
 
-            cur = ggml_cpy(ctx0, KQV, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size));
+        bool ok = true;
+        for (size_t j = 0; j < batch_size && !in; ++j) {
+            ok = ok && batch.data[j].nx == image_size && batch.data[j].ny == image_size;
         }
 
-        // attention output
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].o_b, cur), ggml_mul_mat(ctx0, model.layers[il].o_w, cur));
-
-        // re-add the layer input, e.g., residual
-        cur = ggml_add(ctx0, cur, embeddings);
-
-        embeddings = cur; // embeddings = residual, cur = hidden_states
+        // a failed micro-batch still passes through the links, so that the stages stay in step, but the later stages
+        // neither compute it nor write its values
+        const struct ggml_tensor * output = NULL;
+        bool ok_in = true;
+        const float * hidden = in ? clip_pipeline_front(in, &ok_in) : NULL;
+        ok = ok && ok_in && clip_state_reserve(ctx, state, 0, batch_size);
+        const clip_graph * graph = NULL;
+        if (ok) {
+            const auto build = [&](struct ggml_context * ctx0, std::vector<struct ggml_tensor *> * outputs) {
+                return clip_image_build_graph(ctx, clip_state_vision_model(ctx, state), ctx0, state->alloc, &batch,
+                                              normalize, outputs, state->layer_begin, state->layer_end);
+            };
+            graph = clip_state_graph(state, true, batch_size, normalize, build);
+            ok = graph != NULL;
+        }
+        if (ok) {
+            struct ggml_cgraph * gf = graph->gf;
 
-        // layernorm2
-        {
-            cur = ggml_norm(ctx0, cur, eps);
+            clip_image_set_inputs(ctx, gf, &batch, pipeline->n_threads, hidden);
+            if (in) {
+                clip_pipeline_pop(in);
+            }
 
-            cur = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers[il].ln_2_w, cur), cur),
-                           ggml_repeat(ctx0, model.layers[il].ln_2_b, cur));
+            ok = clip_state_compute(ctx, state, gf, pipeline->n_threads, graph->steps.data(), graph->chains.data());
+            output = gf->nodes[gf->n_nodes - 1];
+        } else if (in) {
+            clip_pipeline_pop(in);
         }
 
-        cur = ggml_mul_mat(ctx0, model.layers[il].ff_i_w, cur);
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_i_b, cur), cur);
+        float * dst = out ? clip_pipeline_back(out) : pipeline->vec + i * projection_dim;
+        if (ok) {
+            memcpy(dst, output->data, ggml_nbytes(output));
+        }
+        if (out) {
+            clip_pipeline_push(out, ok);
+        }
 
-        if (ctx->use_gelu) {
-            cur = ggml_gelu_inplace(ctx0, cur);
-        } else {
-            cur = ggml_gelu_quick_inplace(ctx0, cur);
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(pipeline->mutex);
+            pipeline->ok = false;
         }
+    }
+}
 
-        cur = ggml_mul_mat(ctx0, model.layers[il].ff_o_w, cur);
-        cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].ff_o_b, cur), cur);
+static void clip_pipeline_thread(clip_pipeline * pipeline, const int s) {
+    int n_seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pipeline->mutex);
+            pipeline->cond.wait(lock, [&] { return pipeline->stop || pipeline->n_batch != n_seen; });
+            if (pipeline->stop) {
+                return;
+            }
+            n_seen = pipeline->n_batch;
+        }
 
-        // residual 2
-        cur = ggml_add(ctx0, embeddings, cur);
+        clip_pipeline_run(pipeline, s);
 
-        embeddings = cur;
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+        if (--pipeline->n_busy == 0) {
+            pipeline->cond_done.notify_one();
+        }
     }
+}
 
-    // get the output of cls token, e.g., 0th index
-    struct ggml_tensor * cls = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, batch_size);
-    for (int b = 0; b < batch_size; b++) {
-        ggml_set_i32_1d(cls, b, b * num_positions);
+struct clip_pipeline * clip_pipeline_init(const struct clip_ctx * ctx, int n_threads, int n_stages,
+                                          const int micro_batch) {
+    if (!ctx->has_vision_encoder) {
+        printf("This gguf file seems to have no vision encoder\n");
+        return NULL;
     }
-    embeddings = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, embeddings, hidden_size, num_positions * batch_size), cls);
 
-    // post-layernorm
-    {
-        embeddings = ggml_norm(ctx0, embeddings, eps);
-
-        embeddings = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.post_ln_w, embeddings), embeddings),
-                              ggml_repeat(ctx0, model.post_ln_b, embeddings));
+    if (!ctx->cpus.empty()) {
+        n_threads = std::min(n_threads, (int)ctx->cpus.size());
     }
-
-    ggml_set_scratch(ctx0, {0, 0, nullptr});
-
-    // final visual projection
-    embeddings = ggml_mul_mat(ctx0, model.projection, embeddings);
-
-    // normalize output embeddings
-    struct ggml_tensor * output = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, projection_dim, batch_size);
-
-    for (int b = 0; b < batch_size; b++) {
-        struct ggml_tensor * embedding = ggml_get_rows(ctx0, embeddings, ggml_new_i32(ctx0, b));
-        if (normalize) {
-            ggml_tensor * length = ggml_sqrt(ctx0, ggml_sum(ctx0, ggml_sqr(ctx0, embedding)));
-            embedding = ggml_scale_inplace(ctx0, embedding, ggml_div(ctx0, ggml_new_f32(ctx0, 1.0f), length));
+    n_threads = std::max(1, n_threads);
+
+    const auto & hparams = ctx->vision_model.hparams;
+    const int n_layer = ctx->vision_model.layers.size();
+    n_stages = std::max(1, std::min(n_stages, std::min(n_threads, n_layer)));
+
+    clip_pipeline * pipeline = new clip_pipeline;
+    pipeline->ctx = ctx;
+    pipeline->n_threads = n_threads / n_stages;
+    pipeline->micro_batch = std::max(1, micro_batch);
+
+    for (int s = 0; s < n_stages; ++s) {
+        const int layer_end = s + 1 < n_stages ? (s + 1) * n_layer / n_stages : -1;
+        clip_state * state = clip_state_new(ctx, s * n_layer / n_stages, layer_end);
+        if (!state) {
+            fprintf(stderr, "%s: failed to create stage %d of %d\n", __func__, s + 1, n_stages);
+            delete pipeline;
+            return NULL;
         }
-        output = ggml_acc(ctx0, output, embedding, output->nb[1], output->nb[2], output->nb[3], b * ggml_nbytes(embedding));
+        // every stage computes on its own slice of the cpus of the model
+        for (int t = 0; t < pipeline->n_threads && !ctx->cpus.empty(); ++t) {
+            state->cpus.push_back(ctx->cpus[s * pipeline->n_threads + t]);
+        }
+        pipeline->states.push_back(state);
     }
-    ggml_set_name(output, "check");
 
-    // run the computation
-    ggml_build_forward_expand(&gf, output);
-    ggml_cplan cplan = ggml_graph_plan(&gf, n_threads);
-    cplan.work_size *= batch_size;
-    if (cplan.work_size != 0) {
-        cplan.work_data = (uint8_t *)malloc(cplan.work_size);
+    const int num_positions = (hparams.image_size / hparams.patch_size) * (hparams.image_size / hparams.patch_size) + 1;
+    const size_t slot_size = (size_t)hparams.hidden_size * num_positions * pipeline->micro_batch;
+    for (int s = 0; s + 1 < n_stages; ++s) {
+        pipeline->links.emplace_back(new clip_pipeline_link);
+        pipeline->links.back()->slots.assign(pipeline_depth, std::vector<float>(slot_size));
     }
-    ggml_graph_compute(&gf, &cplan);
-
-// print
-#ifdef CLIP_DEBUG
-    {
-        auto print_t_f32 = [&](struct ggml_tensor * t) {
-            float * data = (float *)t->data;
-            printf("dtype: f32, dims: %jd %jd %jd %jd, nb: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3], t->nb[0],
-                   t->nb[1], t->nb[2], t->nb[3]);
-            printf("data: ");
-            for (int i = 0; i < std::min((int)t->ne[0], 20); i++) {
-                printf("%f ", data[i]);
-            }
-
-            // printf("\n\n");
-            double sum = 0.0;
-            for (int i = 0; i < ggml_nelements(t); i++) {
-                sum += data[i];
-            }
-            printf("sum:  %f\n", sum);
-        };
-
-        auto print_t_f16 = [&](struct ggml_tensor * t) {
-            ggml_fp16_t * data = (ggml_fp16_t *)t->data;
-            printf("dtype: f16, dims: %jd %jd %jd %jd\n", t->ne[0], t->ne[1], t->ne[2], t->ne[3]);
-            printf("data: ");
-            for (int i = 0; i < std::min((int)t->ne[0], 10); i++) {
-                printf("%f ", ggml_fp16_to_fp32(data[i]));
-            }
-            printf("\n\n");
-            double sum = 0.0;
-            for (int i = 0; i < ggml_nelements(t); i++) {
-                sum += ggml_fp16_to_fp32(data[i]);
-            }
-            printf("sum:  %f\n", sum);
-        };
 
-        auto * t = ggml_get_tensor(ctx0, "check");
-        // auto t = inp_raw;
-        if (t->type == GGML_TYPE_F32) {
-            print_t_f32(t);
-        } else {
-            print_t_f16(t);
-        }
+    for (int s = 1; s < n_stages; ++s) {
+        pipeline->threads.emplace_back(clip_pipeline_thread, pipeline, s);
     }
 
-    printf("used_mem = %zu\n", ggml_used_mem(ctx0));
-#endif
+    return pipeline;
+}
 
-    memcpy(vec, ggml_get_data_f32(output), sizeof(float) * projection_dim * batch_size);
+void clip_pipeline_free(struct clip_pipeline * pipeline) { delete pipeline; }
 
-    if (cplan.work_size != 0) {
-        free(cplan.work_data);
+int clip_pipeline_n_stages(const struct clip_pipeline * pipeline) { return pipeline->states.size(); }
+
+bool clip_pipeline_image_batch_encode(struct clip_pipeline * pipeline, const struct clip_image_f32_batch * imgs,
+                                      float * vec, const bool normalize) {
+    {
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+        pipeline->imgs = imgs;
+        pipeline->vec = vec;
+        pipeline->normalize = normalize;
+        pipeline->ok = true;
+        pipeline->n_busy = pipeline->threads.size();
+        pipeline->n_batch++;
     }
+    pipeline->cond.notify_all();
 
-    ggml_free(ctx0);
+    clip_pipeline_run(pipeline, 0);
 
-    return true;
+    std::unique_lock<std::mutex> lock(pipeline->mutex);
+    pipeline->cond_done.wait(lock, [&] { return pipeline->n_busy == 0; });
+
+    return pipeline->ok;
 }
 
 float clip_similarity_score(const float * vec1, const float * vec2, const int vec_dim) {
@@ -1696,9 +4040,30 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
 
     const int n_tensors = gguf_get_n_tensors(ctx_src);
 
+    // the patch embedding is written as a matrix of one row per output channel when such a row is made of whole
+    // blocks, so that it is quantized like the other weights
+    struct ggml_init_params flat_params = {
+        .mem_size = ggml_tensor_overhead(),
+        .mem_buffer = NULL,
+        .no_alloc = true,
+    };
+    struct ggml_context * ctx_flat = ggml_init(flat_params);
+    struct ggml_tensor * patch_flat = NULL;
+    {
+        struct ggml_tensor * cur = ggml_get_tensor(ctx_data, TN_PATCH_EMBD);
+        if (cur && cur->n_dims == 4 && (cur->ne[0] * cur->ne[1] * cur->ne[2]) % ggml_blck_size(type) == 0) {
+            patch_flat = ggml_new_tensor_2d(ctx_flat, cur->type, cur->ne[0] * cur->ne[1] * cur->ne[2], cur->ne[3]);
+            ggml_set_name(patch_flat, TN_PATCH_EMBD);
+            patch_flat->data = cur->data;
+        }
+    }
+
     for (int i = 0; i < n_tensors; ++i) {
         const char * name = gguf_get_tensor_name(ctx_src, i);
         struct ggml_tensor * cur = ggml_get_tensor(ctx_data, name);
+        if (patch_flat && strcmp(name, TN_PATCH_EMBD) == 0) {
+            cur = patch_flat;
+        }
         gguf_add_tensor(ctx_out, cur);
     }
 
@@ -1722,6 +4087,9 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
     for (int i = 0; i < n_tensors; ++i) {
         const std::string name = gguf_get_tensor_name(ctx_src, i);
         struct ggml_tensor * cur = ggml_get_tensor(ctx_data, name.c_str());
+        if (patch_flat && name == TN_PATCH_EMBD) {
+            cur = patch_flat;
+        }
 
         enum ggml_type new_type;
         void * new_data;
@@ -1823,6 +4191,7 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
 
     clip_free(ctx_clip);
     gguf_free(ctx_out);
+    ggml_free(ctx_flat);
 
     {
         printf("%s: original size  = %8.2f MB\n", __func__, total_size_org / 1024.0 / 1024.0);
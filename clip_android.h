@@ -6,6 +6,9 @@
 #include <stddef.h>
 
 struct clip_ctx;
+struct clip_state;
+struct clip_workers;
+struct clip_pipeline;
 
 #ifdef __cplusplus
 extern "C" {
@@ -39,10 +42,97 @@ struct clip_tokens {
     size_t size;
 };
 
+// called while the weights are read, with the number of bytes loaded so far and the total to load
+typedef void (*clip_progress_callback)(size_t loaded, size_t total, void * user_data);
+
+struct clip_model_params {
+    int verbosity;
+
+    // map the model file read-only and point the weights straight into the mapping instead of copying them.
+    // pages are faulted in on first use and shared through the page cache by all processes loading the same file
+    bool use_mmap;
+
+    // load the weights of only one tower of a two-tower file, e.g. only the text tower for a query service.
+    // the hparams of both towers are still reported, but the encode functions of a skipped tower fail
+    bool load_text_encoder;
+    bool load_vision_encoder;
+
+    // number of threads reading weights when the file is not mapped. reads are issued concurrently and overlap
+    // with building the vocab, which keeps network-backed or eMMC storage busy instead of waiting on each request
+    int n_load_threads;
+
+    // may be called from the loading threads, but never concurrently, and with loaded increasing from call to call
+    clip_progress_callback progress_callback;
+    void * progress_callback_user_data;
+
+    // optional path of a weight cache kept next to the model. when it was written from the same model file it is
+    // loaded instead, which skips the alignment copy and most of the vocab setup. otherwise it is (re)written from
+    // the model after loading it. the cache holds every tower of the model, whichever ones are loaded. ignored for
+    // models without a modification time, such as those loaded from a buffer
+    const char * cache_path;
+
+    // bytes of transformer layer weights allowed to stay in memory while encoding, 0 to keep the whole model
+    // resident. with a budget, encoders run one layer at a time, reading the next layers ahead while the current one
+    // computes and dropping each layer from memory once it is done. needs the weights to be mapped in place (see
+    // use_mmap, a cache_path makes sure of it), otherwise the budget is ignored. embeddings, norms and projections
+    // always stay resident
+    size_t layer_budget;
+
+    // CPUs to run the compute threads on, one thread per CPU in order. encode calls use at most n_cpus threads.
+    // NULL to leave thread placement to the OS
+    const int * cpus;
+    int n_cpus;
+
+    // without cpus, run the compute threads only on the performance cores, as told by the capacity the kernel
+    // gives each core or else by its maximum frequency. on mixed-core devices a thread on an efficiency core holds
+    // up the others at every step of an encode
+    bool performance_cores_only;
+
+    // on a machine with more than one NUMA node, keep a copy of the weights in the memory of every node. the
+    // executors of clip_workers are spread over the nodes and compute on the cpus of their node with its copy, see
+    // also clip_init_state_on_node(). costs a copy of the loaded towers per node, and is ignored under a layer budget
+    bool numa;
+};
+
+struct clip_model_params clip_model_default_params();
+
 struct clip_ctx * clip_model_load(const char * fname, const int verbosity);
+struct clip_ctx * clip_model_load_with_params(const char * fname, const struct clip_model_params params);
+
+// Load a GGUF model stored at [offset, offset + size) of an open file, e.g. an uncompressed asset inside an APK or a
+// model kept in a larger bundle file. With use_mmap the region is mapped, otherwise it is read once. The fd can be
+// closed as soon as this returns.
+struct clip_ctx * clip_model_load_from_fd(int fd, size_t offset, size_t size, const struct clip_model_params params);
+
+// Load a GGUF model from memory owned by the caller. Tensors point into the buffer when it is aligned to
+// GGML_MEM_ALIGN, in which case it must stay valid until clip_free(); otherwise the weights are copied.
+struct clip_ctx * clip_model_load_from_buffer(const void * data, size_t size, const struct clip_model_params params);
 
 void clip_free(struct clip_ctx * ctx);
 
+// Per-thread execution state holding the compute, scratch and work buffers of the encoders.
+// A loaded model is never written to while encoding, so any number of threads can share one clip_ctx
+// as long as each of them encodes through its own state. Free all states before the model. NULL when the buffers
+// of the state could not be allocated.
+struct clip_state * clip_init_state(const struct clip_ctx * ctx);
+void clip_free_state(struct clip_state * state);
+
+// A state that encodes with the copy of the weights on a NUMA node and computes on the cpus of that node, see
+// clip_model_params.numa. The same as clip_init_state() when the model has no copy on the node.
+struct clip_state * clip_init_state_on_node(const struct clip_ctx * ctx, int node);
+
+// Release the memory a state holds on to between calls, e.g. on a memory pressure event: its activation buffer, work
+// arena, cached graphs and compute threads. The next encode call allocates them again. clip_trim() does this for the
+// state used by the encode functions that don't take one.
+void clip_state_trim(struct clip_state * state);
+void clip_trim(struct clip_ctx * ctx);
+
+// Measure how fast the compute threads do arithmetic, move memory and pass a barrier, on the CPUs of the model. The
+// planner uses this to keep small steps of an encode on a single thread when splitting them costs more than it saves.
+// The result applies to the whole process. It can be run at any time, also while other threads encode: it only
+// changes how the nodes of later graphs are split across threads, not their order or the memory they need.
+void clip_calibrate(const struct clip_ctx * ctx, int n_threads);
+
 struct clip_text_hparams * clip_get_text_hparams(struct clip_ctx * ctx);
 struct clip_vision_hparams * clip_get_vision_hparams(struct clip_ctx * ctx);
 
@@ -97,6 +187,47 @@ void clip_image_batch_preprocess(const struct clip_ctx * ctx, const int n_thread
 bool clip_image_batch_encode(const struct clip_ctx * ctx, const int n_threads, const struct clip_image_f32_batch * imgs,
                              float * vec, const bool normalize);
 
+// same as above, but using an explicit state instead of the one owned by the model
+bool clip_text_encode_with_state(const struct clip_ctx * ctx, struct clip_state * state, const int n_threads,
+                                 const struct clip_tokens * tokens, float * vec, const bool normalize);
+bool clip_image_encode_with_state(const struct clip_ctx * ctx, struct clip_state * state, const int n_threads,
+                                  struct clip_image_f32 * img, float * vec, const bool normalize);
+bool clip_image_batch_encode_with_state(const struct clip_ctx * ctx, struct clip_state * state, const int n_threads,
+                                        const struct clip_image_f32_batch * imgs, float * vec, const bool normalize);
+
+// Throughput mode for bulk image encoding: n_workers executors share the model, each with n_threads / n_workers
+// compute threads and a state of its own, and take the images of a batch one at a time from a shared queue. A small
+// thread group passes far fewer barriers per image than all threads on a single image do. With cpus on the model
+// every executor runs on its own slice of them. n_workers <= 0 measures images per second for every even split of
+// n_threads on synthetic images and keeps the fastest, which takes a few dozen encodes. Layer streaming works but the
+// executors drop and fetch layers independently of each other, so a layer_budget costs more here than usual. NULL
+// when an executor could not be created, the search skips the splits for which that happens.
+struct clip_workers * clip_workers_init(const struct clip_ctx * ctx, int n_threads, const int n_workers);
+void clip_workers_free(struct clip_workers * workers);
+int clip_workers_count(const struct clip_workers * workers);
+int clip_workers_n_threads(const struct clip_workers * workers);
+
+// encode a batch with the executors, vec receives projection_dim values per image in batch order. not thread safe,
+// one batch at a time per clip_workers
+bool clip_workers_image_batch_encode(struct clip_workers * workers, const struct clip_image_f32_batch * imgs, float * vec,
+                                     const bool normalize);
+
+// Pipeline mode for bulk image encoding: n_stages thread groups of n_threads / n_stages threads each own a contiguous
+// range of the vision layers, and micro-batches of micro_batch images flow from one group to the next through
+// hand-off buffers two micro-batches deep. Every group keeps only the weights of its own layers hot in the caches of
+// its cores instead of streaming all weights through every core. With cpus on the model every group runs on its own
+// slice of them. The layer_budget of the model is ignored here.
+struct clip_pipeline * clip_pipeline_init(const struct clip_ctx * ctx, int n_threads, int n_stages,
+                                          const int micro_batch);
+void clip_pipeline_free(struct clip_pipeline * pipeline);
+int clip_pipeline_n_stages(const struct clip_pipeline * pipeline);
+
+// encode a batch through the stages, vec receives projection_dim values per image in batch order. returns false when
+// an image doesn't have the size of the model or a stage failed to compute a micro-batch, whose values are then left
+// as they were. not thread safe, one batch at a time per clip_pipeline
+bool clip_pipeline_image_batch_encode(struct clip_pipeline * pipeline, const struct clip_image_f32_batch * imgs,
+                                      float * vec, const bool normalize);
+
 // bool image_normalize(const clip_image_u8 *img, clip_image_f32 *res);
 
 bool clip_compare_text_and_image(const struct clip_ctx * ctx, const int n_threads, const char * text,
@@ -0,0 +1,182 @@
+// Latency percentiles of single encode calls, alone and next to threads that keep cores busy, to see how much a noisy
+// neighbour stretches the tail:
+//
+//   bench-latency -m model.gguf -t 4 -j 0,2,4
+//
+// Each background thread spins on a core of its own choosing for the whole run of a load level. A compute thread that
+// shares its core with one runs at a fraction of the speed of the others, which is the case the dynamic row
+// scheduling of the heavy ops is meant for: the other threads take over its share instead of waiting for it.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "clip_android.h"
+#include "ggml/ggml.h"
+
+// threads that burn cpu until they are stopped
+struct background_load {
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+
+    explicit background_load(const int n_threads) {
+        for (int i = 0; i < n_threads; i++) {
+            threads.emplace_back([this] {
+                volatile unsigned x = 0;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    x = x * 1664525u + 1013904223u;
+                }
+            });
+        }
+    }
+
+    ~background_load() {
+        stop = true;
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    }
+};
+
+// value at percentile p of sorted samples
+static double percentile(const std::vector<double> & sorted, const double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const size_t i = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+    return sorted[i];
+}
+
+static void print_row(const char * tower, const int load, std::vector<double> & ms) {
+    std::sort(ms.begin(), ms.end());
+    printf("| %-6s | %4d | %7.2f | %7.2f | %7.2f | %7.2f |\n", tower, load, percentile(ms, 50), percentile(ms, 90),
+           percentile(ms, 99), ms.empty() ? 0.0 : ms.back());
+    fflush(stdout);
+}
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m model.gguf [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m FNAME    model path\n");
+    fprintf(stderr, "  -t N        number of threads (default: 4)\n");
+    fprintf(stderr, "  -j LIST     comma separated numbers of background threads (default: 0,1,2)\n");
+    fprintf(stderr, "  -n N        number of encode calls per tower and load (default: 100)\n");
+    fprintf(stderr, "  -k          calibrate the thread cost model first\n");
+}
+
+int main(int argc, char ** argv) {
+    const char * model_path = NULL;
+    std::vector<int> loads = {0, 1, 2};
+    int n_threads = 4;
+    int n_iter = 100;
+    bool calibrate = false;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "-k") {
+            calibrate = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (arg == "-m") {
+            model_path = argv[++i];
+        } else if (arg == "-t") {
+            n_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-j") {
+            loads.clear();
+            for (char * tok = strtok(argv[++i], ","); tok; tok = strtok(NULL, ",")) {
+                loads.push_back(std::max(0, atoi(tok)));
+            }
+        } else if (arg == "-n") {
+            n_iter = std::max(1, atoi(argv[++i]));
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!model_path) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    clip_model_params params = clip_model_default_params();
+    params.verbosity = 0;
+
+    clip_ctx * ctx = clip_model_load_with_params(model_path, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, model_path);
+        return 1;
+    }
+
+    if (calibrate) {
+        clip_calibrate(ctx, n_threads);
+        const ggml_cost_params cost = ggml_get_cost_params();
+        printf("cost model: %.2f flops/ns, %.2f bytes/ns, %.0f ns per barrier\n\n", cost.flops_per_ns,
+               cost.bytes_per_ns, cost.sync_ns);
+    }
+
+    const auto * vision_hparams = clip_get_vision_hparams(ctx);
+    const int image_size = vision_hparams->image_size;
+    std::vector<float> pixels(3 * image_size * image_size, 0.5f);
+    clip_image_f32 image = {image_size, image_size, pixels.data(), pixels.size()};
+    const clip_image_f32_batch batch = {&image, 1};
+    std::vector<float> image_vec(vision_hparams->projection_dim);
+
+    const auto * text_hparams = clip_get_text_hparams(ctx);
+    std::vector<clip_vocab_id> ids(std::max(2, text_hparams->num_positions / 4));
+    for (size_t i = 0; i < ids.size(); i++) {
+        ids[i] = (clip_vocab_id)((i * 977 + 13) % std::max(1, text_hparams->n_vocab));
+    }
+    clip_tokens tokens = {ids.data(), ids.size()};
+    std::vector<float> text_vec(text_hparams->projection_dim);
+
+    printf("| tower  | load | p50 ms  | p90 ms  | p99 ms  | max ms  |\n");
+    printf("|--------|-----:|--------:|--------:|--------:|--------:|\n");
+
+    for (const int load : loads) {
+        background_load background(load);
+
+        if (image_size > 0) {
+            // warm up, so the graph and work memory of the shape exist
+            clip_image_batch_encode(ctx, n_threads, &batch, image_vec.data(), true);
+
+            std::vector<double> ms;
+            for (int i = 0; i < n_iter; i++) {
+                const auto start = std::chrono::steady_clock::now();
+                if (!clip_image_batch_encode(ctx, n_threads, &batch, image_vec.data(), true)) {
+                    break;
+                }
+                ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            }
+            print_row("vision", load, ms);
+        }
+
+        if (text_hparams->num_positions > 0) {
+            clip_text_encode(ctx, n_threads, &tokens, text_vec.data(), true);
+
+            std::vector<double> ms;
+            for (int i = 0; i < n_iter; i++) {
+                const auto start = std::chrono::steady_clock::now();
+                if (!clip_text_encode(ctx, n_threads, &tokens, text_vec.data(), true)) {
+                    break;
+                }
+                ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            }
+            print_row("text", load, ms);
+        }
+    }
+
+    clip_free(ctx);
+
+    return 0;
+}
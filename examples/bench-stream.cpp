@@ -0,0 +1,186 @@
+// Throughput and peak memory of the encoders under a range of layer budgets, to pick a budget for a device:
+//
+//   bench-stream -m model.gguf -c model.cache -l 0,32,64,128
+//
+// Budgets are in MB, 0 keeps the whole model resident. Layers are only streamed from a model mapped in place, which
+// the weight cache given with -c guarantees. Peak memory is the resident set size sampled while encoding.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#endif
+#endif
+
+#include "clip_android.h"
+
+// resident set size in bytes, 0 where it can't be read
+static size_t current_rss() {
+#if defined(_SC_PAGESIZE)
+    FILE * f = fopen("/proc/self/statm", "r");
+    if (f) {
+        long size = 0;
+        long resident = 0;
+        const int n = fscanf(f, "%ld %ld", &size, &resident);
+        fclose(f);
+        if (n == 2) {
+            return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+        }
+    }
+#endif
+    return 0;
+}
+
+// samples the resident set size in the background and keeps the largest value seen
+struct rss_sampler {
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> peak{0};
+    std::thread thread;
+
+    rss_sampler() {
+        thread = std::thread([this] {
+            while (!stop) {
+                peak = std::max(peak.load(), current_rss());
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+
+    size_t finish() {
+        stop = true;
+        thread.join();
+        return std::max(peak.load(), current_rss());
+    }
+};
+
+static double seconds_since(const std::chrono::steady_clock::time_point & start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m model.gguf [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m FNAME    model path\n");
+    fprintf(stderr, "  -c FNAME    weight cache path, written on the first run\n");
+    fprintf(stderr, "  -l LIST     comma separated layer budgets in MB (default: 0,64,128,256)\n");
+    fprintf(stderr, "  -t N        number of threads (default: 4)\n");
+    fprintf(stderr, "  -b N        image batch size (default: 1)\n");
+    fprintf(stderr, "  -n N        number of encode calls per tower and budget (default: 8)\n");
+}
+
+int main(int argc, char ** argv) {
+    const char * model_path = NULL;
+    const char * cache_path = NULL;
+    std::vector<size_t> budgets = {0, 64, 128, 256};
+    int n_threads = 4;
+    int batch_size = 1;
+    int n_iter = 8;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (arg == "-m") {
+            model_path = argv[++i];
+        } else if (arg == "-c") {
+            cache_path = argv[++i];
+        } else if (arg == "-l") {
+            budgets.clear();
+            for (char * tok = strtok(argv[++i], ","); tok; tok = strtok(NULL, ",")) {
+                budgets.push_back(strtoul(tok, NULL, 10));
+            }
+        } else if (arg == "-t") {
+            n_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-b") {
+            batch_size = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-n") {
+            n_iter = std::max(1, atoi(argv[++i]));
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!model_path) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    printf("| budget MB | load ms | images/s | texts/s | peak RSS MB |\n");
+    printf("|----------:|--------:|---------:|--------:|------------:|\n");
+
+    for (const size_t budget : budgets) {
+        rss_sampler sampler;
+
+        clip_model_params params = clip_model_default_params();
+        params.verbosity = 0;
+        params.cache_path = cache_path;
+        params.layer_budget = budget * 1024 * 1024;
+
+        auto start = std::chrono::steady_clock::now();
+        clip_ctx * ctx = clip_model_load_with_params(model_path, params);
+        if (!ctx) {
+            fprintf(stderr, "%s: failed to load model '%s'\n", __func__, model_path);
+            sampler.finish();
+            return 1;
+        }
+        const double t_load = seconds_since(start);
+
+        double images_per_s = 0.0;
+        const auto * vision_hparams = clip_get_vision_hparams(ctx);
+        if (vision_hparams->image_size > 0) {
+            const int image_size = vision_hparams->image_size;
+            std::vector<float> pixels(3 * image_size * image_size, 0.5f);
+            std::vector<clip_image_f32> images(batch_size, {image_size, image_size, pixels.data(), pixels.size()});
+            const clip_image_f32_batch batch = {images.data(), images.size()};
+            std::vector<float> vec(vision_hparams->projection_dim * batch_size);
+
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < n_iter; i++) {
+                if (!clip_image_batch_encode(ctx, n_threads, &batch, vec.data(), true)) {
+                    break;
+                }
+            }
+            images_per_s = n_iter * batch_size / seconds_since(start);
+        }
+
+        double texts_per_s = 0.0;
+        const auto * text_hparams = clip_get_text_hparams(ctx);
+        if (text_hparams->num_positions > 0) {
+            std::vector<clip_vocab_id> ids(text_hparams->num_positions);
+            for (size_t i = 0; i < ids.size(); i++) {
+                ids[i] = (clip_vocab_id)((i * 977 + 13) % text_hparams->n_vocab);
+            }
+            clip_tokens tokens = {ids.data(), ids.size()};
+            std::vector<float> vec(text_hparams->projection_dim);
+
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < n_iter; i++) {
+                if (!clip_text_encode(ctx, n_threads, &tokens, vec.data(), true)) {
+                    break;
+                }
+            }
+            texts_per_s = n_iter / seconds_since(start);
+        }
+
+        clip_free(ctx);
+        const size_t peak = sampler.finish();
+
+        printf("| %9zu | %7.1f | %8.2f | %7.2f | %11.1f |\n", budget, t_load * 1e3, images_per_s, texts_per_s,
+               peak / 1024.0 / 1024.0);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Images per second of bulk encoding with the threads split into independent executors, to see where fewer threads
+// per image beat all of them on one image, and with the layers split into pipeline stages:
+//
+//   bench-throughput -m model.gguf -t 8 -w 0,1,2,4,8 -p 2,4 -b 4
+//
+// A count of 0 lets clip_workers_init() measure the splits itself and keep the fastest one.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "clip_android.h"
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m model.gguf [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m FNAME    model path\n");
+    fprintf(stderr, "  -t N        number of threads (default: 4)\n");
+    fprintf(stderr, "  -w LIST     comma separated numbers of executors, 0 to pick one (default: 0,1,2,4)\n");
+    fprintf(stderr, "  -n N        number of images per run (default: 64)\n");
+    fprintf(stderr, "  -p LIST     comma separated numbers of pipeline stages (default: none)\n");
+    fprintf(stderr, "  -b N        images per pipeline micro-batch (default: 4)\n");
+}
+
+int main(int argc, char ** argv) {
+    const char * model_path = NULL;
+    std::vector<int> counts = {0, 1, 2, 4};
+    std::vector<int> stages;
+    int n_threads = 4;
+    int n_images = 64;
+    int micro_batch = 4;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (arg == "-m") {
+            model_path = argv[++i];
+        } else if (arg == "-t") {
+            n_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-w") {
+            counts.clear();
+            for (char * tok = strtok(argv[++i], ","); tok; tok = strtok(NULL, ",")) {
+                counts.push_back(std::max(0, atoi(tok)));
+            }
+        } else if (arg == "-n") {
+            n_images = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-p") {
+            for (char * tok = strtok(argv[++i], ","); tok; tok = strtok(NULL, ",")) {
+                stages.push_back(std::max(1, atoi(tok)));
+            }
+        } else if (arg == "-b") {
+            micro_batch = std::max(1, atoi(argv[++i]));
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!model_path) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    clip_model_params params = clip_model_default_params();
+    params.verbosity = 0;
+
+    clip_ctx * ctx = clip_model_load_with_params(model_path, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, model_path);
+        return 1;
+    }
+
+    const auto * hparams = clip_get_vision_hparams(ctx);
+    const int image_size = hparams->image_size;
+    std::vector<float> pixels(3 * image_size * image_size, 0.5f);
+    std::vector<clip_image_f32> images(n_images, {image_size, image_size, pixels.data(), pixels.size()});
+    const clip_image_f32_batch batch = {images.data(), images.size()};
+    std::vector<float> vec((size_t)hparams->projection_dim * n_images);
+
+    printf("| asked | executors | threads each | init ms | images/s |\n");
+    printf("|------:|----------:|-------------:|--------:|---------:|\n");
+
+    for (const int count : counts) {
+        auto start = std::chrono::steady_clock::now();
+        clip_workers * workers = clip_workers_init(ctx, n_threads, count);
+        if (!workers) {
+            break;
+        }
+        const double t_init = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // warm up, so every executor has built its graph
+        clip_workers_image_batch_encode(workers, &batch, vec.data(), true);
+
+        start = std::chrono::steady_clock::now();
+        clip_workers_image_batch_encode(workers, &batch, vec.data(), true);
+        const double t_run = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("| %5d | %9d | %12d | %7.1f | %8.2f |\n", count, clip_workers_count(workers),
+               clip_workers_n_threads(workers), t_init * 1e3, n_images / t_run);
+        fflush(stdout);
+
+        clip_workers_free(workers);
+    }
+
+    if (!stages.empty()) {
+        printf("\n| stages | threads each | micro-batch | images/s |\n");
+        printf("|-------:|-------------:|------------:|---------:|\n");
+    }
+
+    for (const int n_stages : stages) {
+        clip_pipeline * pipeline = clip_pipeline_init(ctx, n_threads, n_stages, micro_batch);
+        if (!pipeline) {
+            break;
+        }
+
+        clip_pipeline_image_batch_encode(pipeline, &batch, vec.data(), true);
+
+        const auto start = std::chrono::steady_clock::now();
+        clip_pipeline_image_batch_encode(pipeline, &batch, vec.data(), true);
+        const double t_run = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const int n = clip_pipeline_n_stages(pipeline);
+        printf("| %6d | %12d | %11d | %8.2f |\n", n, n_threads / n, micro_batch, n_images / t_run);
+        fflush(stdout);
+
+        clip_pipeline_free(pipeline);
+    }
+
+    clip_free(ctx);
+
+    return 0;
+}
@@ -41,6 +41,10 @@ android {
     buildFeatures {
         compose = true
     }
+    androidResources {
+        // keep the model uncompressed so it can be mapped directly from the APK through AssetManager.openFd()
+        noCompress += "gguf"
+    }
 }
 
 dependencies {
@@ -18,7 +18,6 @@ import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
 import java.io.File
 import java.io.FileOutputStream
-import java.io.InputStream
 import android.content.Context
 import androidx.compose.runtime.*
 import io.objectbox.Box
@@ -167,11 +166,6 @@ class MainActivity : ComponentActivity() {
                     val encodedFilesInFolder = encodedRegistry.getOrDefault(folderName, mutableSetOf())
 
                     // Get model path
-                    val modelPath = getAssetFilePath(
-                        applicationContext,
-                        "models/CLIP-ViT-B-32-laion2B-s34B-b79K_ggml-model-q8_0.gguf"
-                    )
-
                     // Get the selected folder path
                     val imagesFolderPath = getAssetFolderPath(applicationContext, folderName)
                     val imagesFolder = File(imagesFolderPath)
@@ -215,12 +209,11 @@ class MainActivity : ComponentActivity() {
 
                         val imagePaths = batch.map { it.absolutePath }.toTypedArray()
 
-                        val result = clipExtractor.extractVectors(
-                            modelPath = modelPath,
+                        val result = extractVectorsFromAsset(
+                            applicationContext,
+                            MODEL_ASSET,
                             imagePaths = imagePaths,
-                            texts = emptyArray(),
-                            nThreads = 4,
-                            verbose = 0
+                            texts = emptyArray()
                         )
 
                         if (result.success) {
@@ -291,18 +284,12 @@ class MainActivity : ComponentActivity() {
 
                 val results = withContext(Dispatchers.IO) {
                     // Get model path
-                    val modelPath = getAssetFilePath(
-                        applicationContext,
-                        "models/CLIP-ViT-B-32-laion2B-s34B-b79K_ggml-model-q8_0.gguf"
-                    )
-
                     // Encode the query text
-                    val result = clipExtractor.extractVectors(
-                        modelPath = modelPath,
+                    val result = extractVectorsFromAsset(
+                        applicationContext,
+                        MODEL_ASSET,
                         imagePaths = emptyArray(),
-                        texts = arrayOf(query),
-                        nThreads = 4,
-                        verbose = 0
+                        texts = arrayOf(query)
                     )
 
                     if (result.success && result.textEmbeddings.isNotEmpty()) {
@@ -336,32 +323,24 @@ class MainActivity : ComponentActivity() {
         }
     }
 
-    private fun getAssetFilePath(context: Context, assetName: String): String {
-        val file = File(context.filesDir, assetName)
-
-        if (file.exists()) {
-            Log.d(TAG, "File already exists: ${file.absolutePath}")
-            return file.absolutePath
-        }
-
-        file.parentFile?.mkdirs()
-
-        try {
-            val inputStream: InputStream = context.assets.open(assetName)
-            val outputStream = FileOutputStream(file)
-
-            inputStream.use { input ->
-                outputStream.use { output ->
-                    input.copyTo(output)
-                }
-            }
-
-            Log.d(TAG, "Copied asset '$assetName' to '${file.absolutePath}'")
-            return file.absolutePath
-
-        } catch (e: Exception) {
-            Log.e(TAG, "Error copying asset '$assetName': ${e.message}", e)
-            throw e
+    // The model is stored uncompressed in the APK (see noCompress in build.gradle.kts), so the native side can map it
+    // straight from the APK file through the asset's file descriptor instead of copying it into filesDir first
+    private fun extractVectorsFromAsset(
+        context: Context,
+        assetName: String,
+        imagePaths: Array<String>,
+        texts: Array<String>
+    ): ClipResult {
+        context.assets.openFd(assetName).use { afd ->
+            return clipExtractor.extractVectorsFromFd(
+                modelFd = afd.parcelFileDescriptor.fd,
+                modelOffset = afd.startOffset,
+                modelLength = afd.length,
+                imagePaths = imagePaths,
+                texts = texts,
+                nThreads = 4,
+                verbose = 0
+            )
         }
     }
 
@@ -404,5 +383,6 @@ class MainActivity : ComponentActivity() {
 
     companion object {
         private const val TAG = "ClipExample"
+        private const val MODEL_ASSET = "models/CLIP-ViT-B-32-laion2B-s34B-b79K_ggml-model-q8_0.gguf"
     }
 }
\ No newline at end of file
@@ -108,50 +108,8 @@ jfloatArray vectorToJfloatArray(JNIEnv* env, const std::vector<float>& vec) {
     return result;
 }
 
-extern "C" {
-
-JNIEXPORT jobject JNICALL
-Java_com_example_clip_ClipExtractor_extractVectors(
-        JNIEnv* env,
-        jobject /* this */,
-        jstring jModelPath,
-        jobjectArray jImagePaths,
-        jobjectArray jTexts,
-        jint nThreads,
-        jint verbose
-) {
-    LOGD("Starting extractVectors");
-
-    // Convert Java strings to C++ strings
-    const char* modelPathCStr = env->GetStringUTFChars(jModelPath, nullptr);
-    std::string modelPath(modelPathCStr);
-    env->ReleaseStringUTFChars(jModelPath, modelPathCStr);
-
-    std::vector<std::string> imagePaths = jstringArrayToVector(env, jImagePaths);
-    std::vector<std::string> texts = jstringArrayToVector(env, jTexts);
-
-    LOGD("Processing %zu images folder and %zu texts", imagePaths.size(), texts.size());
-    // Expand folders into individual image files
-    std::vector<std::string> allImagePaths;
-    for (const auto& inputPath : imagePaths) {
-        LOGD("Processing input path: %s", inputPath.c_str());
-        std::vector<std::string> foundImages = getImageFilesFromPath(inputPath);
-        allImagePaths.insert(allImagePaths.end(), foundImages.begin(), foundImages.end());
-    }
-
-    LOGD("Total image files to process: %zu", allImagePaths.size());
-    for (size_t i = 0; i < allImagePaths.size(); i++) {
-        LOGD("  Image[%zu]: %s", i, allImagePaths[i].c_str());
-    }
-    // Call the actual extraction function
-    EncodingResult result = clip_extract_vectors(
-            modelPath,
-            imagePaths,
-            texts,
-            nThreads,
-            verbose
-    );
-
+// Convert an EncodingResult into a com.example.clip.ClipResult
+static jobject encodingResultToJava(JNIEnv* env, const EncodingResult& result) {
     // Find the ClipResult class
     jclass resultClass = env->FindClass("com/example/clip/ClipResult");
     if (resultClass == nullptr) {
@@ -243,8 +201,96 @@ Java_com_example_clip_ClipExtractor_extractVectors(
     }
     env->SetObjectField(jResult, textsField, jTextsProcessed );
 
+    return jResult;
+}
+
+extern "C" {
+
+JNIEXPORT jobject JNICALL
+Java_com_example_clip_ClipExtractor_extractVectors(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jModelPath,
+        jobjectArray jImagePaths,
+        jobjectArray jTexts,
+        jint nThreads,
+        jint verbose
+) {
+    LOGD("Starting extractVectors");
+
+    // Convert Java strings to C++ strings
+    const char* modelPathCStr = env->GetStringUTFChars(jModelPath, nullptr);
+    std::string modelPath(modelPathCStr);
+    env->ReleaseStringUTFChars(jModelPath, modelPathCStr);
+
+    std::vector<std::string> imagePaths = jstringArrayToVector(env, jImagePaths);
+    std::vector<std::string> texts = jstringArrayToVector(env, jTexts);
+
+    LOGD("Processing %zu images folder and %zu texts", imagePaths.size(), texts.size());
+    // Expand folders into individual image files
+    std::vector<std::string> allImagePaths;
+    for (const auto& inputPath : imagePaths) {
+        LOGD("Processing input path: %s", inputPath.c_str());
+        std::vector<std::string> foundImages = getImageFilesFromPath(inputPath);
+        allImagePaths.insert(allImagePaths.end(), foundImages.begin(), foundImages.end());
+    }
+
+    LOGD("Total image files to process: %zu", allImagePaths.size());
+    for (size_t i = 0; i < allImagePaths.size(); i++) {
+        LOGD("  Image[%zu]: %s", i, allImagePaths[i].c_str());
+    }
+    // Call the actual extraction function
+    EncodingResult result = clip_extract_vectors(
+            modelPath,
+            imagePaths,
+            texts,
+            nThreads,
+            verbose
+    );
+
+    jobject jResult = encodingResultToJava(env, result);
+    if (jResult == nullptr) {
+        return nullptr;
+    }
+
     LOGD("Successfully completed extractVectors");
     return jResult;
 }
 
+JNIEXPORT jobject JNICALL
+Java_com_example_clip_ClipExtractor_extractVectorsFromFd(
+        JNIEnv* env,
+        jobject /* this */,
+        jint modelFd,
+        jlong modelOffset,
+        jlong modelLength,
+        jobjectArray jImagePaths,
+        jobjectArray jTexts,
+        jint nThreads,
+        jint verbose
+) {
+    LOGD("Starting extractVectorsFromFd (fd %d, offset %lld, length %lld)", modelFd, (long long) modelOffset, (long long) modelLength);
+
+    std::vector<std::string> imagePaths = jstringArrayToVector(env, jImagePaths);
+    std::vector<std::string> texts = jstringArrayToVector(env, jTexts);
+
+    EncodingResult result = clip_extract_vectors_from_fd(
+            modelFd,
+            modelOffset,
+            modelLength,
+            imagePaths,
+            texts,
+            nThreads,
+            verbose
+    );
+
+    jobject jResult = encodingResultToJava(env, result);
+    if (jResult == nullptr) {
+        return nullptr;
+    }
+
+    LOGD("Successfully completed extractVectorsFromFd");
+    return jResult;
+}
+
 } // extern "C"
\ No newline at end of file
@@ -36,6 +36,24 @@ class ClipExtractor {
         verbose: Int = 0
     ): ClipResult
 
+    /**
+     * Same as extractVectors, but reads the model from a region of an open file instead of a path,
+     * e.g. an uncompressed asset opened with AssetManager.openFd(), so it never has to be copied out of the APK
+     *
+     * @param modelFd File descriptor of the file containing the model
+     * @param modelOffset Offset of the model in the file
+     * @param modelLength Size of the model in bytes
+     */
+    external fun extractVectorsFromFd(
+        modelFd: Int,
+        modelOffset: Long,
+        modelLength: Long,
+        imagePaths: Array<String>,
+        texts: Array<String>,
+        nThreads: Int = 4,
+        verbose: Int = 0
+    ): ClipResult
+
 //    /**
 //     * Extract embeddings from images only
 //     */
@@ -218,6 +218,8 @@
 #define GGML_MAX_PARAMS        256
 #define GGML_MAX_CONTEXTS      64
 #define GGML_MAX_SRC           6
+#define GGML_MAX_CONCURRENCY   8
+#define GGML_MAX_CHAIN         16
 #define GGML_MAX_NAME          64
 #define GGML_MAX_OP_PARAMS     32
 #define GGML_DEFAULT_N_THREADS 4
@@ -293,6 +295,8 @@ extern "C" {
 
     struct ggml_object;
     struct ggml_context;
+    struct ggml_threadpool;
+    struct ggml_compute_state_shared;
 
     enum ggml_type {
         GGML_TYPE_F32  = 0,
@@ -400,6 +404,7 @@ extern "C" {
         GGML_OP_UPSCALE, // nearest interpolate
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_WIN_PART,
@@ -501,6 +506,13 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // the first thread and the part of the work data of a member of a step computed side by side
+    struct ggml_step_member {
+        int    ith;
+        size_t work_offs;
+        size_t work_size;
+    };
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -515,6 +527,16 @@ extern "C" {
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // threads to compute the graph with, NULL to start them for this call only
+        struct ggml_threadpool * threadpool;
+
+        // steps of nodes to compute side by side and where their members compute, see ggml_graph_plan_concurrent()
+        const int * steps;
+        const struct ggml_step_member * members;
+
+        // chains of row-wise nodes to compute without a barrier in between, see ggml_graph_find_chains()
+        const int * chains;
     };
 
     // next prime after GGML_MAX_NODES
@@ -575,6 +597,12 @@ extern "C" {
         // work buffer for all threads
         size_t wsize;
         void * wdata;
+
+        // state shared by the threads computing the graph, NULL outside of ggml_graph_compute()
+        struct ggml_compute_state_shared * shared;
+
+        // index of the node among the nodes computed side by side with it
+        int slot;
     };
 
     // misc
@@ -587,6 +615,8 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(void); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API int     ggml_numa_n_nodes(void); // NUMA nodes found by ggml_numa_init, 0 before it ran
+    GGML_API int     ggml_numa_node_cpus(int node, int * cpus, int n_max); // cpus of a node, returns their number
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -939,6 +969,15 @@ extern "C" {
             struct ggml_tensor  * a,
             float                 eps);
 
+    // normalize along rows, then scale by w and shift by b in the same pass
+    // w and b are F32 vectors of a->ne[0] elements
+    GGML_API struct ggml_tensor * ggml_norm_affine(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * w,
+            struct ggml_tensor  * b,
+            float                 eps);
+
     GGML_API struct ggml_tensor * ggml_rms_norm(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -1402,6 +1441,18 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // softmax(k*q*scale) applied to v, with the scores of a block of queries computed for a block of keys at a time
+    // and folded into the result with an online softmax, so that they are never stored
+    // q: [d, n_q, n_head, n_batch], k: [d, n_kv, n_head, n_batch], v: [d_v, n_kv, n_head, n_batch]
+    // rows must be contiguous, the other dims may be strided, e.g. permuted views of the heads of a projection
+    // result: [d_v, n_head, n_q, n_batch], i.e. the heads of every query side by side
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            float                 scale);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
@@ -1641,6 +1692,49 @@ extern "C" {
     GGML_API               int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
     GGML_API              void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // reorders the nodes of a graph so that nodes that don't depend on each other follow each other, in steps of up to
+    // GGML_MAX_CONCURRENCY nodes. steps[i] receives the number of nodes from node i to the end of its step, so 1 marks
+    // the last node of a step. the members of a step are searched among the next n_lookahead pending nodes
+    GGML_API void ggml_graph_find_concurrency(struct ggml_cgraph * cgraph, int * steps, int n_lookahead);
+
+    // finds runs of up to GGML_MAX_CHAIN consecutive nodes of the same shape that compute each row of their result from
+    // the same row of their other inputs of that shape (elementwise ops, norm, soft_max, ...). the threads compute such
+    // a chain block of rows by block of rows, every block through all of its nodes while it is in cache, with a single
+    // barrier at the end of the chain. chains[i] receives the number of nodes from node i to the end of its chain, 1
+    // for the last node of a chain and for nodes that aren't part of one. the steps of ggml_graph_find_concurrency(),
+    // if not NULL, are cut so that none of them overlaps a chain
+    GGML_API void ggml_graph_find_chains(const struct ggml_cgraph * cgraph, int * steps, int * chains);
+
+    // same as ggml_graph_plan(), but the members of every step found by ggml_graph_find_concurrency() are computed side
+    // by side on disjoint groups of threads where the cost model expects that to be faster than one after the other,
+    // and the chains found by ggml_graph_find_chains() are computed without barriers between their nodes. neither the
+    // members of a step nor the nodes of a chain may reuse memory another one of them still reads, e.g. allocate the
+    // graph with a barrier in the parse sequence of ggml-alloc only where both a step and a chain end. members receives
+    // the threads and work data of the members of the steps and needs an entry per node when steps are given. steps,
+    // members and chains can be NULL, and have to stay valid until the graph is computed
+    GGML_API struct ggml_cplan ggml_graph_plan_concurrent(struct ggml_cgraph * cgraph, int n_threads, const int * steps,
+            struct ggml_step_member * members, const int * chains);
+
+    // costs ggml_graph_plan() weighs to decide whether a node is worth splitting across threads. the defaults are
+    // rough; ggml_cost_calibrate() measures them on the threads of a pool (or on the calling thread alone, which
+    // leaves sync_ns as it is). they can be set while other threads plan graphs, and only change how nodes are split
+    // across threads: ggml_graph_find_concurrency() orders the nodes by the default costs
+    struct ggml_cost_params {
+        float flops_per_ns; // arithmetic throughput of one thread
+        float bytes_per_ns; // memory throughput of one thread
+        float sync_ns;      // time all threads take to pass a barrier
+    };
+
+    GGML_API struct ggml_cost_params ggml_get_cost_params(void);
+    GGML_API void                    ggml_set_cost_params(struct ggml_cost_params params);
+    GGML_API struct ggml_cost_params ggml_cost_calibrate (struct ggml_threadpool * threadpool);
+
+    // worker threads kept alive across ggml_graph_compute() calls, for plans of up to n_threads threads
+    // cpus: optional cpu of every thread, including thread 0 which is the thread calling ggml_graph_compute()
+    GGML_API struct ggml_threadpool * ggml_threadpool_new      (int n_threads, const int * cpus);
+    GGML_API void                     ggml_threadpool_free     (struct ggml_threadpool * threadpool);
+    GGML_API int                      ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
@@ -1869,7 +1963,8 @@ extern "C" {
 
     GGML_API struct gguf_context * gguf_init_empty(void);
     GGML_API struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params);
-    //GGML_API struct gguf_context * gguf_init_from_buffer(..);
+    // the buffer is only read during the call, tensor data is copied if params.ctx requests it
+    GGML_API struct gguf_context * gguf_init_from_buffer(const void * data, size_t size, struct gguf_init_params params);
 
     GGML_API void gguf_free(struct gguf_context * ctx);
 
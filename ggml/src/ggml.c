@@ -96,6 +96,44 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef SRWLOCK pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeSRWLock(mutex);
+    return 0;
+}
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    (void) mutex;
+    return 0;
+}
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    AcquireSRWLockExclusive(mutex);
+    return 0;
+}
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    ReleaseSRWLockExclusive(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    return SleepConditionVariableSRW(cond, mutex, INFINITE, 0) ? 0 : EINVAL;
+}
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -3739,6 +3777,41 @@ inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #endif
 }
 
+// y = y*v*w + b, the scale and shift of a layer norm
+inline static void ggml_vec_scale_shift_f32(const int n, float * restrict y, const float v, const float * restrict w, const float * restrict b) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC vx = GGML_F32_VEC_SET1(v);
+
+    GGML_F32_VEC ay[GGML_F32_ARR];
+    GGML_F32_VEC aw[GGML_F32_ARR];
+    GGML_F32_VEC ab[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ay[j] = GGML_F32_VEC_LOAD(y + i + j*GGML_F32_EPR);
+            aw[j] = GGML_F32_VEC_LOAD(w + i + j*GGML_F32_EPR);
+            ab[j] = GGML_F32_VEC_LOAD(b + i + j*GGML_F32_EPR);
+            ay[j] = GGML_F32_VEC_MUL(ay[j], vx);
+            ay[j] = GGML_F32_VEC_FMA(ab[j], ay[j], aw[j]);
+
+            GGML_F32_VEC_STORE(y + i + j*GGML_F32_EPR, ay[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        y[i] = y[i]*v*w[i] + b[i];
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        y[i] = y[i]*v*w[i] + b[i];
+    }
+#endif
+}
+
 inline static void ggml_vec_norm_f32 (const int n, float * s, const float * x) { ggml_vec_dot_f32(n, s, x, x); *s = sqrtf(*s);   }
 inline static void ggml_vec_sqr_f32  (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = x[i]*x[i];   }
 inline static void ggml_vec_sqrt_f32 (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = sqrtf(x[i]); }
@@ -3977,6 +4050,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "UPSCALE",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -4001,7 +4075,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -4059,6 +4133,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "upscale(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -4083,7 +4158,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -4270,6 +4345,24 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+int ggml_numa_n_nodes(void) {
+    return g_state.numa.n_nodes;
+}
+
+int ggml_numa_node_cpus(int node, int * cpus, int n_max) {
+    if (node < 0 || node >= (int) g_state.numa.n_nodes) {
+        return 0;
+    }
+
+    const struct ggml_numa_node * numa_node = &g_state.numa.nodes[node];
+    const int n = MIN((int) numa_node->n_cpus, n_max);
+    for (int i = 0; i < n; ++i) {
+        cpus[i] = numa_node->cpus[i];
+    }
+
+    return n;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -6008,15 +6101,26 @@ struct ggml_tensor * ggml_silu_back(
 static struct ggml_tensor * ggml_norm_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * b,
         float eps,
         bool inplace) {
     bool is_node = false;
 
-    if (!inplace && (a->grad)) {
+    if (!inplace && (a->grad || (w && w->grad) || (b && b->grad))) {
         GGML_ASSERT(false); // TODO: implement backward
         is_node = true;
     }
 
+    // the scale and the shift come together
+    GGML_ASSERT((w == NULL) == (b == NULL));
+
+    if (w) {
+        GGML_ASSERT(w->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_is_vector(w) && ggml_is_vector(b));
+        GGML_ASSERT(w->ne[0] == a->ne[0] && b->ne[0] == a->ne[0]);
+    }
+
     struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
 
     ggml_set_op_params(result, &eps, sizeof(eps));
@@ -6024,6 +6128,8 @@ static struct ggml_tensor * ggml_norm_impl(
     result->op   = GGML_OP_NORM;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src[0] = a;
+    result->src[1] = w;
+    result->src[2] = b;
 
     return result;
 }
@@ -6032,14 +6138,23 @@ struct ggml_tensor * ggml_norm(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         float eps) {
-    return ggml_norm_impl(ctx, a, eps, false);
+    return ggml_norm_impl(ctx, a, NULL, NULL, eps, false);
 }
 
 struct ggml_tensor * ggml_norm_inplace(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         float eps) {
-    return ggml_norm_impl(ctx, a, eps, true);
+    return ggml_norm_impl(ctx, a, NULL, NULL, eps, true);
+}
+
+struct ggml_tensor * ggml_norm_affine(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * b,
+        float eps) {
+    return ggml_norm_impl(ctx, a, w, b, eps, false);
 }
 
 // ggml_rms_norm
@@ -7438,6 +7553,37 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        float                 scale) {
+    GGML_ASSERT(q->type == GGML_TYPE_F32 && k->type == GGML_TYPE_F32 && v->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->ne[0] == q->ne[0]);
+    GGML_ASSERT(v->ne[1] == k->ne[1]);
+    GGML_ASSERT(k->ne[2] == q->ne[2] && v->ne[2] == q->ne[2]);
+    GGML_ASSERT(k->ne[3] == q->ne[3] && v->ne[3] == q->ne[3]);
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, v->ne[0], q->ne[2], q->ne[1], q->ne[3]);
+
+    ggml_set_op_params(result, &scale, sizeof(scale));
+
+    result->op   = GGML_OP_FLASH_ATTN_EXT;
+    result->grad = NULL;
+    result->src[0] = q;
+    result->src[1] = k;
+    result->src[2] = v;
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -8170,6 +8316,14 @@ void ggml_set_param(
     tensor->grad = ggml_dup_tensor(ctx, tensor);
 }
 
+// rows of the chunks that the threads computing a per-row op claim from each other, see ggml_chunk_next()
+#define GGML_CHUNK_ROWS 16
+
+// Dynamic scheduling of the chunks of an op: every thread starts with the chunk of its own index and then claims the
+// next one no thread has taken, so faster threads take on more chunks. Outside of a graph compute the chunks are
+// dealt out statically.
+static int64_t ggml_chunk_next(const struct ggml_compute_params * params, int64_t ichunk);
+
 // ggml_compute_forward_dup
 
 static void ggml_compute_forward_dup_same_cont(
@@ -10565,31 +10719,30 @@ static void ggml_compute_forward_gelu_f32(
     }
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     const int nc = src0->ne[0];
     const int nr = ggml_nrows(src0);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    const int nchunk = (nr + GGML_CHUNK_ROWS - 1)/GGML_CHUNK_ROWS;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    for (int64_t ichunk = ith; ichunk < nchunk; ichunk = ggml_chunk_next(params, ichunk)) {
+        const int ir0 = ichunk*GGML_CHUNK_ROWS;
+        const int ir1 = MIN(ir0 + GGML_CHUNK_ROWS, nr);
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        ggml_vec_gelu_f32(nc,
-                (float *) ((char *) dst->data  + i1*( dst->nb[1])),
-                (float *) ((char *) src0->data + i1*(src0->nb[1])));
+        for (int i1 = ir0; i1 < ir1; i1++) {
+            ggml_vec_gelu_f32(nc,
+                    (float *) ((char *) dst->data  + i1*( dst->nb[1])),
+                    (float *) ((char *) src0->data + i1*(src0->nb[1])));
 
 #ifndef NDEBUG
-        for (int k = 0; k < nc; k++) {
-            const float x = ((float *) ((char *) dst->data + i1*( dst->nb[1])))[k];
-            UNUSED(x);
-            assert(!isnan(x));
-            assert(!isinf(x));
-        }
+            for (int k = 0; k < nc; k++) {
+                const float x = ((float *) ((char *) dst->data + i1*( dst->nb[1])))[k];
+                UNUSED(x);
+                assert(!isnan(x));
+                assert(!isinf(x));
+            }
 #endif
+        }
     }
 }
 
@@ -10806,38 +10959,53 @@ static void ggml_compute_forward_norm_f32(
     GGML_ASSERT(src0->nb[0] == sizeof(float));
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     GGML_TENSOR_UNARY_OP_LOCALS;
 
     float eps;
     memcpy(&eps, dst->op_params, sizeof(float));
 
+    // optional scale and shift, applied in the same pass as the normalization
+    const float * w = dst->src[1] ? (const float *) dst->src[1]->data : NULL;
+    const float * b = dst->src[2] ? (const float *) dst->src[2]->data : NULL;
+
+    const int64_t nr = ne01*ne02*ne03;
+    const int64_t nchunk = (nr + GGML_CHUNK_ROWS - 1)/GGML_CHUNK_ROWS;
+
     // TODO: optimize
-    for (int64_t i03 = 0; i03 < ne03; i03++) {
-        for (int64_t i02 = 0; i02 < ne02; i02++) {
-            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
-                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+    for (int64_t ichunk = ith; ichunk < nchunk; ichunk = ggml_chunk_next(params, ichunk)) {
+        const int64_t ir0 = ichunk*GGML_CHUNK_ROWS;
+        const int64_t ir1 = MIN(ir0 + GGML_CHUNK_ROWS, nr);
 
-                ggml_float sum = 0.0;
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    sum += (ggml_float)x[i00];
-                }
+        for (int64_t ir = ir0; ir < ir1; ir++) {
+            const int64_t i03 = ir/(ne02*ne01);
+            const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+            const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-                float mean = sum/ne00;
+            const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
 
-                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+            ggml_float sum = 0.0;
+            for (int64_t i00 = 0; i00 < ne00; i00++) {
+                sum += (ggml_float)x[i00];
+            }
 
-                ggml_float sum2 = 0.0;
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    float v = x[i00] - mean;
-                    y[i00] = v;
-                    sum2 += (ggml_float)(v*v);
-                }
+            float mean = sum/ne00;
+
+            float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
 
-                float variance = sum2/ne00;
-                const float scale = 1.0f/sqrtf(variance + eps);
+            ggml_float sum2 = 0.0;
+            for (int64_t i00 = 0; i00 < ne00; i00++) {
+                float v = x[i00] - mean;
+                y[i00] = v;
+                sum2 += (ggml_float)(v*v);
+            }
 
+            float variance = sum2/ne00;
+            const float scale = 1.0f/sqrtf(variance + eps);
+
+            if (w) {
+                ggml_vec_scale_shift_f32(ne00, y, scale, w, b);
+            } else {
                 ggml_vec_scale_f32(ne00, y, scale);
             }
         }
@@ -11231,7 +11399,6 @@ static void ggml_compute_forward_mul_mat(
     GGML_TENSOR_BINARY_OP_LOCALS;
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     const enum ggml_type type = src0->type;
 
@@ -11360,31 +11527,6 @@ static void ggml_compute_forward_mul_mat(
 
     //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
 
-    // distribute the thread work across the inner or outer loop based on which one is larger
-
-    const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-    const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
-
-    const int64_t ith0 = ith % nth0;
-    const int64_t ith1 = ith / nth0;
-
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
-    const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
-
-    const int64_t ir010 = dr0*ith0;
-    const int64_t ir011 = MIN(ir010 + dr0, nr0);
-
-    const int64_t ir110 = dr1*ith1;
-    const int64_t ir111 = MIN(ir110 + dr1, nr1);
-
-    //printf("ir010 = %6lld, ir011 = %6lld, ir110 = %6lld, ir111 = %6lld\n", ir010, ir011, ir110, ir111);
-
-    // threads with no work simply yield (not sure if it helps)
-    if (ir010 >= ir011 || ir110 >= ir111) {
-        sched_yield();
-        return;
-    }
-
     assert(ne12 % ne02 == 0);
     assert(ne13 % ne03 == 0);
 
@@ -11392,45 +11534,59 @@ static void ggml_compute_forward_mul_mat(
     const int64_t blck_0 = 16;
     const int64_t blck_1 = 16;
 
+    // distribute the thread work across the inner or outer loop based on which one is larger. it is split into
+    // chunks of one block that the threads claim as they go, so a slow thread doesn't hold up the others
+    const bool split0 = nr0 > nr1; // parallelize by src0 rows, else by src1 rows
+
+    const int64_t nchunk = split0 ? (nr0 + blck_0 - 1)/blck_0 : (nr1 + blck_1 - 1)/blck_1;
+
     // attempt to reduce false-sharing (does not seem to make a difference)
     float tmp[16];
 
-    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
-        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
-            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
-                const int64_t i13 = (ir1/(ne12*ne11));
-                const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
-                const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+    for (int64_t ichunk = ith; ichunk < nchunk; ichunk = ggml_chunk_next(params, ichunk)) {
+        const int64_t ir010 = split0 ? ichunk*blck_0 : 0;
+        const int64_t ir011 = split0 ? MIN(ir010 + blck_0, nr0) : nr0;
 
-                // broadcast src0 into src1
-                const int64_t i03 = i13/r3;
-                const int64_t i02 = i12/r2;
+        const int64_t ir110 = split0 ? 0 : ichunk*blck_1;
+        const int64_t ir111 = split0 ? nr1 : MIN(ir110 + blck_1, nr1);
+
+        for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
+            for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
+                for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
+                    const int64_t i13 = (ir1/(ne12*ne11));
+                    const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
+                    const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
 
-                const int64_t i1 = i11;
-                const int64_t i2 = i12;
-                const int64_t i3 = i13;
+                    // broadcast src0 into src1
+                    const int64_t i03 = i13/r3;
+                    const int64_t i02 = i12/r2;
 
-                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
+                    const int64_t i1 = i11;
+                    const int64_t i2 = i12;
+                    const int64_t i3 = i13;
 
-                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
-                //       the original src1 data pointer, so we should index using the indices directly
-                // TODO: this is a bit of a hack, we should probably have a better way to handle this
-                const char * src1_col = (const char *) wdata +
-                    (src1_cont || src1->type != vec_dot_type
-                     ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
-                     : (i11*nb11 + i12*nb12 + i13*nb13));
+                    const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
 
-                float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+                    // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
+                    //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+                    //       the original src1 data pointer, so we should index using the indices directly
+                    // TODO: this is a bit of a hack, we should probably have a better way to handle this
+                    const char * src1_col = (const char *) wdata +
+                        (src1_cont || src1->type != vec_dot_type
+                         ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
+                         : (i11*nb11 + i12*nb12 + i13*nb13));
 
-                //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
-                //}
+                    float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                    vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
+                    //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                    //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
+                    //}
+
+                    for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                        vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
+                    }
+                    memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
                 }
-                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
             }
         }
     }
@@ -12213,59 +12369,58 @@ static void ggml_compute_forward_soft_max_f32(
     // TODO: handle transposed/permuted matrices
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     const int nc = src0->ne[0];
     const int nr = ggml_nrows(src0);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    const int nchunk = (nr + GGML_CHUNK_ROWS - 1)/GGML_CHUNK_ROWS;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    for (int64_t ichunk = ith; ichunk < nchunk; ichunk = ggml_chunk_next(params, ichunk)) {
+        const int ir0 = ichunk*GGML_CHUNK_ROWS;
+        const int ir1 = MIN(ir0 + GGML_CHUNK_ROWS, nr);
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float *sp = (float *)((char *) src0->data + i1*src0->nb[1]);
-        float *dp = (float *)((char *)  dst->data +  i1*dst->nb[1]);
+        for (int i1 = ir0; i1 < ir1; i1++) {
+            float *sp = (float *)((char *) src0->data + i1*src0->nb[1]);
+            float *dp = (float *)((char *)  dst->data +  i1*dst->nb[1]);
 
 #ifndef NDEBUG
-        for (int i = 0; i < nc; ++i) {
-            //printf("p[%d] = %f\n", i, p[i]);
-            assert(!isnan(sp[i]));
-        }
+            for (int i = 0; i < nc; ++i) {
+                //printf("p[%d] = %f\n", i, p[i]);
+                assert(!isnan(sp[i]));
+            }
 #endif
 
-        float max = -INFINITY;
-        ggml_vec_max_f32(nc, &max, sp);
+            float max = -INFINITY;
+            ggml_vec_max_f32(nc, &max, sp);
 
-        ggml_float sum = 0.0;
+            ggml_float sum = 0.0;
 
-        uint16_t scvt;
-        for (int i = 0; i < nc; i++) {
-            if (sp[i] == -INFINITY) {
-                dp[i] = 0.0f;
-            } else {
-                // const float val = (sp[i] == -INFINITY) ? 0.0 : exp(sp[i] - max);
-                ggml_fp16_t s = GGML_FP32_TO_FP16(sp[i] - max);
-                memcpy(&scvt, &s, sizeof(scvt));
-                const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
-                sum += (ggml_float)val;
-                dp[i] = val;
+            uint16_t scvt;
+            for (int i = 0; i < nc; i++) {
+                if (sp[i] == -INFINITY) {
+                    dp[i] = 0.0f;
+                } else {
+                    // const float val = (sp[i] == -INFINITY) ? 0.0 : exp(sp[i] - max);
+                    ggml_fp16_t s = GGML_FP32_TO_FP16(sp[i] - max);
+                    memcpy(&scvt, &s, sizeof(scvt));
+                    const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+                    sum += (ggml_float)val;
+                    dp[i] = val;
+                }
             }
-        }
 
-        assert(sum > 0.0);
+            assert(sum > 0.0);
 
-        sum = 1.0/sum;
-        ggml_vec_scale_f32(nc, dp, sum);
+            sum = 1.0/sum;
+            ggml_vec_scale_f32(nc, dp, sum);
 
 #ifndef NDEBUG
-        for (int i = 0; i < nc; ++i) {
-            assert(!isnan(dp[i]));
-            assert(!isinf(dp[i]));
-        }
+            for (int i = 0; i < nc; ++i) {
+                assert(!isnan(dp[i]));
+                assert(!isinf(dp[i]));
+            }
 #endif
+        }
     }
 }
 
@@ -13658,7 +13813,7 @@ static void ggml_compute_forward_conv_2d_f16_f32(
                 for (int i0 = 0; i0 < ne0; ++i0) {
                     ggml_vec_dot_f16(ew0, dst_data + i1*ne0 + i0,
                             (ggml_fp16_t *) ((char *) src0->data + i2*nb03),
-                            (ggml_fp16_t *)                wdata + i3*nb3 + (i1*ne0 + i0)*ew0);
+                            (ggml_fp16_t *)                wdata + i3*(ne1*ne0*ew0) + (i1*ne0 + i0)*ew0);
                 }
             }
         }
@@ -14422,6 +14577,138 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
+// ggml_compute_forward_flash_attn_ext
+
+// queries that go through the keys together, and keys whose scores are computed at once. a block of keys and values
+// stays in cache while every query of a block is folded with it
+#define GGML_FLASH_ATTN_EXT_Q 32
+#define GGML_FLASH_ATTN_EXT_K 64
+
+// floats of work data of a thread: the unnormalized results, running maxima and sums of a block of queries, and the
+// scores of one query against a block of keys
+#define GGML_FLASH_ATTN_EXT_WORK(dv) (GGML_FLASH_ATTN_EXT_Q*((dv) + 2) + GGML_FLASH_ATTN_EXT_K + CACHE_LINE_SIZE_F32)
+
+static void ggml_compute_forward_flash_attn_ext_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        struct ggml_tensor * dst) {
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb);
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb);
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb);
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne);
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb);
+
+    const int64_t D  = neq0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+    const int64_t M  = nek1;
+
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == sizeof(float));
+    GGML_ASSERT(nbv0 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    GGML_ASSERT(nek0 == D && nev1 == M);
+    GGML_ASSERT(ne0 == DV && ne1 == neq2 && ne2 == N && ne3 == neq3);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+
+    float scale;
+    memcpy(&scale, dst->op_params, sizeof(float));
+
+    float * O  = (float *) params->wdata + ith*GGML_FLASH_ATTN_EXT_WORK(DV);
+    float * mx = O  + GGML_FLASH_ATTN_EXT_Q*DV;
+    float * l  = mx + GGML_FLASH_ATTN_EXT_Q;
+    float * S  = l  + GGML_FLASH_ATTN_EXT_Q;
+
+    // a chunk is a block of queries of one head of one batch
+    const int64_t nblk   = (N + GGML_FLASH_ATTN_EXT_Q - 1)/GGML_FLASH_ATTN_EXT_Q;
+    const int64_t nchunk = nblk*neq2*neq3;
+
+    for (int64_t ichunk = ith; ichunk < nchunk; ichunk = ggml_chunk_next(params, ichunk)) {
+        const int64_t i3  = ichunk/(nblk*neq2);
+        const int64_t i2  = (ichunk - i3*nblk*neq2)/nblk;
+        const int64_t iq0 = (ichunk - i3*nblk*neq2 - i2*nblk)*GGML_FLASH_ATTN_EXT_Q;
+        const int64_t iq1 = MIN(iq0 + GGML_FLASH_ATTN_EXT_Q, N);
+
+        for (int64_t j = 0; j < iq1 - iq0; ++j) {
+            mx[j] = -INFINITY;
+            l[j]  = 0.0f;
+        }
+        memset(O, 0, (iq1 - iq0)*DV*sizeof(float));
+
+        for (int64_t ik0 = 0; ik0 < M; ik0 += GGML_FLASH_ATTN_EXT_K) {
+            const int64_t ik1 = MIN(ik0 + GGML_FLASH_ATTN_EXT_K, M);
+
+            for (int64_t iq = iq0; iq < iq1; ++iq) {
+                const int64_t j = iq - iq0;
+                const float * qr = (const float *) ((const char *) q->data + iq*nbq1 + i2*nbq2 + i3*nbq3);
+
+                float smax = -INFINITY;
+                for (int64_t ik = ik0; ik < ik1; ++ik) {
+                    const float * kr = (const float *) ((const char *) k->data + ik*nbk1 + i2*nbk2 + i3*nbk3);
+                    ggml_vec_dot_f32(D, S + (ik - ik0), kr, qr);
+                    S[ik - ik0] *= scale;
+                    smax = MAX(smax, S[ik - ik0]);
+                }
+
+                // rescale what the earlier blocks of keys added up to the new maximum
+                const float m = MAX(mx[j], smax);
+                float * o = O + j*DV;
+                if (mx[j] != m) {
+                    const float alpha = expf(mx[j] - m);
+                    ggml_vec_scale_f32(DV, o, alpha);
+                    l[j] *= alpha;
+                    mx[j] = m;
+                }
+
+                ggml_float sum = 0.0;
+                for (int64_t ik = ik0; ik < ik1; ++ik) {
+                    const float p = expf(S[ik - ik0] - m);
+                    const float * vr = (const float *) ((const char *) v->data + ik*nbv1 + i2*nbv2 + i3*nbv3);
+                    ggml_vec_mad_f32(DV, o, vr, p);
+                    sum += (ggml_float) p;
+                }
+                l[j] += (float) sum;
+            }
+        }
+
+        for (int64_t iq = iq0; iq < iq1; ++iq) {
+            const int64_t j = iq - iq0;
+            float * y = (float *) ((char *) dst->data + i2*nb1 + iq*nb2 + i3*nb3);
+            memcpy(y, O + j*DV, DV*sizeof(float));
+            ggml_vec_scale_f32(DV, y, 1.0f/l[j]);
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        struct ggml_tensor * dst) {
+    switch (q->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_flash_attn_ext_f32(params, q, k, v, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_flash_ff
 
 static void ggml_compute_forward_flash_ff_f16(
@@ -15911,6 +16198,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src[0], tensor->src[1], tensor->src[2], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor->src[4], tensor);
@@ -16757,6 +17048,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             inplace);
                 }
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -17181,20 +17473,59 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(threa
 static void clear_numa_thread_affinity(void) {}
 #endif
 
-struct ggml_compute_state_shared {
-    const struct ggml_cgraph * cgraph;
-    const struct ggml_cplan  * cplan;
+// pinning the calling thread to a single cpu. unlike pthread_setaffinity_np(), sched_setaffinity() is also available
+// on Android, and with pid 0 it applies to the calling thread only
+#if defined(__linux__)
+#include <sched.h>
 
-    int64_t perf_node_start_cycles;
-    int64_t perf_node_start_time_us;
+typedef cpu_set_t ggml_cpu_set_t;
 
-    const int n_threads;
+// false when the cpu can't be used, with errno set
+static bool ggml_thread_pin(int cpu, ggml_cpu_set_t * prev) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return false;
+    }
 
-    // synchronization primitives
-    atomic_int n_active; // num active threads
-    atomic_int node_n;   // active graph node
+    if (prev && sched_getaffinity(0, sizeof(*prev), prev) != 0) {
+        CPU_ZERO(prev);
+    }
 
-    bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+static void ggml_thread_unpin(const ggml_cpu_set_t * prev) {
+    if (CPU_COUNT(prev) > 0) {
+        sched_setaffinity(0, sizeof(*prev), prev);
+    }
+}
+#else
+// TODO: Windows etc.
+typedef int ggml_cpu_set_t;
+
+static bool ggml_thread_pin(int cpu, ggml_cpu_set_t * prev) { UNUSED(cpu); UNUSED(prev); return true; }
+static void ggml_thread_unpin(const ggml_cpu_set_t * prev) { UNUSED(prev); }
+#endif
+
+struct ggml_compute_state_shared {
+    const struct ggml_cgraph * cgraph;
+    const struct ggml_cplan  * cplan;
+
+    int64_t perf_node_start_cycles;
+    int64_t perf_node_start_time_us;
+
+    const int n_threads;
+
+    // synchronization primitives
+    atomic_int n_active; // num active threads
+    atomic_int node_n;   // active graph node
+    atomic_int n_chunk[GGML_MAX_CONCURRENCY]; // next chunk of every active node to be claimed, see ggml_chunk_next()
+
+    bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
     void * abort_callback_data;
 };
 
@@ -17202,8 +17533,176 @@ struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * threadpool; // the pool the thread belongs to, NULL if it only lives for one graph
 };
 
+// worker threads that outlive a graph. between graphs they spin for a while, so that back to back graphs don't pay
+// for waking them up, then sleep until the next graph is posted
+struct ggml_threadpool {
+    int n_threads;
+    struct ggml_compute_state * workers; // workers[0] is unused, the thread calling ggml_graph_compute() is thread 0
+    int * cpus;                          // cpu of every thread, NULL to leave them to the OS
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    struct ggml_compute_state_shared * shared; // the graph being computed
+    atomic_int n_graph;                        // number of graphs posted so far
+    atomic_int n_busy;                         // workers that haven't finished with the current graph yet
+    atomic_int stop;
+    atomic_int n_pin_failed;                   // threads that couldn't be pinned, the pool stops pinning after one
+};
+
+#define GGML_THREADPOOL_SPIN_US 200
+
+static int64_t ggml_chunk_next(const struct ggml_compute_params * params, int64_t ichunk) {
+    if (params->shared == NULL) {
+        return ichunk + params->nth;
+    }
+
+    return atomic_fetch_add(&params->shared->n_chunk[params->slot], 1);
+}
+
+static int ggml_node_plan(struct ggml_tensor * node, int n_threads, size_t * node_work_size);
+
+// pin thread ith of a pool to its cpu. a cpu that can't be used, e.g. one that went offline, is reported once, and
+// from then on the threads of the pool are left to the OS
+static bool ggml_threadpool_pin(struct ggml_threadpool * threadpool, int ith, ggml_cpu_set_t * prev) {
+    if (!threadpool->cpus || atomic_load(&threadpool->n_pin_failed) > 0) {
+        return false;
+    }
+
+    if (ggml_thread_pin(threadpool->cpus[ith], prev)) {
+        return true;
+    }
+
+    if (atomic_fetch_add(&threadpool->n_pin_failed, 1) == 0) {
+        fprintf(stderr, "warning: pinning a thread to cpu %d failed: %s, not pinning the threads of this pool\n",
+                threadpool->cpus[ith], strerror(errno));
+    }
+
+    return false;
+}
+
+// number of nodes computed side by side from node i on. that is the rest of the step of node i, up to one node per
+// thread, if the plan hands out every thread to exactly one of them, else node i is computed on its own
+static int ggml_graph_step_len(const struct ggml_cgraph * cgraph, const int * n_tasks, const int * steps, int n_threads, int i) {
+    if (steps == NULL || steps[i] <= 1) {
+        return 1;
+    }
+
+    const int n_step = MIN(MIN(steps[i], cgraph->n_nodes - i), MIN(n_threads, GGML_MAX_CONCURRENCY));
+
+    int n_sum = 0;
+    for (int m = 0; m < n_step; ++m) {
+        if (n_tasks[i + m] < 1) {
+            return 1;
+        }
+        n_sum += n_tasks[i + m];
+    }
+
+    return n_sum == n_threads ? n_step : 1;
+}
+
+// threads and work data of the member in slot of the step of n_step nodes at node_n, as planned
+static void ggml_graph_step_params(const struct ggml_cplan * cplan, int node_n, int n_step, int slot,
+        struct ggml_compute_params * params) {
+    params->nth   = cplan->n_tasks[node_n + slot];
+    params->slot  = slot;
+    params->wsize = cplan->work_size;
+    params->wdata = cplan->work_data;
+
+    if (n_step > 1) {
+        const struct ggml_step_member * member = &cplan->members[node_n + slot];
+        params->wsize = member->work_size;
+        params->wdata = member->work_size > 0 ? (char *) cplan->work_data + member->work_offs : NULL;
+    }
+}
+
+// nodes computed from node i on before the next barrier: the rest of a chain, a step computed side by side, or node i
+// alone
+static int ggml_graph_run_len(const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan, int n_threads, int i, bool * fused) {
+    if (cplan->chains && cplan->chains[i] > 1) {
+        *fused = true;
+        return MIN(cplan->chains[i], cgraph->n_nodes - i);
+    }
+
+    *fused = false;
+    return ggml_graph_step_len(cgraph, cplan->n_tasks, cplan->steps, n_threads, i);
+}
+
+// threads and work data of node m of the run of n_run nodes at node_n. the nodes of a chain all use every thread of
+// the chain one after the other
+static void ggml_graph_run_params(const struct ggml_cplan * cplan, int node_n, int n_run, bool fused, int m,
+        struct ggml_compute_params * params) {
+    if (fused) {
+        ggml_graph_step_params(cplan, node_n + m, 1, 0, params);
+    } else {
+        ggml_graph_step_params(cplan, node_n, n_run, m, params);
+    }
+}
+
+// bytes of every tensor of a chain covered by a block of rows. the blocks of the inputs and results of a chain stay
+// in cache while the block goes through all of its nodes
+#define GGML_CHAIN_BLOCK_SIZE (16*1024)
+
+// rows [ir0, ir1) of a contiguous tensor, as a tensor of their own
+static void ggml_chain_rows(struct ggml_tensor * rows, const struct ggml_tensor * t, int64_t ir0, int64_t ir1) {
+    *rows = *t;
+    rows->ne[1] = ir1 - ir0;
+    rows->ne[2] = 1;
+    rows->ne[3] = 1;
+    rows->nb[2] = rows->nb[1]*rows->ne[1];
+    rows->nb[3] = rows->nb[2];
+    rows->data  = (char *) t->data + ir0*t->nb[1];
+}
+
+// the threads of a chain claim blocks of rows from each other and take every block through all nodes of the chain,
+// each node on the rows of the block of its inputs of the same shape and on the whole of its broadcast inputs
+static void ggml_compute_forward_chain(const struct ggml_compute_params * params, struct ggml_tensor * const * nodes,
+        int n_chain) {
+    const int64_t nr = ggml_nrows(nodes[0]);
+
+    // a few blocks per thread at least, so that the faster threads can take over from the others
+    int64_t dr = MAX(1, (int64_t) (GGML_CHAIN_BLOCK_SIZE/nodes[0]->nb[1]));
+    dr = MIN(dr, MAX(1, nr/(4*params->nth)));
+
+    const int64_t nblock = (nr + dr - 1)/dr;
+
+    // a node is computed on a block by this thread alone
+    struct ggml_compute_params block_params = {
+        /*.type   =*/ GGML_TASK_COMPUTE,
+        /*.ith    =*/ 0,
+        /*.nth    =*/ 1,
+        /*.wsize  =*/ 0,
+        /*.wdata  =*/ NULL,
+        /*.shared =*/ NULL,
+        /*.slot   =*/ 0,
+    };
+
+    struct ggml_tensor dst;
+    struct ggml_tensor src[GGML_MAX_SRC];
+
+    for (int64_t ib = params->ith; ib < nblock; ib = ggml_chunk_next(params, ib)) {
+        const int64_t ir0 = ib*dr;
+        const int64_t ir1 = MIN(ir0 + dr, nr);
+
+        for (int m = 0; m < n_chain; ++m) {
+            const struct ggml_tensor * node = nodes[m];
+
+            ggml_chain_rows(&dst, node, ir0, ir1);
+            for (int j = 0; j < GGML_MAX_SRC && node->src[j]; ++j) {
+                if (ggml_are_same_shape(node->src[j], node)) {
+                    ggml_chain_rows(&src[j], node->src[j], ir0, ir1);
+                    dst.src[j] = &src[j];
+                }
+            }
+
+            ggml_compute_forward(&block_params, &dst);
+        }
+    }
+}
+
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
     int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
     int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
@@ -17222,9 +17721,15 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     const int * n_tasks_arr = cplan->n_tasks;
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith, n_threads);
+    // threads of a pinned pool stay on their cpus, which the owner of the pool picked
+    const bool pinned = state->threadpool && state->threadpool->cpus;
+    if (!pinned) {
+        set_numa_thread_affinity(state->ith, n_threads);
+    }
 
-    int node_n = -1;
+    int  node_n = -1;
+    int  n_step = 1;     // nodes computed from node_n on before the next barrier
+    bool fused  = false; // whether they are a chain, or else a step computed side by side
 
     while (true) {
         if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
@@ -17235,53 +17740,71 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             // all other threads are finished and spinning
             // do finalize and init here so we don't have synchronize again
             struct ggml_compute_params params = {
-                /*.type  =*/ GGML_TASK_FINALIZE,
-                /*.ith   =*/ 0,
-                /*.nth   =*/ 0,
-                /*.wsize =*/ cplan->work_size,
-                /*.wdata =*/ cplan->work_data,
+                /*.type   =*/ GGML_TASK_FINALIZE,
+                /*.ith    =*/ 0,
+                /*.nth    =*/ 0,
+                /*.wsize  =*/ cplan->work_size,
+                /*.wdata  =*/ cplan->work_data,
+                /*.shared =*/ state->shared,
+                /*.slot   =*/ 0,
             };
 
             if (node_n != -1) {
                 /* FINALIZE */
-                struct ggml_tensor * node = state->shared->cgraph->nodes[node_n];
-                if (GGML_OP_HAS_FINALIZE[node->op]) {
-                    params.nth = n_tasks_arr[node_n];
-                    ggml_compute_forward(&params, node);
+                for (int m = 0; m < n_step; ++m) {
+                    struct ggml_tensor * node = state->shared->cgraph->nodes[node_n + m];
+                    if (GGML_OP_HAS_FINALIZE[node->op]) {
+                        params.type = GGML_TASK_FINALIZE;
+                        ggml_graph_run_params(cplan, node_n, n_step, fused, m, &params);
+                        ggml_compute_forward(&params, node);
+                    }
+                    ggml_graph_compute_perf_stats_node(node, state->shared);
                 }
-                ggml_graph_compute_perf_stats_node(node, state->shared);
             }
 
             // distribute new work or execute it direct if 1T
-            while (++node_n < cgraph->n_nodes) {
+            while ((node_n += n_step) < cgraph->n_nodes) {
                 GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
 
-                struct ggml_tensor * node = cgraph->nodes[node_n];
-                const int n_tasks = n_tasks_arr[node_n];
+                n_step = ggml_graph_run_len(cgraph, cplan, n_threads, node_n, &fused);
 
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
                 state->shared->perf_node_start_time_us = ggml_perf_time_us();
 
-                params.nth = n_tasks;
+                for (int m = 0; m < n_step; ++m) {
+                    struct ggml_tensor * node = cgraph->nodes[node_n + m];
+
+                    ggml_graph_run_params(cplan, node_n, n_step, fused, m, &params);
 
-                /* INIT */
-                if (GGML_OP_HAS_INIT[node->op]) {
-                    params.type = GGML_TASK_INIT;
-                    ggml_compute_forward(&params, node);
+                    // every thread starts on the chunk of its own index
+                    atomic_store(&state->shared->n_chunk[params.slot], params.nth);
+
+                    /* INIT */
+                    if (GGML_OP_HAS_INIT[node->op]) {
+                        params.type = GGML_TASK_INIT;
+                        ggml_compute_forward(&params, node);
+                    }
                 }
 
-                if (n_tasks == 1) {
+                if ((n_step == 1 || fused) && n_tasks_arr[node_n] == 1) {
                     // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
                     // they do something more efficient than spinning (?)
                     params.type = GGML_TASK_COMPUTE;
-                    ggml_compute_forward(&params, node);
-
-                    if (GGML_OP_HAS_FINALIZE[node->op]) {
-                        params.type = GGML_TASK_FINALIZE;
-                        ggml_compute_forward(&params, node);
+                    if (fused) {
+                        ggml_compute_forward_chain(&params, cgraph->nodes + node_n, n_step);
+                    } else {
+                        ggml_compute_forward(&params, cgraph->nodes[node_n]);
                     }
 
-                    ggml_graph_compute_perf_stats_node(node, state->shared);
+                    for (int m = 0; m < n_step; ++m) {
+                        struct ggml_tensor * node = cgraph->nodes[node_n + m];
+                        if (GGML_OP_HAS_FINALIZE[node->op]) {
+                            params.type = GGML_TASK_FINALIZE;
+                            ggml_graph_run_params(cplan, node_n, n_step, fused, m, &params);
+                            ggml_compute_forward(&params, node);
+                        }
+                        ggml_graph_compute_perf_stats_node(node, state->shared);
+                    }
                 } else {
                     break;
                 }
@@ -17313,419 +17836,785 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         // check if we should stop
         if (node_n >= cgraph->n_nodes) break;
 
+        n_step = ggml_graph_run_len(cgraph, cplan, n_threads, node_n, &fused);
+
         /* COMPUTE */
-        struct ggml_tensor * node = cgraph->nodes[node_n];
-        const int n_tasks = n_tasks_arr[node_n];
-
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_COMPUTE,
-            /*.ith   =*/ state->ith,
-            /*.nth   =*/ n_tasks,
-            /*.wsize =*/ cplan->work_size,
-            /*.wdata =*/ cplan->work_data,
-        };
+        if (fused) {
+            if (state->ith < n_tasks_arr[node_n]) {
+                struct ggml_compute_params params = {
+                    /*.type   =*/ GGML_TASK_COMPUTE,
+                    /*.ith    =*/ state->ith,
+                    /*.nth    =*/ 0,
+                    /*.wsize  =*/ 0,
+                    /*.wdata  =*/ NULL,
+                    /*.shared =*/ state->shared,
+                    /*.slot   =*/ 0,
+                };
+
+                ggml_graph_run_params(cplan, node_n, n_step, fused, 0, &params);
+                ggml_compute_forward_chain(&params, cgraph->nodes + node_n, n_step);
+            }
+            continue;
+        }
+
+        // the threads are handed out to the members of the step in order
+        int slot = 0;
+        while (slot < n_step - 1 && state->ith >= cplan->members[node_n + slot + 1].ith) {
+            slot++;
+        }
+        const int ith = n_step > 1 ? state->ith - cplan->members[node_n + slot].ith : state->ith;
+
+        if (ith < n_tasks_arr[node_n + slot]) {
+            struct ggml_compute_params params = {
+                /*.type   =*/ GGML_TASK_COMPUTE,
+                /*.ith    =*/ ith,
+                /*.nth    =*/ 0,
+                /*.wsize  =*/ 0,
+                /*.wdata  =*/ NULL,
+                /*.shared =*/ state->shared,
+                /*.slot   =*/ 0,
+            };
 
-        if (state->ith < n_tasks) {
-            ggml_compute_forward(&params, node);
+            ggml_graph_step_params(cplan, node_n, n_step, slot, &params);
+            ggml_compute_forward(&params, cgraph->nodes[node_n + slot]);
         }
     }
 
     return GGML_EXIT_SUCCESS;
 }
 
-struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
-    if (n_threads <= 0) {
-        n_threads = GGML_DEFAULT_N_THREADS;
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * threadpool = state->threadpool;
+
+    ggml_threadpool_pin(threadpool, state->ith, NULL);
+
+    int n_seen = 0;
+
+    while (true) {
+        int n_graph = atomic_load(&threadpool->n_graph);
+
+        // spin-then-sleep until the next graph is posted
+        if (n_graph == n_seen) {
+            const int64_t t_start_us = ggml_time_us();
+            while (n_graph == n_seen && !atomic_load(&threadpool->stop) &&
+                   ggml_time_us() - t_start_us < GGML_THREADPOOL_SPIN_US) {
+                ggml_lock_lock(NULL);
+                n_graph = atomic_load(&threadpool->n_graph);
+            }
+        }
+        if (n_graph == n_seen) {
+            pthread_mutex_lock(&threadpool->mutex);
+            while ((n_graph = atomic_load(&threadpool->n_graph)) == n_seen && !atomic_load(&threadpool->stop)) {
+                pthread_cond_wait(&threadpool->cond, &threadpool->mutex);
+            }
+            pthread_mutex_unlock(&threadpool->mutex);
+        }
+
+        if (atomic_load(&threadpool->stop)) {
+            break;
+        }
+        n_seen = n_graph;
+
+        // graphs with fewer threads than the pool leave the last workers idle
+        state->shared = threadpool->shared;
+        if (state->ith < state->shared->n_threads) {
+            ggml_graph_compute_thread(state);
+        }
+        atomic_fetch_sub(&threadpool->n_busy, 1);
     }
 
-    size_t work_size = 0;
+    return 0;
+}
 
-    struct ggml_cplan cplan;
-    memset(&cplan, 0, sizeof(struct ggml_cplan));
+struct ggml_threadpool * ggml_threadpool_new(int n_threads, const int * cpus) {
+    GGML_ASSERT(n_threads > 0);
 
-    // thread scheduling for the different operations + work buffer size estimation
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        int n_tasks = 1;
+    struct ggml_threadpool * threadpool = malloc(sizeof(struct ggml_threadpool));
+    threadpool->n_threads = n_threads;
+    threadpool->workers   = malloc(sizeof(struct ggml_compute_state)*n_threads);
+    threadpool->cpus      = NULL;
+    threadpool->shared    = NULL;
+    atomic_store(&threadpool->n_graph, 0);
+    atomic_store(&threadpool->n_busy,  0);
+    atomic_store(&threadpool->stop,    0);
+    atomic_store(&threadpool->n_pin_failed, 0);
 
-        struct ggml_tensor * node = cgraph->nodes[i];
+    if (cpus) {
+        threadpool->cpus = malloc(sizeof(int)*n_threads);
+        memcpy(threadpool->cpus, cpus, sizeof(int)*n_threads);
+    }
 
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    n_tasks = n_threads;
+    pthread_mutex_init(&threadpool->mutex, NULL);
+    pthread_cond_init(&threadpool->cond, NULL);
 
-                    size_t cur = 0;
-                    if (ggml_is_quantized(node->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
+    for (int j = 1; j < n_threads; ++j) {
+        threadpool->workers[j] = (struct ggml_compute_state) {
+            .thrd       = 0,
+            .ith        = j,
+            .shared     = NULL,
+            .threadpool = threadpool,
+        };
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    n_tasks = n_threads;
+        const int rc = ggml_thread_create(&threadpool->workers[j].thrd, NULL, ggml_threadpool_thread, &threadpool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
 
-                    size_t cur = 0;
+    return threadpool;
+}
 
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
+void ggml_threadpool_free(struct ggml_threadpool * threadpool) {
+    if (threadpool == NULL) {
+        return;
+    }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_ACC:
-                {
-                    n_tasks = n_threads;
+    pthread_mutex_lock(&threadpool->mutex);
+    atomic_store(&threadpool->stop, 1);
+    pthread_cond_broadcast(&threadpool->cond);
+    pthread_mutex_unlock(&threadpool->mutex);
 
-                    size_t cur = 0;
+    for (int j = 1; j < threadpool->n_threads; ++j) {
+        const int rc = ggml_thread_join(threadpool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
 
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
+    pthread_cond_destroy(&threadpool->cond);
+    pthread_mutex_destroy(&threadpool->mutex);
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_SUB:
-            case GGML_OP_DIV:
-            case GGML_OP_SQR:
-            case GGML_OP_SQRT:
-            case GGML_OP_LOG:
-            case GGML_OP_SUM:
-            case GGML_OP_SUM_ROWS:
-            case GGML_OP_MEAN:
-            case GGML_OP_ARGMAX:
-            case GGML_OP_REPEAT:
-            case GGML_OP_REPEAT_BACK:
-            {
-                    n_tasks = 1;
-                } break;
+    free(threadpool->cpus);
+    free(threadpool->workers);
+    free(threadpool);
+}
 
-            case GGML_OP_UNARY:
-                {
-                    switch (ggml_get_unary_op(node)) {
-                        case GGML_UNARY_OP_ABS:
-                        case GGML_UNARY_OP_SGN:
-                        case GGML_UNARY_OP_NEG:
-                        case GGML_UNARY_OP_STEP:
-                        case GGML_UNARY_OP_TANH:
-                        case GGML_UNARY_OP_ELU:
-                        case GGML_UNARY_OP_RELU:
-                            {
-                                n_tasks = 1;
-                            } break;
+int ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool) {
+    return threadpool->n_threads;
+}
 
-                        case GGML_UNARY_OP_GELU:
-                        case GGML_UNARY_OP_GELU_QUICK:
-                        case GGML_UNARY_OP_SILU:
-                            {
-                                n_tasks = n_threads;
-                            } break;
-                    }
-                } break;
-            case GGML_OP_SILU_BACK:
-            case GGML_OP_MUL:
-            case GGML_OP_NORM:
-            case GGML_OP_RMS_NORM:
-            case GGML_OP_RMS_NORM_BACK:
-            case GGML_OP_GROUP_NORM:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_CONCAT:
-            case GGML_OP_MUL_MAT:
-            case GGML_OP_OUT_PROD:
-                {
-                    n_tasks = n_threads;
+// Thread cost model of ggml_graph_plan(). A node split across threads costs a barrier, which every thread of the
+// graph takes part in no matter how many of them the node uses, so a node either runs on all of its threads or, when
+// splitting saves less time than the barrier costs, on the thread that dispatches it without any barrier at all.
+
+static const struct ggml_cost_params g_cost_params_default = {
+    /*.flops_per_ns =*/ 10.0f,
+    /*.bytes_per_ns =*/ 10.0f,
+    /*.sync_ns      =*/ 2000.0f,
+};
+
+// written by ggml_set_cost_params() while other threads may be planning graphs, so it is only accessed in the
+// critical section, and a plan works with a copy taken once
+static struct ggml_cost_params g_cost_params = {
+    /*.flops_per_ns =*/ 10.0f,
+    /*.bytes_per_ns =*/ 10.0f,
+    /*.sync_ns      =*/ 2000.0f,
+};
+
+struct ggml_cost_params ggml_get_cost_params(void) {
+    ggml_critical_section_start();
+    const struct ggml_cost_params params = g_cost_params;
+    ggml_critical_section_end();
+
+    return params;
+}
+
+void ggml_set_cost_params(struct ggml_cost_params params) {
+    ggml_critical_section_start();
+    g_cost_params = params;
+    ggml_critical_section_end();
+}
+
+// estimated time of a node on a single thread
+static double ggml_node_cost_ns(const struct ggml_tensor * node, const struct ggml_cost_params * cost) {
+    double bytes = (double) ggml_nbytes(node);
+    for (int i = 0; i < GGML_MAX_SRC && node->src[i]; ++i) {
+        bytes += (double) ggml_nbytes(node->src[i]);
+    }
+
+    double flops = (double) ggml_nelements(node);
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_OUT_PROD:
+            {
+                flops *= 2.0*node->src[0]->ne[0];
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                // a dot product with every key and a multiply-add of every value
+                flops *= 4.0*node->src[1]->ne[1];
+            } break;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_GROUP_NORM:
+        case GGML_OP_UNARY:
+            {
+                flops *= 8.0;
+            } break;
+        default:
+            break;
+    }
+
+    return flops/(double) cost->flops_per_ns + bytes/(double) cost->bytes_per_ns;
+}
+
+// n_tasks of a node that could be split into up to n_tasks tasks
+static int ggml_node_n_tasks(const struct ggml_tensor * node, int n_tasks, const struct ggml_cost_params * cost) {
+    if (n_tasks <= 1) {
+        return n_tasks;
+    }
+
+    const double cost_ns = ggml_node_cost_ns(node, cost);
+
+    return cost_ns*(1.0 - 1.0/n_tasks) < (double) cost->sync_ns ? 1 : n_tasks;
+}
+
+// n_tasks of a node computed on its own by n_threads threads, before the cost model has its say, and the size of the
+// work data it needs
+static int ggml_node_plan(struct ggml_tensor * node, int n_threads, size_t * node_work_size) {
+    int n_tasks = 1;
+
+    size_t work_size = 0;
+
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+                if (ggml_is_quantized(node->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
 
-                    // TODO: use different scheduling for different matrix sizes
-                    //const int nr0 = ggml_nrows(node->src[0]);
-                    //const int nr1 = ggml_nrows(node->src[1]);
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_ACC:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_SUB:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_SUM:
+        case GGML_OP_SUM_ROWS:
+        case GGML_OP_MEAN:
+        case GGML_OP_ARGMAX:
+        case GGML_OP_REPEAT:
+        case GGML_OP_REPEAT_BACK:
+        {
+                n_tasks = 1;
+            } break;
+
+        case GGML_OP_UNARY:
+            {
+                switch (ggml_get_unary_op(node)) {
+                    case GGML_UNARY_OP_ABS:
+                    case GGML_UNARY_OP_SGN:
+                    case GGML_UNARY_OP_NEG:
+                    case GGML_UNARY_OP_STEP:
+                    case GGML_UNARY_OP_TANH:
+                    case GGML_UNARY_OP_ELU:
+                    case GGML_UNARY_OP_RELU:
+                        {
+                            n_tasks = 1;
+                        } break;
 
-                    //n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks%d\n", nr0, nr1, nr0*nr1, n_tasks);
+                    case GGML_UNARY_OP_GELU:
+                    case GGML_UNARY_OP_GELU_QUICK:
+                    case GGML_UNARY_OP_SILU:
+                        {
+                            n_tasks = n_threads;
+                        } break;
+                }
+            } break;
+        case GGML_OP_SILU_BACK:
+        case GGML_OP_MUL:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_RMS_NORM_BACK:
+        case GGML_OP_GROUP_NORM:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_CONCAT:
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_OUT_PROD:
+            {
+                n_tasks = n_threads;
 
-                    size_t cur = 0;
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+                // TODO: use different scheduling for different matrix sizes
+                //const int nr0 = ggml_nrows(node->src[0]);
+                //const int nr1 = ggml_nrows(node->src[1]);
+
+                //n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks%d\n", nr0, nr1, nr0*nr1, n_tasks);
+
+                size_t cur = 0;
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
 
 #if defined(GGML_USE_CUBLAS)
-                    if (ggml_cuda_can_mul_mat(node->src[0], node->src[1], node)) {
-                        n_tasks = 1; // TODO: this actually is doing nothing
-                                     //       the threads are still spinning
-                    } else
+                if (ggml_cuda_can_mul_mat(node->src[0], node->src[1], node)) {
+                    n_tasks = 1; // TODO: this actually is doing nothing
+                                 //       the threads are still spinning
+                } else
 #elif defined(GGML_USE_CLBLAST)
-                    if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
-                        n_tasks = 1; // TODO: this actually is doing nothing
-                                     //       the threads are still spinning
-                        cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
-                    } else
+                if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
+                    n_tasks = 1; // TODO: this actually is doing nothing
+                                 //       the threads are still spinning
+                    cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
+                } else
 #endif
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                    if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
-                        n_tasks = 1; // TODO: this actually is doing nothing
-                                     //       the threads are still spinning
-                        if (node->src[0]->type != GGML_TYPE_F32) {
-                            // here we need memory just for single 2D matrix from src0
-                            cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
-                        }
-                    } else
-#endif
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_type_size(vec_dot_type)*ggml_nelements(node->src[1])/ggml_blck_size(vec_dot_type);
-                    } else {
-                        cur = 0;
+                if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
+                    n_tasks = 1; // TODO: this actually is doing nothing
+                                 //       the threads are still spinning
+                    if (node->src[0]->type != GGML_TYPE_F32) {
+                        // here we need memory just for single 2D matrix from src0
+                        cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
                     }
+                } else
+#endif
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_type_size(vec_dot_type)*ggml_nelements(node->src[1])/ggml_blck_size(vec_dot_type);
+                } else {
+                    cur = 0;
+                }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_SCALE:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_SET:
-            case GGML_OP_CONT:
-            case GGML_OP_RESHAPE:
-            case GGML_OP_VIEW:
-            case GGML_OP_PERMUTE:
-            case GGML_OP_TRANSPOSE:
-            case GGML_OP_GET_ROWS:
-            case GGML_OP_GET_ROWS_BACK:
-            case GGML_OP_DIAG:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_DIAG_MASK_ZERO:
-            case GGML_OP_DIAG_MASK_INF:
-            case GGML_OP_SOFT_MAX:
-            case GGML_OP_SOFT_MAX_BACK:
-            case GGML_OP_ROPE:
-            case GGML_OP_ROPE_BACK:
-            case GGML_OP_ADD_REL_POS:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_ALIBI:
-                {
-                    n_tasks = 1; //TODO
-                } break;
-            case GGML_OP_CLAMP:
-                {
-                    n_tasks = 1; //TODO
-                } break;
-            case GGML_OP_CONV_1D:
-                {
-                    n_tasks = n_threads;
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_SCALE:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_SET:
+        case GGML_OP_CONT:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_GET_ROWS_BACK:
+        case GGML_OP_DIAG:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_DIAG_MASK_ZERO:
+        case GGML_OP_DIAG_MASK_INF:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_SOFT_MAX_BACK:
+        case GGML_OP_ROPE:
+        case GGML_OP_ROPE_BACK:
+        case GGML_OP_ADD_REL_POS:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_ALIBI:
+            {
+                n_tasks = 1; //TODO
+            } break;
+        case GGML_OP_CLAMP:
+            {
+                n_tasks = 1; //TODO
+            } break;
+        case GGML_OP_CONV_1D:
+            {
+                n_tasks = n_threads;
 
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    size_t cur = 0;
-                    const int nk = node->src[0]->ne[0];
-
-                    if (node->src[0]->type == GGML_TYPE_F16 &&
-                            node->src[1]->type == GGML_TYPE_F32) {
-                        cur = sizeof(ggml_fp16_t)*(
-                                nk*ggml_up32(node->src[0]->ne[1])*node->src[0]->ne[2] +
-                                ( 2*(nk/2) + node->src[1]->ne[0])*node->src[1]->ne[1]
-                                );
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                            node->src[1]->type == GGML_TYPE_F32) {
-                        cur = sizeof(float)*(
-                                nk*ggml_up32(node->src[0]->ne[1])*node->src[0]->ne[2] +
-                                ( 2*(nk/2) + node->src[1]->ne[0])*node->src[1]->ne[1]
-                                );
-                    } else {
-                        GGML_ASSERT(false);
-                    }
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_CONV_2D:
-                {
-                    n_tasks = n_threads;
+                size_t cur = 0;
+                const int nk = node->src[0]->ne[0];
+
+                if (node->src[0]->type == GGML_TYPE_F16 &&
+                        node->src[1]->type == GGML_TYPE_F32) {
+                    cur = sizeof(ggml_fp16_t)*(
+                            nk*ggml_up32(node->src[0]->ne[1])*node->src[0]->ne[2] +
+                            ( 2*(nk/2) + node->src[1]->ne[0])*node->src[1]->ne[1]
+                            );
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                        node->src[1]->type == GGML_TYPE_F32) {
+                    cur = sizeof(float)*(
+                            nk*ggml_up32(node->src[0]->ne[1])*node->src[0]->ne[2] +
+                            ( 2*(nk/2) + node->src[1]->ne[0])*node->src[1]->ne[1]
+                            );
+                } else {
+                    GGML_ASSERT(false);
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_CONV_2D:
+            {
+                n_tasks = n_threads;
+
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // C
+                const int64_t ne03 = node->src[0]->ne[3]; // N
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // C
+                const int64_t ne13 = node->src[1]->ne[3]; // N
+
+                const int64_t ne0 = node->ne[0];
+                const int64_t ne1 = node->ne[1];
+                const int64_t ne2 = node->ne[2];
+                const int64_t nk = ne00*ne01;
+                const int64_t ew0 = nk * ne02;
+
+                UNUSED(ne03);
+                UNUSED(ne2);
+
+                size_t cur = 0;
+
+                if (node->src[0]->type == GGML_TYPE_F16 &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur = sizeof(ggml_fp16_t)*(ne0*ne1*ew0*ne13);
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur = sizeof(float)*      (ne10*ne11*ne12);
+                } else {
+                    GGML_ASSERT(false);
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                n_tasks = n_threads;
+
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
 
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // C
-                    const int64_t ne03 = node->src[0]->ne[3]; // N
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
 
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // C
+                size_t cur = 0;
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
 
-                    const int64_t ne0 = node->ne[0];
-                    const int64_t ne1 = node->ne[1];
-                    const int64_t ne2 = node->ne[2];
-                    const int64_t nk = ne00*ne01;
-                    const int64_t ew0 = nk * ne02;
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_POOL_1D:
+        case GGML_OP_POOL_2D:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_UPSCALE:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_FLASH_ATTN:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
+
+                if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                n_tasks = n_threads;
+
+                const size_t cur = sizeof(float)*GGML_FLASH_ATTN_EXT_WORK(node->src[2]->ne[0])*n_tasks;
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_FLASH_FF:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                }
+
+                if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+
+                if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_WIN_PART:
+        case GGML_OP_WIN_UNPART:
+        case GGML_OP_GET_REL_POS:
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_MAP_CUSTOM1:
+            {
+                struct ggml_map_custom1_op_params * p = (struct ggml_map_custom1_op_params *) node->op_params;
+                if (p->n_tasks == GGML_N_TASKS_MAX) {
+                    n_tasks = n_threads;
+                } else {
+                    n_tasks = MIN(p->n_tasks, n_threads);
+                }
+            } break;
+        case GGML_OP_MAP_CUSTOM2:
+            {
+                struct ggml_map_custom2_op_params * p = (struct ggml_map_custom2_op_params *) node->op_params;
+                if (p->n_tasks == GGML_N_TASKS_MAX) {
+                    n_tasks = n_threads;
+                } else {
+                    n_tasks = MIN(p->n_tasks, n_threads);
+                }
+            } break;
+        case GGML_OP_MAP_CUSTOM3:
+            {
+                struct ggml_map_custom3_op_params * p = (struct ggml_map_custom3_op_params *) node->op_params;
+                if (p->n_tasks == GGML_N_TASKS_MAX) {
+                    n_tasks = n_threads;
+                } else {
+                    n_tasks = MIN(p->n_tasks, n_threads);
+                }
+            } break;
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_NONE:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
 
-                    UNUSED(ne03);
-                    UNUSED(ne2);
+    *node_work_size = work_size;
 
-                    size_t cur = 0;
+    return n_tasks;
+}
 
-                    if (node->src[0]->type == GGML_TYPE_F16 &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur = sizeof(ggml_fp16_t)*(ne0*ne1*ew0);
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur = sizeof(float)*      (ne10*ne11*ne12);
-                    } else {
-                        GGML_ASSERT(false);
-                    }
+// gives the members of the step at node i threads of their own, if the cost model expects them to finish sooner side
+// by side than one after the other. the threads left after one per member go to the members that can be split, in
+// proportion to their cost
+static void ggml_graph_plan_step(const struct ggml_cgraph * cgraph, int * n_tasks, const int * steps, int n_threads, int i,
+        const struct ggml_cost_params * cost) {
+    const int n_step = MIN(MIN(steps[i], cgraph->n_nodes - i), MIN(n_threads, GGML_MAX_CONCURRENCY));
+    if (n_step <= 1) {
+        return;
+    }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    n_tasks = n_threads;
+    double cost_ns[GGML_MAX_CONCURRENCY];
+    bool   can_split[GGML_MAX_CONCURRENCY];
+    int    n_split[GGML_MAX_CONCURRENCY];
 
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+    double cost_split = 0.0;
+    double serial_ns  = 0.0;
+    int    m_max      = -1; // the costliest member that can be split
 
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+    for (int m = 0; m < n_step; ++m) {
+        struct ggml_tensor * node = cgraph->nodes[i + m];
+        if (node->op == GGML_OP_MAP_CUSTOM1 || node->op == GGML_OP_MAP_CUSTOM2 || node->op == GGML_OP_MAP_CUSTOM3) {
+            return;
+        }
 
-                    size_t cur = 0;
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+        size_t cur = 0;
+        cost_ns[m] = ggml_node_cost_ns(node, cost);
+        n_split[m] = 1;
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_POOL_1D:
-            case GGML_OP_POOL_2D:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_UPSCALE:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_FLASH_ATTN:
-                {
-                    n_tasks = n_threads;
+        serial_ns += n_tasks[i + m] > 1 ? cost_ns[m]/n_tasks[i + m] + (double) cost->sync_ns : cost_ns[m];
 
-                    size_t cur = 0;
+        can_split[m] = ggml_node_plan(node, n_threads, &cur) > 1;
+        if (can_split[m]) {
+            cost_split += cost_ns[m];
+            if (m_max < 0 || cost_ns[m] > cost_ns[m_max]) {
+                m_max = m;
+            }
+        }
+    }
 
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+    int n_left = n_threads - n_step;
+    if (n_left > 0) {
+        if (m_max < 0) {
+            return;
+        }
+        for (int m = 0; m < n_step && cost_split > 0.0; ++m) {
+            if (can_split[m]) {
+                const int n_extra = (int) ((double) (n_threads - n_step)*cost_ns[m]/cost_split);
+                n_split[m] += n_extra;
+                n_left     -= n_extra;
+            }
+        }
+        n_split[m_max] += n_left;
+    }
 
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    }
+    double step_ns = 0.0;
+    for (int m = 0; m < n_step; ++m) {
+        step_ns = MAX(step_ns, cost_ns[m]/n_split[m]);
+    }
+    step_ns += (double) cost->sync_ns;
 
-                    if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    }
+    if (step_ns < serial_ns) {
+        for (int m = 0; m < n_step; ++m) {
+            n_tasks[i + m] = n_split[m];
+        }
+    }
+}
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_FLASH_FF:
-                {
-                    n_tasks = n_threads;
+// the nodes of the chain at node i all run on the threads the cost model gives the whole chain, which splits into
+// blocks of rows whatever its ops
+static void ggml_graph_plan_chain(const struct ggml_cgraph * cgraph, int * n_tasks, int n_chain, int n_threads, int i,
+        const struct ggml_cost_params * cost) {
+    double cost_ns = 0.0;
+    for (int m = 0; m < n_chain; ++m) {
+        cost_ns += ggml_node_cost_ns(cgraph->nodes[i + m], cost);
+    }
 
-                    size_t cur = 0;
+    const bool split = n_threads > 1 && cost_ns*(1.0 - 1.0/n_threads) >= (double) cost->sync_ns;
 
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    }
+    const int n_chain_tasks = split ? n_threads : 1;
+    for (int m = 0; m < n_chain; ++m) {
+        n_tasks[i + m] = n_chain_tasks;
+    }
+}
 
-                    if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    }
+struct ggml_cplan ggml_graph_plan_concurrent(struct ggml_cgraph * cgraph, int n_threads, const int * steps,
+        struct ggml_step_member * members, const int * chains) {
+    GGML_ASSERT(steps == NULL || members != NULL);
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    n_tasks = n_threads;
+    if (n_threads <= 0) {
+        n_threads = GGML_DEFAULT_N_THREADS;
+    }
 
-                    size_t cur = 0;
+    size_t work_size = 0;
 
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
+    struct ggml_cplan cplan;
+    memset(&cplan, 0, sizeof(struct ggml_cplan));
 
-                    if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
+    const struct ggml_cost_params cost = ggml_get_cost_params();
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_WIN_PART:
-            case GGML_OP_WIN_UNPART:
-            case GGML_OP_GET_REL_POS:
-            case GGML_OP_MAP_UNARY:
-            case GGML_OP_MAP_BINARY:
-            case GGML_OP_MAP_CUSTOM1_F32:
-            case GGML_OP_MAP_CUSTOM2_F32:
-            case GGML_OP_MAP_CUSTOM3_F32:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_MAP_CUSTOM1:
-                {
-                    struct ggml_map_custom1_op_params * p = (struct ggml_map_custom1_op_params *) node->op_params;
-                    if (p->n_tasks == GGML_N_TASKS_MAX) {
-                        n_tasks = n_threads;
-                    } else {
-                        n_tasks = MIN(p->n_tasks, n_threads);
-                    }
-                } break;
-            case GGML_OP_MAP_CUSTOM2:
-                {
-                    struct ggml_map_custom2_op_params * p = (struct ggml_map_custom2_op_params *) node->op_params;
-                    if (p->n_tasks == GGML_N_TASKS_MAX) {
-                        n_tasks = n_threads;
-                    } else {
-                        n_tasks = MIN(p->n_tasks, n_threads);
-                    }
-                } break;
-            case GGML_OP_MAP_CUSTOM3:
-                {
-                    struct ggml_map_custom3_op_params * p = (struct ggml_map_custom3_op_params *) node->op_params;
-                    if (p->n_tasks == GGML_N_TASKS_MAX) {
-                        n_tasks = n_threads;
-                    } else {
-                        n_tasks = MIN(p->n_tasks, n_threads);
-                    }
-                } break;
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    n_tasks = n_threads;
+    // thread scheduling for the different operations + work buffer size estimation
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-                    size_t cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+        size_t cur = 0;
+        int n_tasks = ggml_node_plan(node, n_threads, &cur);
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_NONE:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ASSERT(false);
-                } break;
+        // custom ops ask for their number of tasks themselves
+        if (node->op != GGML_OP_MAP_CUSTOM1 && node->op != GGML_OP_MAP_CUSTOM2 && node->op != GGML_OP_MAP_CUSTOM3) {
+            n_tasks = ggml_node_n_tasks(node, n_tasks, &cost);
         }
 
         cplan.n_tasks[i] = n_tasks;
+        work_size = MAX(work_size, cur);
+    }
+
+    // the members of a step computed side by side each work in a part of the work data of their own
+    if (steps && n_threads > 1) {
+        for (int i = 0; i < cgraph->n_nodes; ) {
+            ggml_graph_plan_step(cgraph, cplan.n_tasks, steps, n_threads, i, &cost);
+
+            // the threads and the work data of the members, one after the other, so that computing the step only
+            // looks them up
+            const int n_step = ggml_graph_step_len(cgraph, cplan.n_tasks, steps, n_threads, i);
+            if (n_step > 1) {
+                int    ith = 0;
+                size_t cur = 0;
+                for (int m = 0; m < n_step; ++m) {
+                    size_t node_work_size = 0;
+                    ggml_node_plan(cgraph->nodes[i + m], n_threads, &node_work_size);
+                    members[i + m].ith       = ith;
+                    members[i + m].work_offs = cur;
+                    members[i + m].work_size = node_work_size;
+                    ith += cplan.n_tasks[i + m];
+                    cur += GGML_PAD(node_work_size, CACHE_LINE_SIZE);
+                }
+                work_size = MAX(work_size, cur);
+            }
+            i += n_step;
+        }
+    }
+
+    if (chains) {
+        for (int i = 0; i < cgraph->n_nodes; ) {
+            const int n_chain = MIN(MAX(chains[i], 1), cgraph->n_nodes - i);
+            if (n_chain > 1) {
+                ggml_graph_plan_chain(cgraph, cplan.n_tasks, n_chain, n_threads, i, &cost);
+            }
+            i += n_chain;
+        }
     }
 
     if (work_size > 0) {
@@ -17735,10 +18624,17 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
     cplan.n_threads = n_threads;
     cplan.work_size = work_size;
     cplan.work_data = NULL;
+    cplan.steps     = steps;
+    cplan.members   = members;
+    cplan.chains    = chains;
 
     return cplan;
 }
 
+struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
+    return ggml_graph_plan_concurrent(cgraph, n_threads, NULL, NULL, NULL);
+}
+
 int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
@@ -17753,6 +18649,10 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
                 GGML_ASSERT(cplan->n_tasks[i] > 0);
             }
         }
+
+        if (cplan->threadpool) {
+            GGML_ASSERT(cplan->n_threads <= cplan->threadpool->n_threads);
+        }
     }
 
     const int n_threads = cplan->n_threads;
@@ -17765,18 +18665,37 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         /*.n_threads               =*/ n_threads,
         /*.n_active                =*/ n_threads,
         /*.node_n                  =*/ -1,
+        /*.n_chunk                 =*/ { 0 },
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
     };
+    struct ggml_threadpool * threadpool = cplan->threadpool;
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
-    // create thread pool
-    if (n_threads > 1) {
+    // the calling thread computes as thread 0 of a pinned pool, on the cpu of that thread
+    ggml_cpu_set_t caller_cpus;
+    memset(&caller_cpus, 0, sizeof(caller_cpus));
+    const bool caller_pinned = threadpool && ggml_threadpool_pin(threadpool, 0, &caller_cpus);
+
+    if (threadpool) {
+        // post the graph to the workers of the pool
+        if (threadpool->n_threads > 1) {
+            threadpool->shared = &state_shared;
+            atomic_store(&threadpool->n_busy, threadpool->n_threads - 1);
+
+            pthread_mutex_lock(&threadpool->mutex);
+            atomic_fetch_add(&threadpool->n_graph, 1);
+            pthread_cond_broadcast(&threadpool->cond);
+            pthread_mutex_unlock(&threadpool->mutex);
+        }
+    } else if (n_threads > 1) {
+        // create thread pool
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .ith = j,
-                .shared = &state_shared,
+                .thrd       = 0,
+                .ith        = j,
+                .shared     = &state_shared,
+                .threadpool = NULL,
             };
 
             const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
@@ -17787,6 +18706,7 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
 
     workers[0].ith = 0;
     workers[0].shared = &state_shared;
+    workers[0].threadpool = threadpool;
 
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
@@ -17795,10 +18715,19 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
 
     // don't leave affinity set on the main thread
-    clear_numa_thread_affinity();
+    if (caller_pinned) {
+        ggml_thread_unpin(&caller_cpus);
+    } else if (!threadpool || !threadpool->cpus) {
+        clear_numa_thread_affinity();
+    }
 
-    // join or kill thread pool
-    if (n_threads > 1) {
+    if (threadpool) {
+        // the workers still read state_shared until they are done with the graph
+        while (atomic_load(&threadpool->n_busy) > 0) {
+            ggml_lock_lock(NULL);
+        }
+    } else if (n_threads > 1) {
+        // join or kill thread pool
         for (int j = 1; j < n_threads; j++) {
             const int rc = ggml_thread_join(workers[j].thrd, NULL);
             GGML_ASSERT(rc == 0);
@@ -17825,6 +18754,219 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     return compute_status;
 }
 
+// whether a node only gives another shape to the data of its source
+static bool ggml_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// whether a node reads or writes the memory of the tensor base
+static bool ggml_node_touches(const struct ggml_tensor * node, const struct ggml_tensor * base) {
+    if (node == base || node->view_src == base) {
+        return true;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        const struct ggml_tensor * src = node->src[i];
+        if (src && (src == base || src->view_src == base)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// whether one of two nodes writes in place to memory the other one uses
+static bool ggml_nodes_conflict(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    const struct ggml_tensor * dst_a = ggml_node_is_noop(a) ? NULL : a->view_src;
+    const struct ggml_tensor * dst_b = ggml_node_is_noop(b) ? NULL : b->view_src;
+
+    return (dst_a && ggml_node_touches(b, dst_a)) || (dst_b && ggml_node_touches(a, dst_b));
+}
+
+// whether node i can join the step being formed: none of the nodes before it that aren't placed in an earlier step yet
+// is a source of it or shares memory with it that one of the two writes in place
+static bool ggml_node_ready(struct ggml_tensor * const * nodes, const uint8_t * placed, int first, int i) {
+    const struct ggml_tensor * node = nodes[i];
+    for (int j = first; j < i; ++j) {
+        if (placed[j] == 2) {
+            continue;
+        }
+        for (int k = 0; k < GGML_MAX_SRC; ++k) {
+            if (node->src[k] == nodes[j]) {
+                return false;
+            }
+        }
+        if (ggml_nodes_conflict(node, nodes[j])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ggml_graph_find_concurrency(struct ggml_cgraph * cgraph, int * steps, int n_lookahead) {
+    const int n_nodes = cgraph->n_nodes;
+    if (n_nodes == 0) {
+        return;
+    }
+
+    struct ggml_tensor ** nodes = malloc(2*n_nodes*sizeof(struct ggml_tensor *));
+    struct ggml_tensor ** grads = nodes + n_nodes;
+    uint8_t * placed = calloc(n_nodes, 1); // 1: member of the step being formed, 2: member of an earlier step
+
+    memcpy(nodes, cgraph->nodes, n_nodes*sizeof(struct ggml_tensor *));
+    memcpy(grads, cgraph->grads, n_nodes*sizeof(struct ggml_tensor *));
+
+    int step[GGML_MAX_CONCURRENCY];
+    int first    = 0;
+    int n_placed = 0;
+
+    while (n_placed < n_nodes) {
+        while (placed[first] == 2) {
+            first++;
+        }
+
+        // the first pending node is always ready. the nodes that take no time are steps of their own, so that they
+        // don't hold a thread of a step
+        int n_step = 0;
+        for (int i = first, n_seen = 0; i < n_nodes && n_seen < MAX(1, n_lookahead) && n_step < GGML_MAX_CONCURRENCY; ++i) {
+            if (placed[i] == 2) {
+                continue;
+            }
+            n_seen++;
+
+            const bool noop = ggml_node_is_noop(nodes[i]);
+            if ((noop && n_step > 0) || !ggml_node_ready(nodes, placed, first, i)) {
+                continue;
+            }
+
+            placed[i] = 1;
+            step[n_step++] = i;
+
+            if (noop) {
+                break;
+            }
+        }
+
+        // costliest members first: with fewer threads than members, the nodes computed side by side are the front of
+        // the step. the costs are those of the default parameters, so that the order of the nodes, and with it the
+        // memory ggml-alloc gives them, is the same before and after the parameters are calibrated
+        for (int m = 1; m < n_step; ++m) {
+            const int i = step[m];
+            int k = m;
+            for (; k > 0 && ggml_node_cost_ns(nodes[step[k - 1]], &g_cost_params_default) <
+                            ggml_node_cost_ns(nodes[i], &g_cost_params_default); --k) {
+                step[k] = step[k - 1];
+            }
+            step[k] = i;
+        }
+
+        for (int m = 0; m < n_step; ++m) {
+            cgraph->nodes[n_placed] = nodes[step[m]];
+            cgraph->grads[n_placed] = grads[step[m]];
+            steps[n_placed] = n_step - m;
+            placed[step[m]] = 2;
+            n_placed++;
+        }
+    }
+
+    free(placed);
+    free(nodes);
+}
+
+// whether every row of the result of a node only depends on the same row of its inputs of the same shape, and on
+// inputs broadcast along the rows, so that it can be computed block of rows by block of rows
+static bool ggml_node_is_rowwise(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SCALE:
+        case GGML_OP_NORM:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_REPEAT:
+            break;
+        case GGML_OP_UNARY:
+            switch (ggml_get_unary_op(node)) {
+                case GGML_UNARY_OP_RELU:
+                case GGML_UNARY_OP_GELU:
+                case GGML_UNARY_OP_GELU_QUICK:
+                case GGML_UNARY_OP_SILU:
+                    break;
+                default:
+                    return false;
+            }
+            break;
+        default:
+            return false;
+    }
+
+    if (node->type != GGML_TYPE_F32 || !ggml_is_contiguous(node)) {
+        return false;
+    }
+
+    for (int j = 0; j < GGML_MAX_SRC && node->src[j]; ++j) {
+        const struct ggml_tensor * src = node->src[j];
+
+        const bool rows      = ggml_are_same_shape(src, node) && src->type == GGML_TYPE_F32 && ggml_is_contiguous(src);
+        const bool broadcast = src->ne[1] == 1 && src->ne[2] == 1 && src->ne[3] == 1;
+        if (!rows && !broadcast) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void ggml_graph_find_chains(const struct ggml_cgraph * cgraph, int * steps, int * chains) {
+    const int n_nodes = cgraph->n_nodes;
+
+    for (int i = 0; i < n_nodes; ++i) {
+        chains[i] = 1;
+    }
+
+    for (int i = 0; i < n_nodes; ) {
+        const struct ggml_tensor * first = cgraph->nodes[i];
+
+        int n_chain = 0;
+        while (i + n_chain < n_nodes && n_chain < GGML_MAX_CHAIN) {
+            const struct ggml_tensor * node = cgraph->nodes[i + n_chain];
+            if (!ggml_node_is_rowwise(node) || !ggml_are_same_shape(node, first)) {
+                break;
+            }
+            n_chain++;
+        }
+
+        if (n_chain < 2) {
+            i++;
+            continue;
+        }
+
+        for (int m = 0; m < n_chain; ++m) {
+            chains[i + m] = n_chain - m;
+        }
+
+        // the nodes of the chain leave the steps they were in, and the steps before them end where the chain starts
+        if (steps) {
+            for (int m = 0; m < n_chain; ++m) {
+                steps[i + m] = 1;
+            }
+            for (int k = i - 1; k >= 0 && k + steps[k] > i; --k) {
+                steps[k] = i - k;
+            }
+        }
+
+        i += n_chain;
+    }
+}
+
 void ggml_graph_reset(struct ggml_cgraph * cgraph) {
     for (int i = 0; i < cgraph->n_nodes; i++) {
         struct ggml_tensor * grad = cgraph->grads[i];
@@ -17845,6 +18987,98 @@ void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph *
     ggml_graph_compute(cgraph, &cplan);
 }
 
+// best of n_runs computes of a graph, in ns. n_tasks < 0 keeps the planned number of tasks of every node
+static double ggml_cost_time_graph(struct ggml_cgraph * gf, struct ggml_threadpool * threadpool, int n_tasks,
+        void * work_data, size_t work_size, int n_runs) {
+    struct ggml_cplan cplan = ggml_graph_plan(gf, threadpool ? threadpool->n_threads : 1);
+    GGML_ASSERT(cplan.work_size <= work_size);
+    cplan.work_data  = work_data;
+    cplan.threadpool = threadpool;
+    if (n_tasks > 0) {
+        for (int i = 0; i < gf->n_nodes; ++i) {
+            cplan.n_tasks[i] = n_tasks;
+        }
+    }
+
+    double best_ns = INFINITY;
+    for (int run = 0; run < n_runs; ++run) {
+        const int64_t t_start_us = ggml_time_us();
+        ggml_graph_compute(gf, &cplan);
+        best_ns = MIN(best_ns, 1e3*(ggml_time_us() - t_start_us));
+    }
+
+    return best_ns;
+}
+
+struct ggml_cost_params ggml_cost_calibrate(struct ggml_threadpool * threadpool) {
+    struct ggml_cost_params result = ggml_get_cost_params();
+
+    const int64_t n_k     = 256; // mul_mat of [n_k, n_k] x [n_k, n_cols]
+    const int64_t n_cols  = 64;
+    const int64_t n_copy  = 1 << 21;
+    const int     n_sync  = 256; // nodes of the sync graph
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 4*ggml_graph_overhead() + sizeof(float)*(2*n_copy + 2*n_k*n_k + 2*n_k*n_cols + 64*(n_sync + 2)) +
+                          64*ggml_tensor_overhead() + n_sync*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    if (!ctx) {
+        return result;
+    }
+
+    // work buffer of the f16 conversion of the mul_mat input
+    const size_t work_size = sizeof(float)*n_k*n_cols + CACHE_LINE_SIZE*GGML_DEFAULT_N_THREADS*8;
+    void * work_data = malloc(work_size);
+
+    // arithmetic: an f16 weight matrix times f32 activations, the bulk of a transformer
+    {
+        struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_k, n_k);
+        struct ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_k, n_cols);
+        ggml_set_f32(a, 0.5f);
+        ggml_set_f32(b, 0.25f);
+
+        struct ggml_cgraph gf = ggml_build_forward(ggml_mul_mat(ctx, a, b));
+        const double ns = ggml_cost_time_graph(&gf, NULL, 1, work_data, work_size, 5);
+        result.flops_per_ns = (float) (2.0*n_k*n_k*n_cols/ns);
+    }
+
+    // memory: a copy of a buffer larger than the caches
+    {
+        struct ggml_tensor * a = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_copy);
+        struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_copy);
+        ggml_set_f32(a, 1.0f);
+        ggml_set_f32(b, 0.0f);
+
+        struct ggml_cgraph gf = ggml_build_forward(ggml_cpy(ctx, a, b));
+        const double ns = ggml_cost_time_graph(&gf, NULL, 1, work_data, work_size, 5);
+        result.bytes_per_ns = (float) (2.0*ggml_nbytes(a)/ns);
+    }
+
+    // sync: a chain of tiny nodes, split across all threads and then on one thread
+    if (threadpool && threadpool->n_threads > 1) {
+        struct ggml_tensor * one = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 16);
+        struct ggml_tensor * cur = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 16);
+        ggml_set_f32(one, 1.0f);
+        ggml_set_f32(cur, 0.0f);
+        for (int i = 0; i < n_sync; ++i) {
+            cur = ggml_add_inplace(ctx, cur, one);
+        }
+
+        struct ggml_cgraph gf = ggml_build_forward(cur);
+        const double ns_split  = ggml_cost_time_graph(&gf, threadpool, threadpool->n_threads, work_data, work_size, 5);
+        const double ns_single = ggml_cost_time_graph(&gf, threadpool, 1, work_data, work_size, 5);
+        result.sync_ns = (float) MAX(0.0, (ns_split - ns_single)/gf.n_nodes);
+    }
+
+    free(work_data);
+    ggml_free(ctx);
+
+    return result;
+}
+
 struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name) {
     for (int i = 0; i < cgraph->n_leafs; i++) {
         struct ggml_tensor * leaf = cgraph->leafs[i];
@@ -19748,13 +20982,9 @@ struct gguf_context * gguf_init_empty(void) {
     return ctx;
 }
 
-struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params) {
-    FILE * file = fopen(fname, "rb");
-    if (!file) {
-        return NULL;
-    }
-
-    // offset from start of file
+// reads from the current position of file, which is closed on return
+static struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params) {
+    // offset from start of the gguf data
     size_t offset = 0;
 
     uint32_t magic = 0;
@@ -19944,7 +21174,7 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
 
         if (offset_pad != 0) {
             offset += ctx->alignment - offset_pad;
-            fseek(file, offset, SEEK_SET);
+            fseek(file, ctx->alignment - offset_pad, SEEK_CUR);
         }
     }
 
@@ -20064,6 +21294,34 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
     return ctx;
 }
 
+struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params) {
+    FILE * file = fopen(fname, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    return gguf_init_from_file_impl(file, params);
+}
+
+struct gguf_context * gguf_init_from_buffer(const void * data, size_t size, struct gguf_init_params params) {
+#if !defined(_WIN32)
+    FILE * file = fmemopen((void *)(uintptr_t) data, size, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    return gguf_init_from_file_impl(file, params);
+#else
+    fprintf(stderr, "%s: not supported on this platform\n", __func__);
+
+    UNUSED(data);
+    UNUSED(size);
+    UNUSED(params);
+
+    return NULL;
+#endif
+}
+
 void gguf_free(struct gguf_context * ctx) {
     if (ctx == NULL) {
         return;
@@ -30,8 +30,12 @@ struct EncodingResult {
 };
 
 
-EncodingResult clip_extract_vectors(
+// loads the model from model_path, or from [model_offset, model_offset + model_length) of model_fd when it is valid
+static EncodingResult clip_extract_vectors_impl(
     const std::string& model_path,
+    int model_fd,
+    long model_offset,
+    long model_length,
     const std::vector<std::string>& image_paths,
     const std::vector<std::string>& texts,
     int n_threads,
@@ -55,7 +59,7 @@ EncodingResult clip_extract_vectors(
         result.error_message = "Must provide at least 1 image path or text string";
         return result;
     }
-    if (model_path.empty()) {
+    if (model_fd < 0 && model_path.empty()) {
         result.error_message = "Model path cannot be empty";
         return result;
     }
@@ -64,9 +68,17 @@ EncodingResult clip_extract_vectors(
         n_threads = 1;
     }
 
-    auto ctx = clip_model_load(model_path.c_str(), verbose);
+    // only load the towers needed for the given inputs
+    clip_model_params model_params = clip_model_default_params();
+    model_params.verbosity = verbose;
+    model_params.load_text_encoder = !texts.empty();
+    model_params.load_vision_encoder = !image_paths.empty();
+
+    auto ctx = model_fd >= 0 ? clip_model_load_from_fd(model_fd, model_offset, model_length, model_params)
+                             : clip_model_load_with_params(model_path.c_str(), model_params);
     if (!ctx) {
-        result.error_message = "Unable to load model from " + model_path;
+        result.error_message = model_fd >= 0 ? "Unable to load model from fd " + std::to_string(model_fd)
+                                             : "Unable to load model from " + model_path;
         return result;
     }
     
@@ -220,3 +232,25 @@ EncodingResult clip_extract_vectors(
     result.success = true;
     return result;
 }
+
+EncodingResult clip_extract_vectors(
+    const std::string& model_path,
+    const std::vector<std::string>& image_paths,
+    const std::vector<std::string>& texts,
+    int n_threads,
+    int verbose
+) {
+    return clip_extract_vectors_impl(model_path, -1, 0, 0, image_paths, texts, n_threads, verbose);
+}
+
+EncodingResult clip_extract_vectors_from_fd(
+    int model_fd,
+    long model_offset,
+    long model_length,
+    const std::vector<std::string>& image_paths,
+    const std::vector<std::string>& texts,
+    int n_threads,
+    int verbose
+) {
+    return clip_extract_vectors_impl("", model_fd, model_offset, model_length, image_paths, texts, n_threads, verbose);
+}
@@ -44,6 +44,24 @@ EncodingResult clip_extract_vectors(
     int verbose
 );
 
+/**
+ * Same as clip_extract_vectors, but loads the model from a region of an open file instead of a path,
+ * e.g. an uncompressed asset opened with AssetManager.openFd(), so that it never has to be copied out of the APK
+ *
+ * @param model_fd File descriptor of the file containing the model
+ * @param model_offset Offset of the model in the file
+ * @param model_length Size of the model in bytes
+ */
+EncodingResult clip_extract_vectors_from_fd(
+    int model_fd,
+    long model_offset,
+    long model_length,
+    const std::vector<std::string>& image_paths,
+    const std::vector<std::string>& texts,
+    int n_threads,
+    int verbose
+);
+
 /**
  * Get all image files from a directory or validate a single image file
  * 
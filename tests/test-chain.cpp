@@ -0,0 +1,99 @@
+// add -> norm -> mul -> gelu with a scale and a shift broadcast along the rows, computed as a chain by
+// ggml_graph_find_chains() and node by node, on random shapes and thread counts. the results must be the same bit for
+// bit, and an operand broadcast along more than the rows must keep its node out of the chain
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "ggml/ggml.h"
+
+static void fill_random(struct ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-2.0f, 2.0f);
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); i++) {
+        data[i] = dist(rng);
+    }
+}
+
+// the result of the graph with or without its chains
+static std::vector<float> compute(struct ggml_cgraph * gf, const int n_threads, const int * chains) {
+    struct ggml_cplan cplan = ggml_graph_plan_concurrent(gf, n_threads, NULL, NULL, chains);
+    std::vector<uint8_t> work(cplan.work_size);
+    cplan.work_data = work.data();
+    ggml_graph_compute(gf, &cplan);
+
+    const struct ggml_tensor * out = gf->nodes[gf->n_nodes - 1];
+    const float * data = (const float *)out->data;
+    return std::vector<float>(data, data + ggml_nelements(out));
+}
+
+// whether the chained and the plain compute agree, and the chains are the ones expected. with shift_rows the shift
+// is broadcast along ne[2] and ne[3] only, so the add that takes it can't be part of the chain
+static bool run_case(const int64_t * ne, const int n_threads, const bool shift_rows, std::mt19937 & rng) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 64 * 1024 * 1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * a = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, ne[0], ne[1], ne[2], ne[3]);
+    struct ggml_tensor * b = shift_rows ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne[0], ne[1])
+                                        : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne[0]);
+    struct ggml_tensor * w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne[0]);
+    fill_random(a, rng);
+    fill_random(b, rng);
+    fill_random(w, rng);
+
+    struct ggml_tensor * out = ggml_gelu(ctx, ggml_mul(ctx, ggml_norm(ctx, ggml_add(ctx, a, b), 1e-5f), w));
+
+    struct ggml_cgraph gf = ggml_build_forward(out);
+    GGML_ASSERT(gf.n_nodes == 4);
+
+    std::vector<int> chains(gf.n_nodes);
+    ggml_graph_find_chains(&gf, NULL, chains.data());
+
+    // a shift of ne[1] rows repeated along ne[2] and ne[3] is only chained when it has a's shape or a single row
+    const bool add_chained = !shift_rows || ne[1] == 1 || (ne[2] == 1 && ne[3] == 1);
+    const int expected[2][4] = {{1, 3, 2, 1}, {4, 3, 2, 1}};
+
+    bool ok = memcmp(chains.data(), expected[add_chained], sizeof(expected[0])) == 0;
+    if (!ok) {
+        fprintf(stderr, "%s: chains %d %d %d %d\n", __func__, chains[0], chains[1], chains[2], chains[3]);
+    }
+
+    ok = compute(&gf, n_threads, chains.data()) == compute(&gf, n_threads, NULL) && ok;
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> dist_row(1, 300);
+    std::uniform_int_distribution<int> dist_dim(1, 5);
+
+    int n_failed = 0;
+    for (int i = 0; i < 64; i++) {
+        // enough rows for several blocks per thread, and short rows for the leftover elements of the simd loops
+        const int64_t ne[4] = {dist_row(rng), dist_dim(rng), dist_dim(rng), dist_dim(rng)};
+        const int n_threads = 1 + i % 4;
+        const bool shift_rows = i % 3 == 0;
+
+        if (!run_case(ne, n_threads, shift_rows, rng)) {
+            fprintf(stderr, "%s: [%lld, %lld, %lld, %lld]%s with %d threads: mismatch\n", __func__, (long long)ne[0],
+                    (long long)ne[1], (long long)ne[2], (long long)ne[3], shift_rows ? ", shift of ne[1] rows" : "",
+                    n_threads);
+            n_failed++;
+        }
+    }
+
+    printf("%s: %s\n", __func__, n_failed == 0 ? "ok" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
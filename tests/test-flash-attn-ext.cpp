@@ -0,0 +1,118 @@
+// ggml_flash_attn_ext() against soft_max(K*Q*scale) applied to V with the separate ops, on shapes that leave partial
+// blocks of queries and keys, on permuted views of the heads of a projection and on thread counts
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "ggml/ggml.h"
+
+static void fill_random(struct ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-2.0f, 2.0f);
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); i++) {
+        data[i] = dist(rng);
+    }
+}
+
+struct attn_case {
+    int64_t d;
+    int64_t d_v;
+    int64_t n_q;
+    int64_t n_kv;
+    int64_t n_head;
+    int64_t n_batch;
+    bool    permuted; // q, k and v are views of [d, n_head, n, n_batch] projections, like the heads of the towers
+};
+
+// q, k or v of a case: contiguous, or a permuted view of the heads of a projection
+static struct ggml_tensor * new_input(struct ggml_context * ctx, const int64_t d, const int64_t n, const attn_case & c,
+                                      std::mt19937 & rng) {
+    if (!c.permuted) {
+        struct ggml_tensor * t = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, d, n, c.n_head, c.n_batch);
+        fill_random(t, rng);
+        return t;
+    }
+
+    struct ggml_tensor * t = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, d, c.n_head, n, c.n_batch);
+    fill_random(t, rng);
+    return ggml_permute(ctx, t, 0, 2, 1, 3);
+}
+
+// largest difference between the fused op and the separate ops, relative to the magnitude of the expected value
+static double run_case(const attn_case & c, const int n_threads, std::mt19937 & rng) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 64 * 1024 * 1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * q = new_input(ctx, c.d,   c.n_q,  c, rng);
+    struct ggml_tensor * k = new_input(ctx, c.d,   c.n_kv, c, rng);
+    struct ggml_tensor * v = new_input(ctx, c.d_v, c.n_kv, c, rng);
+
+    const float scale = 1.0f / sqrtf((float)c.d);
+    struct ggml_tensor * fused = ggml_flash_attn_ext(ctx, q, k, v, scale);
+
+    // [n_kv, n_q, n_head, n_batch] scores, and [d_v, n_q, n_head, n_batch] results with the heads of a query moved
+    // side by side like those of the fused op
+    struct ggml_tensor * kq  = ggml_soft_max(ctx, ggml_scale(ctx, ggml_mul_mat(ctx, k, q), ggml_new_f32(ctx, scale)));
+    struct ggml_tensor * v_t = ggml_cont(ctx, ggml_permute(ctx, v, 1, 0, 2, 3));
+    struct ggml_tensor * ref = ggml_cont(ctx, ggml_permute(ctx, ggml_mul_mat(ctx, v_t, kq), 0, 2, 1, 3));
+
+    struct ggml_cgraph gf = ggml_build_forward(fused);
+    ggml_build_forward_expand(&gf, ref);
+    ggml_graph_compute_with_ctx(ctx, &gf, n_threads);
+
+    const float * x = ggml_get_data_f32(fused);
+    const float * y = ggml_get_data_f32(ref);
+
+    double max_err = 0.0;
+    for (int64_t i = 0; i < ggml_nelements(ref); i++) {
+        const double err = std::fabs((double)x[i] - y[i]) / std::max(1.0, std::fabs((double)y[i]));
+        max_err = std::isnan(err) ? INFINITY : std::max(max_err, err);
+    }
+
+    ggml_free(ctx);
+
+    return max_err;
+}
+
+int main(void) {
+    std::mt19937 rng(1234);
+
+    // the separate soft_max takes its exponentials from a table of fp16 inputs, the fused op computes them in full
+    // precision, which moves the results by about 5e-4 relative on these shapes
+    const double tolerance = 2e-3;
+
+    // the blocks of the op are 32 queries by 64 keys: single queries and keys, partial blocks of both, odd head sizes
+    // and values wider than the keys
+    const attn_case cases[] = {
+        {  8,  8,   1,   1, 1, 1, false},
+        { 16, 16,   1,  65, 2, 1, false},
+        {  7,  5,  33,  63, 3, 2, false},
+        { 64, 64,  50,  50, 4, 1, true },
+        { 32, 48,  97, 130, 2, 2, true },
+        { 13, 13, 257,   3, 1, 1, true },
+    };
+
+    int n_failed = 0;
+    for (const attn_case & c : cases) {
+        for (int n_threads = 1; n_threads <= 4; n_threads++) {
+            const double err = run_case(c, n_threads, rng);
+            if (!(err <= tolerance)) {
+                fprintf(stderr, "%s: d %lld, d_v %lld, n_q %lld, n_kv %lld, n_head %lld, n_batch %lld%s with %d "
+                        "threads: error %g\n", __func__, (long long)c.d, (long long)c.d_v, (long long)c.n_q,
+                        (long long)c.n_kv, (long long)c.n_head, (long long)c.n_batch, c.permuted ? ", permuted" : "",
+                        n_threads, err);
+                n_failed++;
+            }
+        }
+    }
+
+    printf("%s: %s\n", __func__, n_failed == 0 ? "ok" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+// ggml_norm_affine() against ggml_norm() followed by ggml_mul() and ggml_add() with the scale and shift broadcast
+// along the rows, on random shapes and thread counts
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "ggml/ggml.h"
+
+static void fill_random(struct ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-2.0f, 2.0f);
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); i++) {
+        data[i] = dist(rng);
+    }
+}
+
+// largest difference between the fused and the separate ops, relative to the magnitude of the expected value
+static double run_case(const int64_t * ne, const int n_threads, std::mt19937 & rng) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 64 * 1024 * 1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * a = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, ne[0], ne[1], ne[2], ne[3]);
+    struct ggml_tensor * w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne[0]);
+    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne[0]);
+    fill_random(a, rng);
+    fill_random(w, rng);
+    fill_random(b, rng);
+
+    const float eps = 1e-5f;
+    struct ggml_tensor * fused = ggml_norm_affine(ctx, a, w, b, eps);
+    struct ggml_tensor * ref   = ggml_add(ctx, ggml_mul(ctx, ggml_norm(ctx, a, eps), w), b);
+
+    struct ggml_cgraph gf = ggml_build_forward(fused);
+    ggml_build_forward_expand(&gf, ref);
+    ggml_graph_compute_with_ctx(ctx, &gf, n_threads);
+
+    const float * x = ggml_get_data_f32(fused);
+    const float * y = ggml_get_data_f32(ref);
+
+    double max_err = 0.0;
+    for (int64_t i = 0; i < ggml_nelements(ref); i++) {
+        const double err = std::fabs((double)x[i] - y[i]) / std::max(1.0, std::fabs((double)y[i]));
+        max_err = std::isnan(err) ? INFINITY : std::max(max_err, err);
+    }
+
+    ggml_free(ctx);
+
+    return max_err;
+}
+
+int main(void) {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> dist_row(1, 300);
+    std::uniform_int_distribution<int> dist_dim(1, 5);
+
+    // the fused op rounds the scale and shift once with fma where the separate ops round twice
+    const double tolerance = 1e-5;
+
+    int n_failed = 0;
+    for (int i = 0; i < 64; i++) {
+        // short rows hit the leftover elements of the simd loop, several rows and batches the broadcast
+        const int64_t ne[4] = {dist_row(rng), dist_dim(rng), dist_dim(rng), dist_dim(rng)};
+        const int n_threads = 1 + i % 4;
+
+        const double err = run_case(ne, n_threads, rng);
+        if (!(err <= tolerance)) {
+            fprintf(stderr, "%s: [%lld, %lld, %lld, %lld] with %d threads: error %g\n", __func__, (long long)ne[0],
+                    (long long)ne[1], (long long)ne[2], (long long)ne[3], n_threads, err);
+            n_failed++;
+        }
+    }
+
+    printf("%s: %s\n", __func__, n_failed == 0 ? "ok" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}